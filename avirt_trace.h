@@ -0,0 +1,197 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * AVIRT - ALSA Virtual Soundcard
+ *
+ * Copyright (c) 2010-2018 Fiberdyne Systems Pty Ltd
+ *
+ * avirt_trace.h - AVIRT PCM tracepoints
+ *
+ * Every event names its substream as pcmC<card>D<device><p|c>:<number>, and
+ * carries a position and a byte count, both in bytes. The position is an
+ * offset into the substream's buffer.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM avirt
+
+#if !defined(_AVIRT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AVIRT_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <sound/pcm.h>
+
+#define AVIRT_PCM_ENTRY                                                        \
+	__field(int, card)                                                     \
+	__field(int, device)                                                   \
+	__field(int, stream)                                                   \
+	__field(int, number)                                                   \
+	__field(unsigned long, pos)                                            \
+	__field(unsigned long, bytes)
+
+#define AVIRT_PCM_ASSIGN(substream)                                            \
+	do {                                                                   \
+		__entry->card = (substream)->pcm->card->number;                \
+		__entry->device = (substream)->pcm->device;                    \
+		__entry->stream = (substream)->stream;                         \
+		__entry->number = (substream)->number;                         \
+	} while (0)
+
+#define AVIRT_PCM_FMT "pcmC%dD%d%c:%d pos=%lu bytes=%lu"
+
+#define AVIRT_PCM_ARGS                                                         \
+	__entry->card, __entry->device, __entry->stream ? 'c' : 'p',           \
+		__entry->number, __entry->pos, __entry->bytes
+
+/* Offset of a boundary wrapped frame position into the buffer, in bytes */
+#define AVIRT_PCM_BUF_POS(runtime, frames)                                     \
+	frames_to_bytes(runtime, (frames) % (runtime)->buffer_size)
+
+/* A substream is opened */
+TRACE_EVENT(avirt_pcm_open,
+	TP_PROTO(struct snd_pcm_substream *substream),
+	TP_ARGS(substream),
+	TP_STRUCT__entry(AVIRT_PCM_ENTRY),
+	TP_fast_assign(
+		AVIRT_PCM_ASSIGN(substream);
+		__entry->pos = 0;
+		__entry->bytes = 0;
+	),
+	TP_printk(AVIRT_PCM_FMT, AVIRT_PCM_ARGS)
+);
+
+/* The buffer and period sizes are set, bytes is the buffer size */
+TRACE_EVENT(avirt_pcm_hw_params,
+	TP_PROTO(struct snd_pcm_substream *substream,
+		 struct snd_pcm_hw_params *params),
+	TP_ARGS(substream, params),
+	TP_STRUCT__entry(
+		AVIRT_PCM_ENTRY
+		__field(unsigned int, rate)
+		__field(unsigned int, channels)
+		__field(unsigned int, period_bytes)
+	),
+	TP_fast_assign(
+		AVIRT_PCM_ASSIGN(substream);
+		__entry->pos = 0;
+		__entry->bytes = params_buffer_bytes(params);
+		__entry->rate = params_rate(params);
+		__entry->channels = params_channels(params);
+		__entry->period_bytes = params_period_bytes(params);
+	),
+	TP_printk(AVIRT_PCM_FMT " rate=%u channels=%u period_bytes=%u",
+		  AVIRT_PCM_ARGS, __entry->rate, __entry->channels,
+		  __entry->period_bytes)
+);
+
+/* The substream is started or stopped, at the last hardware position */
+TRACE_EVENT(avirt_pcm_trigger,
+	TP_PROTO(struct snd_pcm_substream *substream, int cmd),
+	TP_ARGS(substream, cmd),
+	TP_STRUCT__entry(
+		AVIRT_PCM_ENTRY
+		__field(int, cmd)
+	),
+	TP_fast_assign(
+		AVIRT_PCM_ASSIGN(substream);
+		__entry->pos = AVIRT_PCM_BUF_POS(
+			substream->runtime, substream->runtime->status->hw_ptr);
+		__entry->bytes = 0;
+		__entry->cmd = cmd;
+	),
+	TP_printk(AVIRT_PCM_FMT " cmd=%d", AVIRT_PCM_ARGS, __entry->cmd)
+);
+
+/*
+ * The hardware position is queried, bytes is how far it moved since the
+ * previous query
+ */
+TRACE_EVENT(avirt_pcm_pointer,
+	TP_PROTO(struct snd_pcm_substream *substream, snd_pcm_uframes_t pos),
+	TP_ARGS(substream, pos),
+	TP_STRUCT__entry(AVIRT_PCM_ENTRY),
+	TP_fast_assign(
+		AVIRT_PCM_ASSIGN(substream);
+		__entry->pos = frames_to_bytes(substream->runtime, pos);
+		__entry->bytes = AVIRT_PCM_BUF_POS(substream->runtime,
+			pos + substream->runtime->buffer_size -
+			substream->runtime->status->hw_ptr %
+				substream->runtime->buffer_size);
+	),
+	TP_printk(AVIRT_PCM_FMT, AVIRT_PCM_ARGS)
+);
+
+/*
+ * The application position is updated, bytes is how far it is ahead of the
+ * hardware position
+ */
+TRACE_EVENT(avirt_pcm_ack,
+	TP_PROTO(struct snd_pcm_substream *substream),
+	TP_ARGS(substream),
+	TP_STRUCT__entry(AVIRT_PCM_ENTRY),
+	TP_fast_assign(
+		AVIRT_PCM_ASSIGN(substream);
+		__entry->pos = AVIRT_PCM_BUF_POS(
+			substream->runtime,
+			substream->runtime->control->appl_ptr);
+		__entry->bytes = frames_to_bytes(substream->runtime,
+			(substream->runtime->control->appl_ptr +
+			 substream->runtime->boundary -
+			 substream->runtime->status->hw_ptr) %
+				substream->runtime->boundary);
+	),
+	TP_printk(AVIRT_PCM_FMT, AVIRT_PCM_ARGS)
+);
+
+DECLARE_EVENT_CLASS(avirt_pcm_copy,
+	TP_PROTO(struct snd_pcm_substream *substream, unsigned long pos,
+		 unsigned long bytes),
+	TP_ARGS(substream, pos, bytes),
+	TP_STRUCT__entry(AVIRT_PCM_ENTRY),
+	TP_fast_assign(
+		AVIRT_PCM_ASSIGN(substream);
+		__entry->pos = pos;
+		__entry->bytes = bytes;
+	),
+	TP_printk(AVIRT_PCM_FMT, AVIRT_PCM_ARGS)
+);
+
+/* Audio is copied between the buffer and user space */
+DEFINE_EVENT(avirt_pcm_copy, avirt_pcm_copy_user,
+	TP_PROTO(struct snd_pcm_substream *substream, unsigned long pos,
+		 unsigned long bytes),
+	TP_ARGS(substream, pos, bytes)
+);
+
+/* Audio is copied between the buffer and the kernel */
+DEFINE_EVENT(avirt_pcm_copy, avirt_pcm_copy_kernel,
+	TP_PROTO(struct snd_pcm_substream *substream, unsigned long pos,
+		 unsigned long bytes),
+	TP_ARGS(substream, pos, bytes)
+);
+
+/*
+ * An Audio Path reports a period boundary, at the last hardware position, and
+ * bytes is the period size
+ */
+TRACE_EVENT(avirt_pcm_period_elapsed,
+	TP_PROTO(struct snd_pcm_substream *substream),
+	TP_ARGS(substream),
+	TP_STRUCT__entry(AVIRT_PCM_ENTRY),
+	TP_fast_assign(
+		AVIRT_PCM_ASSIGN(substream);
+		__entry->pos = AVIRT_PCM_BUF_POS(
+			substream->runtime, substream->runtime->status->hw_ptr);
+		__entry->bytes = frames_to_bytes(substream->runtime,
+						 substream->runtime->period_size);
+	),
+	TP_printk(AVIRT_PCM_FMT, AVIRT_PCM_ARGS)
+);
+
+#endif /* _AVIRT_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE avirt_trace
+
+#include <trace/define_trace.h>
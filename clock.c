@@ -0,0 +1,235 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * AVIRT - ALSA Virtual Soundcard
+ *
+ * Copyright (c) 2010-2018 Fiberdyne Systems Pty Ltd
+ *
+ * clock.c - AVIRT shared master clock
+ */
+
+#include <linux/slab.h>
+#include <linux/hrtimer.h>
+
+#include "core.h"
+
+#define D_LOGNAME "clock"
+
+#define D_INFOK(fmt, args...) DINFO(D_LOGNAME, fmt, ##args)
+#define D_PRINTK(fmt, args...) DDEBUG(D_LOGNAME, fmt, ##args)
+#define D_ERRORK(fmt, args...) DERROR(D_LOGNAME, fmt, ##args)
+
+/**
+ * struct snd_avirt_clock_class - A periodic tick shared by all streams of a class
+ * @list: Entry in clock_list
+ * @period_ns: Tick period, identifies the rate/period class
+ * @users: Number of attached clients, protected by clock_mutex
+ * @lock: Protects the fields below
+ * @clients: Started clients
+ * @last: Expiry time of the last processed tick
+ * @armed: The timer is queued, or its callback will re-queue it
+ * @timer: The tick timer
+ */
+struct snd_avirt_clock_class {
+	struct list_head list;
+	u64 period_ns;
+	unsigned int users;
+	spinlock_t lock;
+	struct list_head clients;
+	ktime_t last;
+	bool armed;
+	struct hrtimer timer;
+};
+
+static LIST_HEAD(clock_list);
+static DEFINE_MUTEX(clock_mutex);
+
+/**
+ * snd_avirt_clock_tick - Tick callback of a shared clock
+ * @timer: The clock's hrtimer
+ *
+ * Ticks every started client, then notifies all clients that crossed a period
+ * boundary in one batch. The notifications are sent outside of the clock lock,
+ * as the ALSA middle layer may stop the stream (and thus the client) from
+ * within snd_pcm_period_elapsed().
+ */
+static enum hrtimer_restart snd_avirt_clock_tick(struct hrtimer *timer)
+{
+	struct snd_avirt_clock_class *clock =
+		container_of(timer, struct snd_avirt_clock_class, timer);
+	struct snd_avirt_clock_client *client, *tmp;
+	enum hrtimer_restart restart = HRTIMER_RESTART;
+	LIST_HEAD(due);
+
+	spin_lock(&clock->lock);
+	clock->last = hrtimer_get_expires(timer);
+	list_for_each_entry(client, &clock->clients, list) {
+		if (client->tick(client))
+			list_add_tail(&client->due, &due);
+	}
+	spin_unlock(&clock->lock);
+
+	list_for_each_entry_safe(client, tmp, &due, due) {
+		list_del_init(&client->due);
+		snd_avirt_pcm_period_elapsed(client->substream);
+	}
+
+	spin_lock(&clock->lock);
+	if (list_empty(&clock->clients)) {
+		clock->armed = false;
+		restart = HRTIMER_NORESTART;
+	} else {
+		hrtimer_forward_now(timer, ns_to_ktime(clock->period_ns));
+	}
+	spin_unlock(&clock->lock);
+
+	return restart;
+}
+
+/**
+ * snd_avirt_clock_attach - Attach a client to the clock of its period class
+ * @client: The client to attach
+ * @period_ns: The client's period time, in nanoseconds
+ * @return: 0 on success, negative ERRNO on failure
+ *
+ * A client that is already attached to another class is moved. May sleep.
+ */
+int snd_avirt_clock_attach(struct snd_avirt_clock_client *client,
+			   u64 period_ns)
+{
+	struct snd_avirt_clock_class *clock;
+
+	if (!period_ns)
+		return -EINVAL;
+
+	if (client->clock) {
+		if (client->clock->period_ns == period_ns)
+			return 0;
+		snd_avirt_clock_detach(client);
+	}
+
+	mutex_lock(&clock_mutex);
+	list_for_each_entry(clock, &clock_list, list) {
+		if (clock->period_ns == period_ns)
+			goto attach;
+	}
+
+	clock = kzalloc(sizeof(*clock), GFP_KERNEL);
+	if (!clock) {
+		mutex_unlock(&clock_mutex);
+		return -ENOMEM;
+	}
+	clock->period_ns = period_ns;
+	spin_lock_init(&clock->lock);
+	INIT_LIST_HEAD(&clock->clients);
+	hrtimer_init(&clock->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	clock->timer.function = snd_avirt_clock_tick;
+	list_add_tail(&clock->list, &clock_list);
+	D_PRINTK("new clock class: %llu ns", period_ns);
+
+attach:
+	clock->users++;
+	client->clock = clock;
+	INIT_LIST_HEAD(&client->list);
+	INIT_LIST_HEAD(&client->due);
+	mutex_unlock(&clock_mutex);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(snd_avirt_clock_attach);
+
+/**
+ * snd_avirt_clock_detach - Detach a client from its clock
+ * @client: The client to detach
+ *
+ * Stops the client if needed, and waits for any tick still notifying it.
+ * The clock is freed once its last client is detached. May sleep.
+ */
+void snd_avirt_clock_detach(struct snd_avirt_clock_client *client)
+{
+	struct snd_avirt_clock_class *clock = client->clock;
+
+	if (!clock)
+		return;
+
+	snd_avirt_clock_stop(client);
+
+	mutex_lock(&clock_mutex);
+	/* Synchronise with a tick that may hold this client on its due list */
+	hrtimer_cancel(&clock->timer);
+	spin_lock_irq(&clock->lock);
+	if (list_empty(&clock->clients))
+		clock->armed = false;
+	else
+		hrtimer_start(&clock->timer,
+			      ktime_add_ns(clock->last, clock->period_ns),
+			      HRTIMER_MODE_ABS);
+	spin_unlock_irq(&clock->lock);
+
+	client->clock = NULL;
+	if (!--clock->users) {
+		D_PRINTK("free clock class: %llu ns", clock->period_ns);
+		list_del(&clock->list);
+		kfree(clock);
+	}
+	mutex_unlock(&clock_mutex);
+}
+EXPORT_SYMBOL_GPL(snd_avirt_clock_detach);
+
+/**
+ * snd_avirt_clock_start - Start delivering ticks to a client
+ * @client: The attached client to start
+ * @return: The time origin of the client's first period, in ktime nanoseconds
+ *
+ * The returned origin is the current time, so that the client starts with a
+ * full period. Its period boundaries then fall between the clock's ticks, and
+ * are each reported on the tick that follows them: the client's tick callback
+ * must check its position, rather than count ticks. Safe to call from atomic
+ * context.
+ */
+u64 snd_avirt_clock_start(struct snd_avirt_clock_client *client)
+{
+	struct snd_avirt_clock_class *clock = client->clock;
+	unsigned long flags;
+	u64 origin;
+
+	spin_lock_irqsave(&clock->lock, flags);
+	origin = ktime_get_ns();
+	if (!clock->armed) {
+		clock->last = ns_to_ktime(origin);
+		hrtimer_start(&clock->timer,
+			      ktime_add_ns(clock->last, clock->period_ns),
+			      HRTIMER_MODE_ABS);
+		clock->armed = true;
+	}
+	if (list_empty(&client->list))
+		list_add_tail(&client->list, &clock->clients);
+	spin_unlock_irqrestore(&clock->lock, flags);
+
+	return origin;
+}
+EXPORT_SYMBOL_GPL(snd_avirt_clock_start);
+
+/**
+ * snd_avirt_clock_stop - Stop delivering ticks to a client
+ * @client: The client to stop
+ *
+ * The clock's timer is stopped along with its last started client. Safe to
+ * call from atomic context, including from within snd_pcm_period_elapsed().
+ */
+void snd_avirt_clock_stop(struct snd_avirt_clock_client *client)
+{
+	struct snd_avirt_clock_class *clock = client->clock;
+	unsigned long flags;
+
+	if (!clock)
+		return;
+
+	spin_lock_irqsave(&clock->lock, flags);
+	list_del_init(&client->list);
+	/* If the tick is running, it will not re-arm itself */
+	if (list_empty(&clock->clients) &&
+	    hrtimer_try_to_cancel(&clock->timer) >= 0)
+		clock->armed = false;
+	spin_unlock_irqrestore(&clock->lock, flags);
+}
+EXPORT_SYMBOL_GPL(snd_avirt_clock_stop);
@@ -46,6 +46,10 @@ static ssize_t cfg_snd_avirt_stream_map_store(struct config_item *item,
 	struct snd_avirt_stream *stream =
 		snd_avirt_stream_from_config_item(item);
 
+	// Stream attributes are applied when sealing, and fixed after
+	if (snd_avirt_streams_sealed())
+		return -EPERM;
+
 	split = strsep((char **)&page, "\n");
 	memcpy(stream->map, (char *)split, count);
 
@@ -75,6 +79,9 @@ static ssize_t cfg_snd_avirt_stream_channels_store(struct config_item *item,
 	unsigned long tmp;
 	char *p = (char *)page;
 
+	if (snd_avirt_streams_sealed())
+		return -EPERM;
+
 	err = kstrtoul(p, 10, &tmp);
 	if (err < 0)
 		return err;
@@ -88,17 +95,356 @@ static ssize_t cfg_snd_avirt_stream_channels_store(struct config_item *item,
 }
 CONFIGFS_ATTR(cfg_snd_avirt_stream_, channels);
 
+static const char *const cfg_snd_avirt_clock_names[] = {
+	[SND_AVIRT_CLOCK_SYSTIMER] = "systimer",
+	[SND_AVIRT_CLOCK_HRTIMER] = "hrtimer",
+	[SND_AVIRT_CLOCK_SHARED] = "shared",
+};
+
+static ssize_t cfg_snd_avirt_stream_clock_show(struct config_item *item,
+					       char *page)
+{
+	struct snd_avirt_stream *stream =
+		snd_avirt_stream_from_config_item(item);
+
+	return sprintf(page, "%s\n", cfg_snd_avirt_clock_names[stream->clock]);
+}
+
+static ssize_t cfg_snd_avirt_stream_clock_store(struct config_item *item,
+						const char *page, size_t count)
+{
+	int clock;
+	struct snd_avirt_stream *stream =
+		snd_avirt_stream_from_config_item(item);
+
+	if (snd_avirt_streams_sealed())
+		return -EPERM;
+
+	clock = sysfs_match_string(cfg_snd_avirt_clock_names, page);
+	if (clock < 0) {
+		D_ERRORK("Stream clock: '%s' invalid!", page);
+		return clock;
+	}
+
+	stream->clock = clock;
+
+	return count;
+}
+CONFIGFS_ATTR(cfg_snd_avirt_stream_, clock);
+
+static const char *const cfg_snd_avirt_src_names[] = {
+	[SND_AVIRT_SRC_NONE] = "none",
+	[SND_AVIRT_SRC_LINEAR] = "linear",
+	[SND_AVIRT_SRC_POLYPHASE] = "polyphase",
+};
+
+static ssize_t cfg_snd_avirt_stream_src_show(struct config_item *item,
+					     char *page)
+{
+	struct snd_avirt_stream *stream =
+		snd_avirt_stream_from_config_item(item);
+
+	return sprintf(page, "%s\n", cfg_snd_avirt_src_names[stream->src]);
+}
+
+static ssize_t cfg_snd_avirt_stream_src_store(struct config_item *item,
+					      const char *page, size_t count)
+{
+	int src;
+	struct snd_avirt_stream *stream =
+		snd_avirt_stream_from_config_item(item);
+
+	if (snd_avirt_streams_sealed())
+		return -EPERM;
+
+	src = sysfs_match_string(cfg_snd_avirt_src_names, page);
+	if (src < 0) {
+		D_ERRORK("Stream src: '%s' invalid!", page);
+		return src;
+	}
+
+	stream->src = src;
+
+	return count;
+}
+CONFIGFS_ATTR(cfg_snd_avirt_stream_, src);
+
+static const char *const cfg_snd_avirt_buffer_names[] = {
+	[SND_AVIRT_BUFFER_DEFAULT] = "default",
+	[SND_AVIRT_BUFFER_VMALLOC] = "vmalloc",
+	[SND_AVIRT_BUFFER_CONTIG] = "contig",
+};
+
+static ssize_t cfg_snd_avirt_stream_buffer_show(struct config_item *item,
+						char *page)
+{
+	struct snd_avirt_stream *stream =
+		snd_avirt_stream_from_config_item(item);
+
+	return sprintf(page, "%s\n",
+		       cfg_snd_avirt_buffer_names[stream->buffer]);
+}
+
+static ssize_t cfg_snd_avirt_stream_buffer_store(struct config_item *item,
+						 const char *page, size_t count)
+{
+	int buffer;
+	struct snd_avirt_stream *stream =
+		snd_avirt_stream_from_config_item(item);
+
+	if (snd_avirt_streams_sealed())
+		return -EPERM;
+
+	buffer = sysfs_match_string(cfg_snd_avirt_buffer_names, page);
+	if (buffer < 0) {
+		D_ERRORK("Stream buffer: '%s' invalid!", page);
+		return buffer;
+	}
+
+	stream->buffer = buffer;
+
+	return count;
+}
+CONFIGFS_ATTR(cfg_snd_avirt_stream_, buffer);
+
+static ssize_t cfg_snd_avirt_stream_readers_show(struct config_item *item,
+						 char *page)
+{
+	struct snd_avirt_stream *stream =
+		snd_avirt_stream_from_config_item(item);
+
+	return sprintf(page, "%d\n", stream->readers);
+}
+
+static ssize_t cfg_snd_avirt_stream_readers_store(struct config_item *item,
+						  const char *page,
+						  size_t count)
+{
+	int err;
+	struct snd_avirt_stream *stream =
+		snd_avirt_stream_from_config_item(item);
+	unsigned long tmp;
+	char *p = (char *)page;
+
+	if (snd_avirt_streams_sealed())
+		return -EPERM;
+
+	err = kstrtoul(p, 10, &tmp);
+	if (err < 0)
+		return err;
+
+	if (tmp < 1 || tmp > MAX_READERS)
+		return -ERANGE;
+
+	stream->readers = tmp;
+
+	return count;
+}
+CONFIGFS_ATTR(cfg_snd_avirt_stream_, readers);
+
+static ssize_t cfg_snd_avirt_stream_gain_show(struct config_item *item,
+					      char *page)
+{
+	struct snd_avirt_stream *stream =
+		snd_avirt_stream_from_config_item(item);
+
+	return sprintf(page, "%d\n", stream->gain);
+}
+
+static ssize_t cfg_snd_avirt_stream_gain_store(struct config_item *item,
+					       const char *page, size_t count)
+{
+	int err;
+	struct snd_avirt_stream *stream =
+		snd_avirt_stream_from_config_item(item);
+	unsigned long tmp;
+	char *p = (char *)page;
+
+	if (snd_avirt_streams_sealed())
+		return -EPERM;
+
+	err = kstrtoul(p, 10, &tmp);
+	if (err < 0)
+		return err;
+
+	if (tmp > SND_AVIRT_GAIN_UNITY)
+		return -ERANGE;
+
+	stream->gain = tmp;
+
+	return count;
+}
+CONFIGFS_ATTR(cfg_snd_avirt_stream_, gain);
+
+static ssize_t cfg_snd_avirt_stream_route_show(struct config_item *item,
+					       char *page)
+{
+	struct snd_avirt_stream *stream =
+		snd_avirt_stream_from_config_item(item);
+	struct snd_avirt_route_entry *e;
+	ssize_t count = 0;
+	unsigned int i;
+
+	if (!stream->route.count)
+		return sprintf(page, "none\n");
+	for (i = 0; i < stream->route.count; i++) {
+		e = &stream->route.map[i];
+		count += sprintf(page + count, "%s%u=%u*%d", i ? " " : "",
+				 e->dst, e->src, e->coef);
+	}
+	count += sprintf(page + count, "\n");
+
+	return count;
+}
+
+/*
+ * Parse one "dst=src" or "dst=src*coef" route, the coefficient defaults to
+ * unity
+ */
+static int cfg_snd_avirt_route_parse(char *tok,
+				     struct snd_avirt_route_entry *e)
+{
+	char *dst, *src;
+	int err;
+
+	dst = strsep(&tok, "=");
+	src = strsep(&tok, "*");
+	if (!src)
+		return -EINVAL;
+	err = kstrtouint(dst, 10, &e->dst);
+	if (err < 0)
+		return err;
+	err = kstrtouint(src, 10, &e->src);
+	if (err < 0)
+		return err;
+	e->coef = SND_AVIRT_GAIN_UNITY;
+	if (tok) {
+		err = kstrtoint(tok, 10, &e->coef);
+		if (err < 0)
+			return err;
+	}
+	if (e->dst >= SND_AVIRT_ROUTE_CHANNELS_MAX ||
+	    e->src >= SND_AVIRT_ROUTE_CHANNELS_MAX ||
+	    e->coef > SND_AVIRT_GAIN_UNITY || e->coef < -SND_AVIRT_GAIN_UNITY)
+		return -ERANGE;
+
+	return 0;
+}
+
+static ssize_t cfg_snd_avirt_stream_route_store(struct config_item *item,
+						const char *page, size_t count)
+{
+	struct snd_avirt_stream *stream =
+		snd_avirt_stream_from_config_item(item);
+	struct snd_avirt_route *route;
+	char *buf, *p, *tok;
+	int err = 0;
+
+	// The capture channel count follows the routes
+	if (snd_avirt_streams_sealed())
+		return -EPERM;
+
+	route = kzalloc(sizeof(*route), GFP_KERNEL);
+	buf = kstrndup(page, count, GFP_KERNEL);
+	if (!route || !buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	p = strim(buf);
+	if (!strcmp(p, "none"))
+		p = "";
+	while ((tok = strsep(&p, " ,\n")) != NULL) {
+		if (!*tok)
+			continue;
+		if (route->count == SND_AVIRT_ROUTES_MAX) {
+			err = -E2BIG;
+			goto out;
+		}
+		err = cfg_snd_avirt_route_parse(tok,
+						&route->map[route->count]);
+		if (err < 0)
+			goto out;
+		route->channels = max(route->channels,
+				      route->map[route->count].dst + 1);
+		route->count++;
+	}
+
+	stream->route = *route;
+out:
+	kfree(buf);
+	kfree(route);
+	return err < 0 ? err : count;
+}
+CONFIGFS_ATTR(cfg_snd_avirt_stream_, route);
+
+/*
+ * Bytes of PCM buffer memory held by the stream, and the part of it in use
+ * by the substreams currently set up
+ */
+static void cfg_snd_avirt_stream_buffers(struct snd_avirt_stream *stream,
+					 size_t *allocated, size_t *used)
+{
+	unsigned int i;
+
+	*allocated = 0;
+	*used = 0;
+	if (!stream->buffers)
+		return;
+	for (i = 0; i < stream->buffers->count; i++) {
+		*allocated += READ_ONCE(stream->buffers->buf[i].bytes);
+		*used += READ_ONCE(stream->buffers->buf[i].used);
+	}
+}
+
+static ssize_t cfg_snd_avirt_stream_buffer_allocated_show(
+	struct config_item *item, char *page)
+{
+	size_t allocated, used;
+
+	cfg_snd_avirt_stream_buffers(snd_avirt_stream_from_config_item(item),
+				     &allocated, &used);
+
+	return sprintf(page, "%zu\n", allocated);
+}
+CONFIGFS_ATTR_RO(cfg_snd_avirt_stream_, buffer_allocated);
+
+static ssize_t cfg_snd_avirt_stream_buffer_used_show(struct config_item *item,
+						     char *page)
+{
+	size_t allocated, used;
+
+	cfg_snd_avirt_stream_buffers(snd_avirt_stream_from_config_item(item),
+				     &allocated, &used);
+
+	return sprintf(page, "%zu\n", used);
+}
+CONFIGFS_ATTR_RO(cfg_snd_avirt_stream_, buffer_used);
+
 static struct configfs_attribute *cfg_snd_avirt_stream_attrs[] = {
+	&cfg_snd_avirt_stream_attr_buffer,
+	&cfg_snd_avirt_stream_attr_buffer_allocated,
+	&cfg_snd_avirt_stream_attr_buffer_used,
 	&cfg_snd_avirt_stream_attr_channels,
+	&cfg_snd_avirt_stream_attr_clock,
+	&cfg_snd_avirt_stream_attr_gain,
 	&cfg_snd_avirt_stream_attr_map,
+	&cfg_snd_avirt_stream_attr_readers,
+	&cfg_snd_avirt_stream_attr_route,
+	&cfg_snd_avirt_stream_attr_src,
 	&cfg_snd_avirt_stream_attr_direction,
 	NULL,
 };
 
 static void cfg_snd_avirt_stream_release(struct config_item *item)
 {
+	struct snd_avirt_stream *stream =
+		snd_avirt_stream_from_config_item(item);
+
 	D_INFOK("item->name:%s", item->ci_namebuf);
-	kfree(snd_avirt_stream_from_config_item(item));
+	snd_avirt_stats_destroy(stream);
+	snd_avirt_pcm_buffers_free(stream);
+	kfree(stream);
 }
 
 static struct configfs_item_operations cfg_snd_avirt_stream_ops = {
@@ -118,6 +464,12 @@ cfg_snd_avirt_stream_make_item(struct config_group *group, const char *name)
 	int direction;
 	struct snd_avirt_stream *stream;
 
+	// The PCM devices are fixed once sealed
+	if (snd_avirt_streams_sealed()) {
+		D_ERRORK("Cannot add stream '%s', streams are sealed", name);
+		return ERR_PTR(-EPERM);
+	}
+
 	// Get prefix (playback_ or capture_)
 	split = strsep((char **)&name, "_");
 	if (!split) {
@@ -159,6 +511,7 @@ static ssize_t cfg_snd_avirt_stream_group_sealed_store(struct config_item *item,
 {
 	unsigned long tmp;
 	char *p = (char *)page;
+	int err;
 
 	CHK_ERR(kstrtoul(p, 10, &tmp));
 
@@ -167,7 +520,9 @@ static ssize_t cfg_snd_avirt_stream_group_sealed_store(struct config_item *item,
 		return -ERANGE;
 	}
 
-	snd_avirt_streams_seal();
+	err = snd_avirt_streams_seal();
+	if (err < 0)
+		return err;
 
 	return count;
 }
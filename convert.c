@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * AVIRT - ALSA Virtual Soundcard
+ *
+ * Copyright (c) 2010-2018 Fiberdyne Systems Pty Ltd
+ *
+ * convert.c - AVIRT sample format conversion
+ */
+
+#include <linux/bitops.h>
+#include <linux/string.h>
+
+#include "core.h"
+
+/*
+ * Samples are converted through a left-justified s32 intermediate. Each
+ * (src, dst) pair gets its own conversion function, with the load and store
+ * of both formats inlined, so the conversion and the copy are a single pass.
+ * The conversions are scalar, and FLOAT samples are converted with integer
+ * arithmetic, as kernel C is built without floating point.
+ */
+
+static inline s32 float_to_s32(u32 f)
+{
+	int exp = (f >> 23) & 0xff;
+	u32 mant = (f & 0x7fffff) | 0x800000;
+	int shift = exp - 119; /* mant * 2^(exp - 127 - 23) * 2^31 */
+	s32 v;
+
+	if (!exp)
+		return 0;
+	if (shift >= 8) /* |f| >= 1.0, Inf and NaN */
+		return (f & 0x80000000) ? S32_MIN : S32_MAX;
+	if (shift >= 0)
+		v = mant << shift;
+	else if (shift > -24)
+		v = mant >> -shift;
+	else
+		v = 0;
+
+	return (f & 0x80000000) ? -v : v;
+}
+
+static inline u32 s32_to_float(s32 v)
+{
+	u32 sign = 0, mag = v, mant;
+	int msb;
+
+	if (!v)
+		return 0;
+	if (v < 0) {
+		sign = 0x80000000;
+		mag = -(u32)v;
+	}
+	msb = fls(mag) - 1;
+	if (msb > 23)
+		mant = mag >> (msb - 23);
+	else
+		mant = mag << (23 - msb);
+
+	return sign | ((msb + 96) << 23) | (mant & 0x7fffff);
+}
+
+#define SIZE_s16_le 2
+#define SIZE_s16_be 2
+#define SIZE_s24_le 4
+#define SIZE_s24_be 4
+#define SIZE_s24_3le 3
+#define SIZE_s24_3be 3
+#define SIZE_s32_le 4
+#define SIZE_s32_be 4
+#define SIZE_float_le 4
+#define SIZE_float_be 4
+
+static inline s32 load_s16_le(const u8 *p)
+{
+	return (s32)(s16)le16_to_cpu(*(const __le16 *)p) << 16;
+}
+
+static inline s32 load_s16_be(const u8 *p)
+{
+	return (s32)(s16)be16_to_cpu(*(const __be16 *)p) << 16;
+}
+
+static inline s32 load_s24_le(const u8 *p)
+{
+	return le32_to_cpu(*(const __le32 *)p) << 8;
+}
+
+static inline s32 load_s24_be(const u8 *p)
+{
+	return be32_to_cpu(*(const __be32 *)p) << 8;
+}
+
+static inline s32 load_s24_3le(const u8 *p)
+{
+	return (p[0] << 8) | (p[1] << 16) | ((u32)p[2] << 24);
+}
+
+static inline s32 load_s24_3be(const u8 *p)
+{
+	return (p[2] << 8) | (p[1] << 16) | ((u32)p[0] << 24);
+}
+
+static inline s32 load_s32_le(const u8 *p)
+{
+	return le32_to_cpu(*(const __le32 *)p);
+}
+
+static inline s32 load_s32_be(const u8 *p)
+{
+	return be32_to_cpu(*(const __be32 *)p);
+}
+
+static inline s32 load_float_le(const u8 *p)
+{
+	return float_to_s32(le32_to_cpu(*(const __le32 *)p));
+}
+
+static inline s32 load_float_be(const u8 *p)
+{
+	return float_to_s32(be32_to_cpu(*(const __be32 *)p));
+}
+
+static inline void store_s16_le(u8 *p, s32 v)
+{
+	*(__le16 *)p = cpu_to_le16(v >> 16);
+}
+
+static inline void store_s16_be(u8 *p, s32 v)
+{
+	*(__be16 *)p = cpu_to_be16(v >> 16);
+}
+
+static inline void store_s24_le(u8 *p, s32 v)
+{
+	*(__le32 *)p = cpu_to_le32(v >> 8);
+}
+
+static inline void store_s24_be(u8 *p, s32 v)
+{
+	*(__be32 *)p = cpu_to_be32(v >> 8);
+}
+
+static inline void store_s24_3le(u8 *p, s32 v)
+{
+	p[0] = v >> 8;
+	p[1] = v >> 16;
+	p[2] = v >> 24;
+}
+
+static inline void store_s24_3be(u8 *p, s32 v)
+{
+	p[2] = v >> 8;
+	p[1] = v >> 16;
+	p[0] = v >> 24;
+}
+
+static inline void store_s32_le(u8 *p, s32 v)
+{
+	*(__le32 *)p = cpu_to_le32(v);
+}
+
+static inline void store_s32_be(u8 *p, s32 v)
+{
+	*(__be32 *)p = cpu_to_be32(v);
+}
+
+static inline void store_float_le(u8 *p, s32 v)
+{
+	*(__le32 *)p = cpu_to_le32(s32_to_float(v));
+}
+
+static inline void store_float_be(u8 *p, s32 v)
+{
+	*(__be32 *)p = cpu_to_be32(s32_to_float(v));
+}
+
+#define CONVERT(src, dst)                                                   \
+	static void convert_##src##_##dst(void *dst_buf, const void *src_buf, \
+					  unsigned int samples)               \
+	{                                                                   \
+		const u8 *s = src_buf;                                      \
+		u8 *d = dst_buf;                                            \
+									    \
+		for (; samples; samples--) {                                \
+			store_##dst(d, load_##src(s));                      \
+			s += SIZE_##src;                                    \
+			d += SIZE_##dst;                                    \
+		}                                                           \
+	}
+
+#define CONVERT_FROM(src)          \
+	CONVERT(src, s16_le)       \
+	CONVERT(src, s16_be)       \
+	CONVERT(src, s24_le)       \
+	CONVERT(src, s24_be)       \
+	CONVERT(src, s24_3le)      \
+	CONVERT(src, s24_3be)      \
+	CONVERT(src, s32_le)       \
+	CONVERT(src, s32_be)       \
+	CONVERT(src, float_le)     \
+	CONVERT(src, float_be)
+
+CONVERT_FROM(s16_le)
+CONVERT_FROM(s16_be)
+CONVERT_FROM(s24_le)
+CONVERT_FROM(s24_be)
+CONVERT_FROM(s24_3le)
+CONVERT_FROM(s24_3be)
+CONVERT_FROM(s32_le)
+CONVERT_FROM(s32_be)
+CONVERT_FROM(float_le)
+CONVERT_FROM(float_be)
+
+#define CONVERT_ROW(src)                                               \
+	{                                                              \
+		convert_##src##_s16_le, convert_##src##_s16_be,        \
+		convert_##src##_s24_le, convert_##src##_s24_be,        \
+		convert_##src##_s24_3le, convert_##src##_s24_3be,      \
+		convert_##src##_s32_le, convert_##src##_s32_be,        \
+		convert_##src##_float_le, convert_##src##_float_be,    \
+	}
+
+/* Indexed by convert_index() */
+static const snd_avirt_convert_t convert_table[10][10] = {
+	CONVERT_ROW(s16_le),  CONVERT_ROW(s16_be),  CONVERT_ROW(s24_le),
+	CONVERT_ROW(s24_be),  CONVERT_ROW(s24_3le), CONVERT_ROW(s24_3be),
+	CONVERT_ROW(s32_le),  CONVERT_ROW(s32_be),  CONVERT_ROW(float_le),
+	CONVERT_ROW(float_be),
+};
+
+static int convert_index(snd_pcm_format_t format)
+{
+	switch (format) {
+	case SNDRV_PCM_FORMAT_S16_LE:
+		return 0;
+	case SNDRV_PCM_FORMAT_S16_BE:
+		return 1;
+	case SNDRV_PCM_FORMAT_S24_LE:
+		return 2;
+	case SNDRV_PCM_FORMAT_S24_BE:
+		return 3;
+	case SNDRV_PCM_FORMAT_S24_3LE:
+		return 4;
+	case SNDRV_PCM_FORMAT_S24_3BE:
+		return 5;
+	case SNDRV_PCM_FORMAT_S32_LE:
+		return 6;
+	case SNDRV_PCM_FORMAT_S32_BE:
+		return 7;
+	case SNDRV_PCM_FORMAT_FLOAT_LE:
+		return 8;
+	case SNDRV_PCM_FORMAT_FLOAT_BE:
+		return 9;
+	default:
+		return -EINVAL;
+	}
+}
+
+/**
+ * snd_avirt_convert_get - Get the conversion function for a format pair
+ * @src: The source sample format
+ * @dst: The destination sample format
+ * @return: The conversion function, or NULL if either format is unsupported
+ *
+ * Identical formats are better copied as is, FLOAT samples are clipped to
+ * [-1.0, 1.0] when going through the conversion.
+ */
+snd_avirt_convert_t snd_avirt_convert_get(snd_pcm_format_t src,
+					  snd_pcm_format_t dst)
+{
+	int s = convert_index(src), d = convert_index(dst);
+
+	if (s < 0 || d < 0)
+		return NULL;
+
+	return convert_table[s][d];
+}
+EXPORT_SYMBOL_GPL(snd_avirt_convert_get);
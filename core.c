@@ -10,6 +10,10 @@
 #include <linux/module.h>
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <sound/initval.h>
 
 #include "core.h"
@@ -36,14 +40,30 @@ struct snd_avirt_coreinfo coreinfo = {
 	.version = { 0, 0, 1 },
 };
 
+/*
+ * Audio Path registry
+ * The list and hash are modified under audiopath_mutex, which also serialises
+ * binding the Audio Paths to the streams. Lookups by uid are RCU protected.
+ */
+#define AUDIOPATH_HASH_BITS 4
+
 static LIST_HEAD(audiopath_list);
+static DEFINE_HASHTABLE(audiopath_hash, AUDIOPATH_HASH_BITS);
+static DEFINE_MUTEX(audiopath_mutex);
 
 struct snd_avirt_audiopath_obj {
 	struct kobject kobj;
 	struct list_head list;
+	struct hlist_node node;
 	struct snd_avirt_audiopath *path;
+	struct snd_pcm_ops pcm_ops;
 };
 
+static u32 audiopath_hash_key(const char *uid)
+{
+	return jhash(uid, strlen(uid), 0);
+}
+
 static struct kset *snd_avirt_audiopath_kset;
 static struct kobject *kobj;
 
@@ -145,14 +165,40 @@ static ssize_t
 		       audiopath->version[1], audiopath->version[2]);
 }
 
+/*
+ * The CPU time of an Audio Path is that of the sealed streams mapped to it,
+ * whether they are bound to it yet or not
+ */
+static ssize_t
+	cpu_us_per_sec_show(struct snd_avirt_audiopath_obj *audiopath_obj,
+			    struct snd_avirt_audiopath_attribute *attr,
+			    char *buf)
+{
+	u64 us_per_sec[SND_AVIRT_STAT_CPU_COUNT] = { 0 };
+	struct snd_avirt_stream *stream;
+	unsigned int i;
+
+	mutex_lock(&audiopath_mutex);
+	for (i = 0; core.streams_sealed && i < core.stream_count; i++) {
+		stream = core.streams[i];
+		if (stream && !strcmp(stream->map, audiopath_obj->path->uid))
+			snd_avirt_stats_cpu(stream, us_per_sec);
+	}
+	mutex_unlock(&audiopath_mutex);
+
+	return snd_avirt_stats_cpu_print(buf, us_per_sec);
+}
+
 static struct snd_avirt_audiopath_attribute snd_avirt_audiopath_attrs[] = {
 	__ATTR_RO(audiopath_name),
 	__ATTR_RO(audiopath_version),
+	__ATTR_RO(cpu_us_per_sec),
 };
 
 static struct attribute *snd_avirt_audiopath_def_attrs[] = {
 	&snd_avirt_audiopath_attrs[0].attr,
 	&snd_avirt_audiopath_attrs[1].attr,
+	&snd_avirt_audiopath_attrs[2].attr,
 	NULL,
 };
 
@@ -193,19 +239,18 @@ static struct snd_avirt_audiopath_obj *
 
 static struct snd_pcm *pcm_create(struct snd_avirt_stream *stream)
 {
-	bool playback = false, capture = false;
+	int playback = 0, capture = 0;
 	struct snd_pcm *pcm;
 	int err;
 
-	/** Special case: loopback */
+	/** Special case: loopback, with a capture substream per reader */
 	if (!strcmp(stream->map, "ap_loopback")) {
-		playback = true;
-		capture = true;
-		(&pcm_ops)->copy_user = NULL;
+		playback = 1;
+		capture = stream->readers;
 	} else if (!stream->direction) {
-		playback = true;
+		playback = 1;
 	} else {
-		capture = true;
+		capture = 1;
 	}
 
 	err = snd_pcm_new(core.card, stream->name, stream->device, playback,
@@ -214,13 +259,8 @@ static struct snd_pcm *pcm_create(struct snd_avirt_stream *stream)
 	if (err < 0)
 		return ERR_PTR(err);
 
-	/** Register driver callbacks */
-	if (playback)
-		snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &pcm_ops);
-	if (capture)
-		snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &pcm_ops);
-
 	pcm->info_flags = 0;
+	pcm->private_data = stream;
 	strcpy(pcm->name, stream->name);
 
 	return pcm;
@@ -239,13 +279,34 @@ static void destroy_snd_avirt_audiopath_obj(struct snd_avirt_audiopath_obj *p)
  * snd_avirt_audiopath_get - retrieves the Audio Path by its UID
  * @uid: Unique ID for the Audio Path
  * @return: Corresponding Audio Path
+ *
+ * Call under rcu_read_lock(), and pin the Audio Path module before leaving the
+ * read side critical section if the Audio Path is to be used afterwards.
  */
 struct snd_avirt_audiopath *snd_avirt_audiopath_get(const char *uid)
 {
 	struct snd_avirt_audiopath_obj *ap_obj;
 
-	list_for_each_entry(ap_obj, &audiopath_list, list) {
-		// pr_info("get_ap %s\n", ap_obj->path->uid);
+	hash_for_each_possible_rcu(audiopath_hash, ap_obj, node,
+				   audiopath_hash_key(uid)) {
+		if (!strcmp(ap_obj->path->uid, uid))
+			return ap_obj->path;
+	}
+
+	return NULL;
+}
+
+/*
+ * Lookup by uid for the registry writers, which hold audiopath_mutex rather
+ * than the RCU read lock
+ */
+static struct snd_avirt_audiopath *audiopath_find(const char *uid)
+{
+	struct snd_avirt_audiopath_obj *ap_obj;
+
+	lockdep_assert_held(&audiopath_mutex);
+	hash_for_each_possible(audiopath_hash, ap_obj, node,
+			       audiopath_hash_key(uid)) {
 		if (!strcmp(ap_obj->path->uid, uid))
 			return ap_obj->path;
 	}
@@ -253,6 +314,57 @@ struct snd_avirt_audiopath *snd_avirt_audiopath_get(const char *uid)
 	return NULL;
 }
 
+/**
+ * stream_bind - bind a stream to its Audio Path
+ * @stream: the stream
+ * @audiopath: the Audio Path, or NULL while it is not loaded
+ *
+ * The PCM callbacks reach the Audio Path of a stream through the stream
+ * itself, and the PCM uses the op table built for that Audio Path.
+ * Call with audiopath_mutex held.
+ */
+static void stream_bind(struct snd_avirt_stream *stream,
+			struct snd_avirt_audiopath *audiopath)
+{
+	const struct snd_pcm_ops *ops = &pcm_ops;
+	struct snd_avirt_audiopath_obj *ap_obj;
+
+	if (audiopath) {
+		ap_obj = audiopath->context;
+		ops = &ap_obj->pcm_ops;
+	}
+
+	/* Publish the Audio Path only once its op table is in place */
+	if (!audiopath)
+		RCU_INIT_POINTER(stream->audiopath, NULL);
+	snd_pcm_set_ops(stream->pcm, SNDRV_PCM_STREAM_PLAYBACK, ops);
+	snd_pcm_set_ops(stream->pcm, SNDRV_PCM_STREAM_CAPTURE, ops);
+	if (audiopath)
+		rcu_assign_pointer(stream->audiopath, audiopath);
+}
+
+/**
+ * audiopath_bind - bind or unbind an Audio Path to its sealed streams
+ * @audiopath: the Audio Path
+ * @bind: true to bind, false to unbind
+ *
+ * Call with audiopath_mutex held.
+ */
+static void audiopath_bind(struct snd_avirt_audiopath *audiopath, bool bind)
+{
+	struct snd_avirt_stream *stream;
+	unsigned int i;
+
+	if (!core.streams_sealed)
+		return;
+
+	for (i = 0; i < core.stream_count; i++) {
+		stream = core.streams[i];
+		if (stream && !strcmp(stream->map, audiopath->uid))
+			stream_bind(stream, bind ? audiopath : NULL);
+	}
+}
+
 /**
  * snd_avirt_audiopath_register - register Audio Path with AVIRT
  * @audiopath: Audio Path to be registered
@@ -263,23 +375,36 @@ int snd_avirt_audiopath_register(struct snd_avirt_audiopath *audiopath,
 				 struct snd_avirt_coreinfo **info)
 {
 	struct snd_avirt_audiopath_obj *audiopath_obj;
+	int err = 0;
 
 	if (!audiopath) {
 		D_ERRORK("Audio Path is NULL!");
 		return -EINVAL;
 	}
 
+	mutex_lock(&audiopath_mutex);
+	if (audiopath_find(audiopath->uid)) {
+		D_ERRORK("Audio Path %s is already registered", audiopath->uid);
+		err = -EEXIST;
+		goto exit_unlock;
+	}
+
 	audiopath_obj = create_snd_avirt_audiopath_obj(audiopath->uid);
 	if (!audiopath_obj) {
 		D_INFOK("Failed to alloc driver object");
-		return -ENOMEM;
+		err = -ENOMEM;
+		goto exit_unlock;
 	}
 	audiopath_obj->path = audiopath;
 
 	audiopath->context = audiopath_obj;
+	snd_avirt_pcm_ops_build(&audiopath_obj->pcm_ops, audiopath);
 	D_INFOK("Registered new Audio Path: %s", audiopath->name);
 
 	list_add_tail(&audiopath_obj->list, &audiopath_list);
+	hash_add_rcu(audiopath_hash, &audiopath_obj->node,
+		     audiopath_hash_key(audiopath->uid));
+	audiopath_bind(audiopath, true);
 
 	// If we have already sealed the streams, configure this AP
 	if (core.streams_sealed)
@@ -288,7 +413,10 @@ int snd_avirt_audiopath_register(struct snd_avirt_audiopath *audiopath,
 
 	*info = &coreinfo;
 
-	return 0;
+exit_unlock:
+	mutex_unlock(&audiopath_mutex);
+
+	return err;
 }
 EXPORT_SYMBOL_GPL(snd_avirt_audiopath_register);
 
@@ -313,7 +441,15 @@ int snd_avirt_audiopath_deregister(struct snd_avirt_audiopath *audiopath)
 		return -EINVAL;
 	}
 
+	mutex_lock(&audiopath_mutex);
+	audiopath_bind(audiopath, false);
 	list_del(&audiopath_obj->list);
+	hash_del_rcu(&audiopath_obj->node);
+	audiopath->context = NULL;
+	mutex_unlock(&audiopath_mutex);
+
+	// Wait for any open still looking at this Audio Path
+	synchronize_rcu();
 	destroy_snd_avirt_audiopath_obj(audiopath_obj);
 	D_INFOK("Deregistered Audio Path %s", audiopath->uid);
 
@@ -368,6 +504,10 @@ struct snd_avirt_stream *snd_avirt_stream_create(const char *name,
 	strcpy(stream->name, name);
 	strcpy(stream->map, "none");
 	stream->channels = 0;
+	stream->clock = SND_AVIRT_CLOCK_SYSTIMER;
+	stream->src = SND_AVIRT_SRC_NONE;
+	stream->readers = 1;
+	stream->gain = SND_AVIRT_GAIN_UNITY;
 	stream->direction = direction;
 	stream->device = core.stream_count++;
 
@@ -376,6 +516,71 @@ struct snd_avirt_stream *snd_avirt_stream_create(const char *name,
 	return stream;
 }
 
+/*
+ * Only ap_loopback applies the routes, and they may only read the channels
+ * played to the stream
+ */
+static int stream_route_check(struct snd_avirt_stream *stream)
+{
+	unsigned int i;
+
+	if (stream->route.count && strcmp(stream->map, "ap_loopback")) {
+		D_ERRORK("Stream %s is routed, but mapped to %s", stream->name,
+			 stream->map);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < stream->route.count; i++) {
+		if (stream->route.map[i].src >= stream->channels) {
+			D_ERRORK("Stream %s routes channel %d of %d",
+				 stream->name, stream->route.map[i].src,
+				 stream->channels);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Create the PCM of a stream, and what it needs once sealed. On error, frees
+ * what it created
+ */
+static int stream_create(struct snd_avirt_stream *stream)
+{
+	int err;
+
+	stream->pcm = pcm_create(stream);
+	if (IS_ERR(stream->pcm)) {
+		err = PTR_ERR(stream->pcm);
+		stream->pcm = NULL;
+		return err;
+	}
+	err = snd_avirt_pcm_buffers_alloc(stream);
+	if (err < 0)
+		goto free_pcm;
+	err = snd_avirt_stats_create(stream);
+	if (err < 0)
+		goto free_buffers;
+
+	return 0;
+
+free_buffers:
+	snd_avirt_pcm_buffers_free(stream);
+free_pcm:
+	snd_device_free(core.card, stream->pcm);
+	stream->pcm = NULL;
+	return err;
+}
+
+static void stream_destroy(struct snd_avirt_stream *stream)
+{
+	snd_avirt_stats_destroy(stream);
+	snd_avirt_pcm_buffers_free(stream);
+	snd_device_free(core.card, stream->pcm);
+	stream->pcm = NULL;
+}
+
 int snd_avirt_streams_seal(void)
 {
 	int err = 0;
@@ -383,20 +588,46 @@ int snd_avirt_streams_seal(void)
 	struct snd_avirt_stream *stream;
 	struct config_item *item;
 	struct list_head *entry;
+	unsigned int i;
 
 	if (core.streams_sealed) {
 		D_ERRORK("streams are already sealed!");
 		return -1;
 	}
 
+	kfree(core.streams);
+	core.streams = kcalloc(core.stream_count, sizeof(*core.streams),
+			       GFP_KERNEL);
+	if (!core.streams)
+		return -ENOMEM;
+
+	// Check every stream before creating any, so a bad one leaves none
 	list_for_each(entry, &core.stream_group->cg_children) {
 		item = container_of(entry, struct config_item, ci_entry);
 		stream = snd_avirt_stream_from_config_item(item);
 		if (!stream)
 			return -EFAULT;
-		stream->pcm = pcm_create(stream);
-		if (IS_ERR_OR_NULL(stream->pcm))
-			return (PTR_ERR(stream->pcm));
+		err = stream_route_check(stream);
+		if (err < 0)
+			return err;
+	}
+
+	list_for_each(entry, &core.stream_group->cg_children) {
+		item = container_of(entry, struct config_item, ci_entry);
+		stream = snd_avirt_stream_from_config_item(item);
+		err = stream_create(stream);
+		if (err < 0)
+			goto destroy_streams;
+		// The PCM keeps using the stream after an rmdir of its item
+		core.streams[stream->device] = stream;
+		config_item_get(item);
+	}
+
+	mutex_lock(&audiopath_mutex);
+	for (i = 0; i < core.stream_count; i++) {
+		stream = core.streams[i];
+		if (stream)
+			stream_bind(stream, audiopath_find(stream->map));
 	}
 
 	list_for_each_entry(ap_obj, &audiopath_list, list) {
@@ -412,8 +643,21 @@ int snd_avirt_streams_seal(void)
 	}
 
 	core.streams_sealed = true;
+	mutex_unlock(&audiopath_mutex);
 
 	return err;
+
+destroy_streams:
+	// Leave the streams as they were, so that they can be sealed again
+	for (i = 0; i < core.stream_count; i++) {
+		stream = core.streams[i];
+		if (!stream)
+			continue;
+		stream_destroy(stream);
+		core.streams[i] = NULL;
+		config_item_put(&stream->item);
+	}
+	return err;
 }
 
 bool snd_avirt_streams_sealed(void)
@@ -432,6 +676,9 @@ struct snd_avirt_stream *snd_avirt_stream_find_by_device(unsigned int device)
 		return ERR_PTR(-EINVAL);
 	}
 
+	if (core.streams_sealed)
+		return core.streams[device];
+
 	list_for_each(entry, &core.stream_group->cg_children) {
 		item = container_of(entry, struct config_item, ci_entry);
 		stream = snd_avirt_stream_from_config_item(item);
@@ -486,6 +733,10 @@ static int __init core_init(void)
 		goto exit_snd_card;
 	}
 
+	err = snd_avirt_stats_init(&core);
+	if (err < 0)
+		goto exit_snd_card;
+
 	err = snd_avirt_configfs_init(&core);
 	if (err < 0)
 		goto exit_snd_card;
@@ -507,10 +758,17 @@ exit_class:
  */
 static void __exit core_exit(void)
 {
+	unsigned int i;
+
 	snd_avirt_configfs_exit(&core);
 
-	kset_unregister(snd_avirt_audiopath_kset);
 	snd_card_free(core.card);
+	for (i = 0; core.streams && i < core.stream_count; i++)
+		if (core.streams[i])
+			config_item_put(&core.streams[i]->item);
+	kfree(core.streams);
+	snd_avirt_stats_exit(&core);
+	kset_unregister(snd_avirt_audiopath_kset);
 	device_destroy(core.avirt_class, 0);
 	class_destroy(core.avirt_class);
 }
@@ -14,17 +14,72 @@
 
 #include "utils.h"
 
-extern struct snd_pcm_ops pcm_ops;
+extern const struct snd_pcm_ops pcm_ops;
+
+/*
+ * PCM buffer of a substream, kept from one hw_params to the next so that
+ * negotiating the same buffer size again does not reallocate it
+ */
+struct snd_avirt_pcm_buffer {
+	void *area;
+	size_t bytes; /* allocated */
+	size_t used; /* in use by the runtime */
+	unsigned int backend; /* requested backend (enum snd_avirt_buffer) */
+};
+
+/* PCM buffers of a stream, playback substreams first */
+struct snd_avirt_pcm_buffers {
+	unsigned int count;
+	struct snd_avirt_pcm_buffer buf[];
+};
 
 struct snd_avirt_core {
 	struct snd_card *card;
 	struct device *dev;
 	struct class *avirt_class;
 	struct config_group *stream_group;
+	struct snd_avirt_stream **streams; /* indexed by device, when sealed */
 	unsigned int stream_count;
 	bool streams_sealed;
 };
 
+/**
+ * snd_avirt_pcm_ops_build - Build the PCM op table of an Audio Path
+ * @ops: The op table to fill in
+ * @audiopath: The Audio Path the table is built for
+ */
+void snd_avirt_pcm_ops_build(struct snd_pcm_ops *ops,
+			     const struct snd_avirt_audiopath *audiopath);
+
+/**
+ * snd_avirt_substream_index - Index of a substream within its stream
+ * @substream: pointer to ALSA PCM substream
+ * @return: The index, counting the playback substreams first
+ */
+static inline unsigned int
+snd_avirt_substream_index(struct snd_pcm_substream *substream)
+{
+	unsigned int index = substream->number;
+
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+		index += substream->pcm->streams[SNDRV_PCM_STREAM_PLAYBACK]
+				 .substream_count;
+	return index;
+}
+
+/**
+ * snd_avirt_pcm_buffers_alloc - Create the PCM buffer cache of a stream
+ * @stream: The stream, with its PCM created
+ * @return: 0 on success, negative ERRNO on failure
+ */
+int snd_avirt_pcm_buffers_alloc(struct snd_avirt_stream *stream);
+
+/**
+ * snd_avirt_pcm_buffers_free - Free the PCM buffer cache of a stream
+ * @stream: The stream
+ */
+void snd_avirt_pcm_buffers_free(struct snd_avirt_stream *stream);
+
 /**
  * snd_avirt_configfs_init - Initialise the configfs system
  * @core: The snd_avirt_core pointer
@@ -38,6 +93,60 @@ int __init snd_avirt_configfs_init(struct snd_avirt_core *core);
  */
 void __exit snd_avirt_configfs_exit(struct snd_avirt_core *core);
 
+/**
+ * snd_avirt_stats_init - Create the statistics directory of the streams
+ * @core: The snd_avirt_core pointer
+ * @return: 0 on success, negative ERRNO on failure
+ */
+int snd_avirt_stats_init(struct snd_avirt_core *core);
+
+/**
+ * snd_avirt_stats_exit - Remove the statistics directory of the streams
+ * @core: The snd_avirt_core pointer
+ */
+void snd_avirt_stats_exit(struct snd_avirt_core *core);
+
+/**
+ * snd_avirt_stats_create - Create the statistics of a stream
+ * @stream: The stream, with its PCM created
+ * @return: 0 on success, negative ERRNO on failure
+ */
+int snd_avirt_stats_create(struct snd_avirt_stream *stream);
+
+/**
+ * snd_avirt_stats_destroy - Remove the statistics of a stream
+ * @stream: The stream
+ */
+void snd_avirt_stats_destroy(struct snd_avirt_stream *stream);
+
+/**
+ * snd_avirt_stats_start - Restart the period timing of a substream
+ * @substream: pointer to ALSA PCM substream
+ */
+void snd_avirt_stats_start(struct snd_pcm_substream *substream);
+
+/**
+ * snd_avirt_stats_period - Account an elapsed period of a substream
+ * @substream: pointer to ALSA PCM substream
+ */
+void snd_avirt_stats_period(struct snd_pcm_substream *substream);
+
+/**
+ * snd_avirt_stats_cpu - Add up the CPU time a stream costs
+ * @stream: The stream
+ * @us_per_sec: Adds the microseconds per second spent in timer callbacks,
+ *              copies, silence fill and pointer queries, in that order
+ */
+void snd_avirt_stats_cpu(struct snd_avirt_stream *stream, u64 *us_per_sec);
+
+/**
+ * snd_avirt_stats_cpu_print - Show the CPU time from snd_avirt_stats_cpu()
+ * @buf: The sysfs buffer
+ * @us_per_sec: The CPU time
+ * @return: The length shown
+ */
+ssize_t snd_avirt_stats_cpu_print(char *buf, const u64 *us_per_sec);
+
 /**
  * snd_avirt_streams_seal - Register the sound card to user space
  * @return: 0 on success, negative ERRNO on failure
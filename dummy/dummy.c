@@ -13,8 +13,12 @@
 
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
 #include <sound/avirt.h>
 
+#include "avirt_trace.h"
+
 MODULE_AUTHOR("James O'Shannessy <james.oshannessy@fiberdyne.com.au>");
 MODULE_AUTHOR("Mark Farrugia <mark.farrugia@fiberdyne.com.au>");
 MODULE_DESCRIPTION("Dummy Audio Path for AVIRT");
@@ -30,12 +34,18 @@ MODULE_LICENSE("GPL v2");
 #define DUMMY_BLOCKSIZE 512
 #define DUMMY_PERIODS_MIN 1
 #define DUMMY_PERIODS_MAX 8
+#define DUMMY_PERIOD_BYTES_MIN 64
+#define DUMMY_BUFFER_BYTES_MAX (64 * 1024)
 
 #define get_dummy_ops(substream) \
 	(*(const struct dummy_timer_ops **)(substream)->runtime->private_data)
 
 static struct snd_avirt_coreinfo *coreinfo;
 
+/* Clock source of each stream, indexed by PCM device */
+static unsigned int *dummy_clock;
+static unsigned int dummy_clock_count;
+
 /*******************************************************************************
  * System Timer Interface
  *
@@ -184,15 +194,253 @@ static const struct dummy_timer_ops dummy_systimer_ops = {
 	.pointer = dummy_systimer_pointer,
 };
 
+/*******************************************************************************
+ * High Resolution Timer Interface
+ *
+ * Fires at the exact period boundary, and computes the pointer from the
+ * elapsed ktime, allowing periods shorter than a jiffy to be emulated
+ *
+ * (Borrowed from the default ALSA 'dummy' driver (sound/driver/dummy.c))
+ ******************************************************************************/
+struct dummy_hrtimer_pcm {
+	/* ops must be the first item */
+	const struct dummy_timer_ops *timer_ops;
+	ktime_t base_time;
+	ktime_t period_time;
+	atomic_t running;
+	struct hrtimer timer;
+	struct snd_pcm_substream *substream;
+};
+
+static enum hrtimer_restart dummy_hrtimer_callback(struct hrtimer *timer)
+{
+	struct dummy_hrtimer_pcm *dpcm;
+
+	dpcm = container_of(timer, struct dummy_hrtimer_pcm, timer);
+	if (!atomic_read(&dpcm->running))
+		return HRTIMER_NORESTART;
+	/*
+	 * In cases of XRUN and draining, this calls .trigger to stop PCM
+	 * stream.
+	 */
+	snd_avirt_pcm_period_elapsed(dpcm->substream);
+	if (!atomic_read(&dpcm->running))
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer, dpcm->period_time);
+	return HRTIMER_RESTART;
+}
+
+static int dummy_hrtimer_start(struct snd_pcm_substream *substream)
+{
+	struct dummy_hrtimer_pcm *dpcm = substream->runtime->private_data;
+
+	dpcm->base_time = hrtimer_cb_get_time(&dpcm->timer);
+	hrtimer_start(&dpcm->timer, dpcm->period_time, HRTIMER_MODE_REL);
+	atomic_set(&dpcm->running, 1);
+	return 0;
+}
+
+static int dummy_hrtimer_stop(struct snd_pcm_substream *substream)
+{
+	struct dummy_hrtimer_pcm *dpcm = substream->runtime->private_data;
+
+	atomic_set(&dpcm->running, 0);
+	hrtimer_try_to_cancel(&dpcm->timer);
+	return 0;
+}
+
+static inline void dummy_hrtimer_sync(struct dummy_hrtimer_pcm *dpcm)
+{
+	hrtimer_cancel(&dpcm->timer);
+}
+
+static snd_pcm_uframes_t
+	dummy_hrtimer_pointer(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct dummy_hrtimer_pcm *dpcm = runtime->private_data;
+	u64 delta;
+	u32 pos;
+
+	delta = ktime_to_ns(ktime_sub(hrtimer_cb_get_time(&dpcm->timer),
+				      dpcm->base_time));
+	delta = mul_u64_u32_div(delta, runtime->rate, NSEC_PER_SEC);
+	div_u64_rem(delta, runtime->buffer_size, &pos);
+	return pos;
+}
+
+static int dummy_hrtimer_prepare(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct dummy_hrtimer_pcm *dpcm = runtime->private_data;
+	u64 nsecs;
+
+	dummy_hrtimer_sync(dpcm);
+	nsecs = div_u64((u64)runtime->period_size * NSEC_PER_SEC +
+				runtime->rate - 1,
+			runtime->rate);
+	dpcm->period_time = ns_to_ktime(nsecs);
+
+	return 0;
+}
+
+static int dummy_hrtimer_create(struct snd_pcm_substream *substream)
+{
+	struct dummy_hrtimer_pcm *dpcm;
+
+	dpcm = kzalloc(sizeof(*dpcm), GFP_KERNEL);
+	if (!dpcm)
+		return -ENOMEM;
+	substream->runtime->private_data = dpcm;
+	hrtimer_init(&dpcm->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dpcm->timer.function = dummy_hrtimer_callback;
+	dpcm->substream = substream;
+	atomic_set(&dpcm->running, 0);
+	return 0;
+}
+
+static void dummy_hrtimer_free(struct snd_pcm_substream *substream)
+{
+	struct dummy_hrtimer_pcm *dpcm = substream->runtime->private_data;
+
+	dummy_hrtimer_sync(dpcm);
+	kfree(dpcm);
+}
+
+static const struct dummy_timer_ops dummy_hrtimer_ops = {
+	.create = dummy_hrtimer_create,
+	.free = dummy_hrtimer_free,
+	.prepare = dummy_hrtimer_prepare,
+	.start = dummy_hrtimer_start,
+	.stop = dummy_hrtimer_stop,
+	.pointer = dummy_hrtimer_pointer,
+};
+
+/*******************************************************************************
+ * Shared Clock Interface
+ *
+ * Ticks are delivered by the core's shared clock, so that all streams with the
+ * same rate and period size fire period elapsed on the same timer tick
+ ******************************************************************************/
+struct dummy_shared_pcm {
+	/* ops must be the first item */
+	const struct dummy_timer_ops *timer_ops;
+	u64 base_ns;
+	u64 periods; /* periods reported since base_ns */
+	struct snd_avirt_clock_client client;
+};
+
+/* The stream starts between two ticks, report each boundary once crossed */
+static bool dummy_shared_tick(struct snd_avirt_clock_client *client)
+{
+	struct snd_pcm_runtime *runtime = client->substream->runtime;
+	struct dummy_shared_pcm *dpcm = runtime->private_data;
+	u64 periods;
+
+	periods = div_u64(mul_u64_u32_div(ktime_get_ns() - dpcm->base_ns,
+					  runtime->rate, NSEC_PER_SEC),
+			  runtime->period_size);
+	if (periods == dpcm->periods)
+		return false;
+	dpcm->periods = periods;
+	return true;
+}
+
+static int dummy_shared_start(struct snd_pcm_substream *substream)
+{
+	struct dummy_shared_pcm *dpcm = substream->runtime->private_data;
+
+	/* set before the client is started, for its first tick to see it */
+	dpcm->periods = 0;
+	dpcm->base_ns = ktime_get_ns();
+	snd_avirt_clock_start(&dpcm->client);
+	return 0;
+}
+
+static int dummy_shared_stop(struct snd_pcm_substream *substream)
+{
+	struct dummy_shared_pcm *dpcm = substream->runtime->private_data;
+
+	snd_avirt_clock_stop(&dpcm->client);
+	return 0;
+}
+
+static snd_pcm_uframes_t
+	dummy_shared_pointer(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct dummy_shared_pcm *dpcm = runtime->private_data;
+	u64 delta;
+	u32 pos;
+
+	delta = mul_u64_u32_div(ktime_get_ns() - dpcm->base_ns, runtime->rate,
+				NSEC_PER_SEC);
+	div_u64_rem(delta, runtime->buffer_size, &pos);
+	return pos;
+}
+
+static int dummy_shared_prepare(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct dummy_shared_pcm *dpcm = runtime->private_data;
+	u64 nsecs;
+
+	nsecs = div_u64((u64)runtime->period_size * NSEC_PER_SEC +
+				runtime->rate - 1,
+			runtime->rate);
+
+	return snd_avirt_clock_attach(&dpcm->client, nsecs);
+}
+
+static int dummy_shared_create(struct snd_pcm_substream *substream)
+{
+	struct dummy_shared_pcm *dpcm;
+
+	dpcm = kzalloc(sizeof(*dpcm), GFP_KERNEL);
+	if (!dpcm)
+		return -ENOMEM;
+	substream->runtime->private_data = dpcm;
+	dpcm->client.tick = dummy_shared_tick;
+	dpcm->client.substream = substream;
+	return 0;
+}
+
+static void dummy_shared_free(struct snd_pcm_substream *substream)
+{
+	struct dummy_shared_pcm *dpcm = substream->runtime->private_data;
+
+	snd_avirt_clock_detach(&dpcm->client);
+	kfree(dpcm);
+}
+
+static const struct dummy_timer_ops dummy_shared_ops = {
+	.create = dummy_shared_create,
+	.free = dummy_shared_free,
+	.prepare = dummy_shared_prepare,
+	.start = dummy_shared_start,
+	.stop = dummy_shared_stop,
+	.pointer = dummy_shared_pointer,
+};
+
 /*******************************************************************************
  * Audio Path ALSA PCM Callbacks
  ******************************************************************************/
 static int dummy_pcm_open(struct snd_pcm_substream *substream)
 {
-	const struct dummy_timer_ops *ops;
+	const struct dummy_timer_ops *ops = &dummy_systimer_ops;
 	int err;
 
-	ops = &dummy_systimer_ops;
+	if (substream->pcm->device < dummy_clock_count) {
+		switch (dummy_clock[substream->pcm->device]) {
+		case SND_AVIRT_CLOCK_HRTIMER:
+			ops = &dummy_hrtimer_ops;
+			break;
+		case SND_AVIRT_CLOCK_SHARED:
+			ops = &dummy_shared_ops;
+			break;
+		}
+	}
 	err = ops->create(substream);
 	if (err < 0)
 		return err;
@@ -209,7 +457,13 @@ static int dummy_pcm_close(struct snd_pcm_substream *substream)
 
 static snd_pcm_uframes_t dummy_pcm_pointer(struct snd_pcm_substream *substream)
 {
-	return get_dummy_ops(substream)->pointer(substream);
+	u64 start = local_clock();
+	snd_pcm_uframes_t pos = get_dummy_ops(substream)->pointer(substream);
+
+	snd_avirt_stat_add(substream, SND_AVIRT_STAT_CPU_POINTER,
+			   local_clock() - start);
+	trace_avirt_pcm_pointer(substream, pos);
+	return pos;
 }
 
 static int dummy_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
@@ -248,11 +502,18 @@ static int dummy_configure(struct snd_card *card,
 	// Do something with streams
 
 	struct list_head *entry;
+
+	dummy_clock = kcalloc(stream_count, sizeof(*dummy_clock), GFP_KERNEL);
+	if (!dummy_clock)
+		return -ENOMEM;
+	dummy_clock_count = stream_count;
+
 	list_for_each (entry, &snd_avirt_stream_group->cg_children) {
 		struct config_item *item =
 			container_of(entry, struct config_item, ci_entry);
 		struct snd_avirt_stream *stream =
 			snd_avirt_stream_from_config_item(item);
+		dummy_clock[stream->device] = stream->clock;
 		AP_INFOK("stream name:%s device:%d channels:%d", stream->name,
 			 stream->device, stream->channels);
 	}
@@ -268,6 +529,9 @@ static struct snd_pcm_hardware dummyap_hw = {
 	.rates = SNDRV_PCM_RATE_48000,
 	.rate_min = DUMMY_SAMPLE_RATE,
 	.rate_max = DUMMY_SAMPLE_RATE,
+	.buffer_bytes_max = DUMMY_BUFFER_BYTES_MAX,
+	.period_bytes_min = DUMMY_PERIOD_BYTES_MIN,
+	.period_bytes_max = DUMMY_BUFFER_BYTES_MAX,
 	.periods_min = DUMMY_PERIODS_MIN,
 	.periods_max = DUMMY_PERIODS_MAX,
 };
@@ -279,6 +543,8 @@ static struct snd_avirt_audiopath dummyap_module = {
 	.hw = &dummyap_hw,
 	.pcm_ops = &dummyap_pcm_ops,
 	.configure = dummy_configure,
+	.flags = SND_AVIRT_AP_DIRECT_OPS,
+	.owner = THIS_MODULE,
 };
 
 static int __init dummy_init(void)
@@ -301,6 +567,7 @@ static void __exit dummy_exit(void)
 	pr_info("exit()\n");
 
 	snd_avirt_audiopath_deregister(&dummyap_module);
+	kfree(dummy_clock);
 }
 
 module_init(dummy_init);
@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * AVIRT - ALSA Virtual Soundcard
+ *
+ * Copyright (c) 2010-2018 Fiberdyne Systems Pty Ltd
+ *
+ * gain.c - AVIRT stream gain
+ */
+
+#include <linux/math64.h>
+
+#include "core.h"
+
+/*
+ * The ramp position is kept with SND_AVIRT_GAIN_SHIFT extra fraction bits,
+ * so that slow ramps over long periods still move on every frame. As the
+ * gain never exceeds unity, the scaled samples cannot overflow. The scaling
+ * is scalar fixed point code, kernel C being built without floating point.
+ */
+
+void snd_avirt_gain_reset(struct snd_avirt_gain *gain, unsigned int value)
+{
+	gain->target = value;
+	gain->cur = (s64)value << SND_AVIRT_GAIN_SHIFT;
+	gain->step = 0;
+	gain->left = 0;
+}
+EXPORT_SYMBOL_GPL(snd_avirt_gain_reset);
+
+static void gain_scale(s32 *buf, unsigned int samples, unsigned int g)
+{
+	unsigned int i;
+
+	for (i = 0; i < samples; i++)
+		buf[i] = ((s64)buf[i] * g) >> SND_AVIRT_GAIN_SHIFT;
+}
+
+void snd_avirt_gain_apply(struct snd_avirt_gain *gain, unsigned int target,
+			  unsigned int ramp, s32 *buf, unsigned int frames,
+			  unsigned int channels)
+{
+	unsigned int n, f, c, g;
+
+	if (target != gain->target) {
+		/* start over from wherever the last ramp got to */
+		gain->target = target;
+		gain->left = max(ramp, 1U);
+		gain->step = div_s64(((s64)target << SND_AVIRT_GAIN_SHIFT) -
+					     gain->cur,
+				     gain->left);
+	}
+
+	n = min(frames, gain->left);
+	for (f = 0; f < n; f++) {
+		g = gain->cur >> SND_AVIRT_GAIN_SHIFT;
+		for (c = 0; c < channels; c++, buf++)
+			*buf = ((s64)*buf * g) >> SND_AVIRT_GAIN_SHIFT;
+		gain->cur += gain->step;
+	}
+	gain->left -= n;
+	frames -= n;
+	if (!gain->left)
+		gain->cur = (s64)gain->target << SND_AVIRT_GAIN_SHIFT;
+
+	if (frames && gain->target != SND_AVIRT_GAIN_UNITY)
+		gain_scale(buf, frames * channels, gain->target);
+}
+EXPORT_SYMBOL_GPL(snd_avirt_gain_apply);
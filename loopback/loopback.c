@@ -22,9 +22,15 @@
 
 #include <linux/init.h>
 #include <linux/jiffies.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
 #include <sound/control.h>
@@ -34,6 +40,10 @@
 #include <sound/initval.h>
 #include <sound/avirt.h>
 
+#include "avirt_trace.h"
+#define CREATE_TRACE_POINTS
+#include "loopback_trace.h"
+
 MODULE_AUTHOR("Jaroslav Kysela <perex@perex.cz>");
 MODULE_DESCRIPTION("Loopback Audio Path for AVIRT");
 MODULE_LICENSE("GPL");
@@ -46,27 +56,78 @@ MODULE_LICENSE("GPL");
 
 #define NO_PITCH 100000
 
+/* Rate converter chunk, and capture write lead, in frames */
+#define LOOPBACK_SRC_CHUNK 64
+#define LOOPBACK_SRC_MARGIN 8
+
+/*
+ * Cable ends are indexed by substream->stream + substream->number: the
+ * playback is end 0, and each capture substream (reader) gets its own end.
+ */
+#define CABLE_ENDS (1 + MAX_READERS)
+
 static struct snd_avirt_coreinfo *coreinfo;
 static struct loopback *loopback;
 
 struct loopback_pcm;
+struct loopback_cable;
+
+/*
+ * Zero-copy ring buffer, mapped by both ends of a cable when they negotiate
+ * the same format, rate, channels and buffer size. The capture end reads the
+ * playback data in place, only the positions are tracked separately.
+ */
+struct loopback_zc {
+	void *area;
+	size_t bytes;
+	snd_pcm_format_t format;
+	unsigned int rate;
+	unsigned int channels;
+	unsigned int users; /* protected by loopback->cable_lock */
+};
 
+/*
+ * The cable worker advances the ends and makes every copy between them under
+ * work_lock, with interrupts enabled. lock only guards the bookkeeping shared
+ * with the PCM callbacks, which run with interrupts disabled, the trigger
+ * even in hard interrupt context when a linked stream is stopped from
+ * snd_pcm_period_elapsed(). It is thus always taken with interrupts disabled,
+ * and never held across a copy. Lock order: loopback->cable_lock, work_lock,
+ * lock.
+ */
 struct loopback_cable {
 	spinlock_t lock;
-	struct loopback_pcm *streams[2];
+	struct mutex work_lock;
+	struct loopback_pcm *streams[CABLE_ENDS];
 	struct snd_pcm_hardware hw;
-	/* flags */
+	unsigned int clock; /* enum snd_avirt_clock */
+	unsigned int event : 1; /* captures follow the playback writes */
+	struct loopback_zc *zc; /* latest zero-copy buffer */
+	/* flags, one bit per cable end */
 	unsigned int valid;
 	unsigned int running;
 	unsigned int pause;
+	unsigned int direct_seq; /* bumped when direct writes are flushed */
+	unsigned int direct_flush : 1; /* see loopback_direct_stop() */
+	/* ends whose timer ticked, for the cable worker */
+	unsigned long ticked;
+	struct work_struct work;
+	/* CPU time accounting in work_lock, see struct snd_avirt_cpu */
+	u64 cpu_nested;
 };
 
 struct loopback_setup {
 	unsigned int notify : 1;
+	unsigned int zero_copy : 1;
+	unsigned int event : 1;
 	unsigned int rate_shift;
 	unsigned int format;
 	unsigned int rate;
 	unsigned int channels;
+	unsigned int clock;
+	unsigned int src; /* enum snd_avirt_src_mode */
+	unsigned int gain; /* Q16, read by the cable without a lock */
+	struct snd_avirt_route route; /* playback to capture channels */
 	struct snd_ctl_elem_id active_id;
 	struct snd_ctl_elem_id format_id;
 	struct snd_ctl_elem_id rate_id;
@@ -76,18 +137,25 @@ struct loopback_setup {
 struct loopback {
 	struct snd_card *card;
 	struct mutex cable_lock;
-	struct loopback_cable *cables[MAX_STREAMS];
-	struct snd_pcm *pcm[MAX_STREAMS];
-	struct loopback_setup setup[MAX_STREAMS];
+	unsigned int devices;
+	/* per device state, sized at configure time */
+	struct loopback_cable **cables;
+	struct snd_pcm **pcm;
+	struct loopback_setup *setup;
 };
 
 struct loopback_pcm {
 	struct loopback *loopback;
 	struct snd_pcm_substream *substream;
 	struct loopback_cable *cable;
+	unsigned int index; /* cable end */
 	unsigned int pcm_buffer_size;
-	unsigned int buf_pos; /* position in buffer */
+	unsigned int buf_pos; /* position in buffer, published by the worker */
 	unsigned int silent_size;
+	/* playback data written straight into the capture, in cable->lock */
+	unsigned int direct_pos; /* offset in the playback buffer */
+	unsigned int direct_bytes;
+	snd_pcm_uframes_t direct_appl; /* appl_ptr at the end of the range */
 	/* PCM parameters */
 	unsigned int pcm_period_size;
 	unsigned int pcm_bps; /* bytes per second */
@@ -96,33 +164,85 @@ struct loopback_pcm {
 	/* flags */
 	unsigned int period_update_pending : 1;
 	/* timer stuff */
-	unsigned int irq_pos; /* fractional IRQ position */
-	unsigned int period_size_frac;
+	u64 irq_pos; /* fractional IRQ position (bytes * NSEC_PER_SEC) */
+	u64 period_size_frac;
 	unsigned int last_drift;
-	unsigned long last_jiffies;
+	u64 last_ns; /* ktime of the last position update */
 	struct timer_list timer;
+	struct hrtimer hrtimer;
+	/* shared clock: the client in use, and a spare to move classes with */
+	struct snd_avirt_clock_client *clock_client;
+	struct snd_avirt_clock_client clock_clients[2];
+	u64 clock_period_ns; /* class of the client in use, 0 if unattached */
+	struct loopback_zc *zc; /* mapped zero-copy buffer */
+	/* capture only: rate conversion, when it runs at another rate */
+	struct snd_avirt_src *src;
+	s32 *src_buf; /* converter input and output chunks */
+	unsigned int src_wpos; /* offset of the converter output */
+	unsigned int src_prime; /* realign the output with the capture */
+	/* event driven cables only */
+	snd_pcm_uframes_t event_appl; /* playback: last pushed appl_ptr */
+	unsigned int event_pending; /* capture: frames pushed since pointer */
+	/* capture only: gain and routing applied on the way in */
+	struct snd_avirt_gain gain;
+	s32 *conv_buf; /* one chunk of playback, then of capture frames */
 };
 
-static inline unsigned int byte_pos(struct loopback_pcm *dpcm, unsigned int x)
+/*
+ * Positions are accounted in 64-bit fractional units of bytes * NSEC_PER_SEC,
+ * advanced by the ktime delta in nanoseconds times the byte rate. Even a
+ * MAX_DELTA_NS delta at 32ch/192kHz/float (24.6MB/s) is only ~2.5e17 units.
+ * The rate shift is applied to the elapsed time, not to the period size.
+ */
+static inline unsigned int byte_pos(struct loopback_pcm *dpcm, u64 x)
 {
-	if (dpcm->pcm_rate_shift == NO_PITCH) {
-		x /= HZ;
-	} else {
-		x = div_u64(NO_PITCH * (unsigned long long)x,
-			    HZ * (unsigned long long)dpcm->pcm_rate_shift);
-	}
-	return x - (x % dpcm->pcm_salign);
+	unsigned int pos = div_u64(x, NSEC_PER_SEC);
+
+	return pos - (pos % dpcm->pcm_salign);
 }
 
-static inline unsigned int frac_pos(struct loopback_pcm *dpcm, unsigned int x)
+static inline u64 frac_pos(struct loopback_pcm *dpcm, unsigned int x)
 {
-	if (dpcm->pcm_rate_shift == NO_PITCH) { /* no pitch */
-		return x * HZ;
-	} else {
-		x = div_u64(dpcm->pcm_rate_shift * (unsigned long long)x * HZ,
-			    NO_PITCH);
-	}
-	return x;
+	return (u64)x * NSEC_PER_SEC;
+}
+
+/*
+ * Largest time delta accounted in one step, keeps delta * bps in 64 bits.
+ * Longer updates are accounted in steps of this size.
+ */
+#define MAX_DELTA_NS (10 * NSEC_PER_SEC)
+
+/* @delta_ns is at most MAX_DELTA_NS */
+static inline u64 frac_delta(struct loopback_pcm *dpcm, u64 delta_ns)
+{
+	u64 frac = delta_ns * dpcm->pcm_bps;
+
+	if (dpcm->pcm_rate_shift != NO_PITCH)
+		frac = mul_u64_u32_div(frac, NO_PITCH, dpcm->pcm_rate_shift);
+	return frac;
+}
+
+/* Period time of the stream at the rate shift @shift */
+static inline u64 period_ns(struct loopback_pcm *dpcm, unsigned int shift)
+{
+	u64 ns = div_u64(dpcm->period_size_frac + dpcm->pcm_bps - 1,
+			 dpcm->pcm_bps);
+
+	if (shift != NO_PITCH)
+		ns = DIV_ROUND_UP_ULL(ns * shift, NO_PITCH);
+	return ns;
+}
+
+/* Time in ns until the fractional position reaches the next period */
+static inline u64 period_rest_ns(struct loopback_pcm *dpcm)
+{
+	u64 ns = div_u64(dpcm->period_size_frac - dpcm->irq_pos +
+				 dpcm->pcm_bps - 1,
+			 dpcm->pcm_bps);
+
+	if (dpcm->pcm_rate_shift != NO_PITCH)
+		ns = DIV_ROUND_UP_ULL(ns * dpcm->pcm_rate_shift, NO_PITCH);
+	return ns;
 }
 
 static inline struct loopback_setup *get_setup(struct loopback_pcm *dpcm)
@@ -130,6 +250,14 @@ static inline struct loopback_setup *get_setup(struct loopback_pcm *dpcm)
 	return &dpcm->loopback->setup[dpcm->substream->pcm->device];
 }
 
+static inline const struct snd_avirt_route *
+get_route(struct loopback_pcm *dpcm)
+{
+	struct snd_avirt_route *route = &get_setup(dpcm)->route;
+
+	return route->channels ? route : NULL;
+}
+
 static inline unsigned int get_notify(struct loopback_pcm *dpcm)
 {
 	return get_setup(dpcm)->notify;
@@ -140,71 +268,337 @@ static inline unsigned int get_rate_shift(struct loopback_pcm *dpcm)
 	return get_setup(dpcm)->rate_shift;
 }
 
-/* call in cable->lock */
-static void loopback_timer_start(struct loopback_pcm *dpcm)
+/*
+ * The captures of an event driven cable are not clocked, the cable worker
+ * reports the frames pushed to them
+ */
+static inline bool loopback_event_capture(struct loopback_pcm *dpcm)
 {
-	unsigned long tick;
-	unsigned int rate_shift = get_rate_shift(dpcm);
+	return dpcm->cable->event &&
+	       dpcm->substream->stream == SNDRV_PCM_STREAM_CAPTURE;
+}
 
-	if (rate_shift != dpcm->pcm_rate_shift) {
-		dpcm->pcm_rate_shift = rate_shift;
-		dpcm->period_size_frac = frac_pos(dpcm, dpcm->pcm_period_size);
+/* Arm the timer of a running end for its next period. call in cable->lock */
+static void loopback_timer_arm(struct loopback_pcm *dpcm)
+{
+	u64 tick_ns;
+
+	/* ticks are delivered by the core's shared clock */
+	if (dpcm->cable->clock == SND_AVIRT_CLOCK_SHARED ||
+	    loopback_event_capture(dpcm))
+		return;
+	tick_ns = period_rest_ns(dpcm);
+	if (dpcm->cable->clock == SND_AVIRT_CLOCK_HRTIMER) {
+		/* fire at the exact period boundary */
+		hrtimer_start(&dpcm->hrtimer, ns_to_ktime(tick_ns),
+			      HRTIMER_MODE_REL);
+		return;
 	}
+	mod_timer(&dpcm->timer,
+		  jiffies + DIV_ROUND_UP_ULL(tick_ns * HZ, NSEC_PER_SEC));
+}
+
+/* Rearm an end from the cable worker. call in work_lock and cable->lock */
+static void loopback_timer_start(struct loopback_pcm *dpcm)
+{
+	dpcm->pcm_rate_shift = get_rate_shift(dpcm);
 	if (dpcm->period_size_frac <= dpcm->irq_pos) {
-		dpcm->irq_pos %= dpcm->period_size_frac;
+		div64_u64_rem(dpcm->irq_pos, dpcm->period_size_frac,
+			      &dpcm->irq_pos);
 		dpcm->period_update_pending = 1;
 	}
-	tick = dpcm->period_size_frac - dpcm->irq_pos;
-	tick = (tick + dpcm->pcm_bps - 1) / dpcm->pcm_bps;
-	mod_timer(&dpcm->timer, jiffies + tick);
+	loopback_timer_arm(dpcm);
 }
 
 /* call in cable->lock */
 static inline void loopback_timer_stop(struct loopback_pcm *dpcm)
 {
+	/* shared clock is stopped outside of cable->lock */
+	if (dpcm->cable->clock == SND_AVIRT_CLOCK_SHARED ||
+	    loopback_event_capture(dpcm))
+		return;
+	if (dpcm->cable->clock == SND_AVIRT_CLOCK_HRTIMER) {
+		hrtimer_try_to_cancel(&dpcm->hrtimer);
+		return;
+	}
 	del_timer(&dpcm->timer);
 	dpcm->timer.expires = 0;
 }
 
 static inline void loopback_timer_stop_sync(struct loopback_pcm *dpcm)
 {
+	/*
+	 * shared clock is synchronised in snd_avirt_clock_detach(), and the
+	 * cable worker in free_cable()
+	 */
+	if (dpcm->cable->clock == SND_AVIRT_CLOCK_SHARED ||
+	    loopback_event_capture(dpcm))
+		return;
+	if (dpcm->cable->clock == SND_AVIRT_CLOCK_HRTIMER) {
+		hrtimer_cancel(&dpcm->hrtimer);
+		return;
+	}
 	del_timer_sync(&dpcm->timer);
 }
 
+/* Start time of a (re)started stream. Call outside of cable->lock */
+static inline u64 loopback_clock_start(struct loopback_pcm *dpcm)
+{
+	if (dpcm->cable->clock == SND_AVIRT_CLOCK_SHARED &&
+	    !loopback_event_capture(dpcm))
+		return snd_avirt_clock_start(dpcm->clock_client);
+	return ktime_get_ns();
+}
+
+/* call outside of cable->lock */
+static inline void loopback_clock_stop(struct loopback_pcm *dpcm)
+{
+	if (dpcm->cable->clock == SND_AVIRT_CLOCK_SHARED &&
+	    !loopback_event_capture(dpcm))
+		snd_avirt_clock_stop(dpcm->clock_client);
+}
+
 #define CABLE_VALID_PLAYBACK (1 << SNDRV_PCM_STREAM_PLAYBACK)
-#define CABLE_VALID_CAPTURE (1 << SNDRV_PCM_STREAM_CAPTURE)
-#define CABLE_VALID_BOTH (CABLE_VALID_PLAYBACK | CABLE_VALID_CAPTURE)
+#define CABLE_VALID_CAPTURE (((1 << MAX_READERS) - 1) << SNDRV_PCM_STREAM_CAPTURE)
+
+#define cable_bit(dpcm) (1 << (dpcm)->index)
 
-static int loopback_check_format(struct loopback_cable *cable, int stream)
+/* Iterate over the open captures of a cable */
+#define for_each_capture(cable, capt, i)                        \
+	for ((i) = SNDRV_PCM_STREAM_CAPTURE; (i) < CABLE_ENDS; (i)++) \
+		if (!((capt) = (cable)->streams[(i)])) {          \
+		} else
+
+/* Attach to the shared clock class of @ns. call in loopback->cable_lock */
+static int loopback_clock_attach(struct loopback_pcm *dpcm, u64 ns)
 {
-	struct snd_pcm_runtime *runtime, *cruntime;
-	struct loopback_setup *setup;
-	struct snd_card *card;
-	int check;
+	int err;
+
+	err = snd_avirt_clock_attach(dpcm->clock_client, ns);
+	if (err < 0)
+		return err;
+	dpcm->clock_period_ns = ns;
+	return 0;
+}
+
+/*
+ * Move a stream attached to the shared clock to the class of @ns, as its rate
+ * shift changed. The spare client is attached to the new class, then takes
+ * over from the client in use under the stream lock, which serialises the
+ * swap with the trigger. The position carries on, as only the ticks change.
+ * call in loopback->cable_lock
+ */
+static int loopback_clock_move(struct loopback_pcm *dpcm, u64 ns)
+{
+	struct snd_pcm_substream *substream = dpcm->substream;
+	struct loopback_cable *cable = dpcm->cable;
+	struct snd_avirt_clock_client *old = dpcm->clock_client;
+	struct snd_avirt_clock_client *new =
+		&dpcm->clock_clients[old == dpcm->clock_clients];
+	bool running;
+	int err;
 
-	if (cable->valid != CABLE_VALID_BOTH) {
-		if (stream == SNDRV_PCM_STREAM_PLAYBACK)
-			goto __notify;
+	if (dpcm->clock_period_ns == ns)
 		return 0;
+
+	err = snd_avirt_clock_attach(new, ns);
+	if (err < 0)
+		return err;
+
+	snd_pcm_stream_lock_irq(substream);
+	spin_lock(&cable->lock);
+	running = (cable->running & ~cable->pause) & cable_bit(dpcm);
+	spin_unlock(&cable->lock);
+	if (running) {
+		snd_avirt_clock_start(new);
+		snd_avirt_clock_stop(old);
 	}
-	runtime = cable->streams[SNDRV_PCM_STREAM_PLAYBACK]->substream->runtime;
-	cruntime = cable->streams[SNDRV_PCM_STREAM_CAPTURE]->substream->runtime;
-	check = runtime->format != cruntime->format ||
-		runtime->rate != cruntime->rate ||
-		runtime->channels != cruntime->channels;
-	if (!check)
+	dpcm->clock_client = new;
+	dpcm->clock_period_ns = ns;
+	snd_pcm_stream_unlock_irq(substream);
+
+	snd_avirt_clock_detach(old);
+	return 0;
+}
+
+/* The only open capture of a cable, or NULL. call in cable->lock */
+static struct loopback_pcm *loopback_single_capture(struct loopback_cable *cable)
+{
+	struct loopback_pcm *capt, *single = NULL;
+	unsigned int i;
+
+	for_each_capture(cable, capt, i) {
+		if (single)
+			return NULL;
+		single = capt;
+	}
+	return single;
+}
+
+/* call in cable->lock */
+static inline bool loopback_zc_playing(struct loopback_cable *cable,
+				       struct loopback_zc *zc)
+{
+	struct loopback_pcm *play = cable->streams[SNDRV_PCM_STREAM_PLAYBACK];
+
+	return play && play->zc == zc &&
+	       ((cable->running ^ cable->pause) & CABLE_VALID_PLAYBACK);
+}
+
+/*
+ * A zero-copy capture must follow the playback position, so it can only be
+ * (re)started while the playback runs on the same buffer. It starts from the
+ * playback position last published by the cable worker. call in cable->lock
+ */
+static int loopback_zc_start(struct loopback_pcm *dpcm)
+{
+	struct loopback_cable *cable = dpcm->cable;
+
+	if (!dpcm->zc || dpcm->substream->stream != SNDRV_PCM_STREAM_CAPTURE)
 		return 0;
-	if (stream == SNDRV_PCM_STREAM_CAPTURE) {
+	if (!loopback_zc_playing(cable, dpcm->zc))
 		return -EIO;
-	} else {
-		snd_pcm_stop(
-			cable->streams[SNDRV_PCM_STREAM_CAPTURE]->substream,
-			SNDRV_PCM_STATE_DRAINING);
-	__notify:
-		runtime = cable->streams[SNDRV_PCM_STREAM_PLAYBACK]
-				  ->substream->runtime;
-		setup = get_setup(cable->streams[SNDRV_PCM_STREAM_PLAYBACK]);
-		card = cable->streams[SNDRV_PCM_STREAM_PLAYBACK]->loopback->card;
+	dpcm->buf_pos =
+		READ_ONCE(cable->streams[SNDRV_PCM_STREAM_PLAYBACK]->buf_pos);
+	return 0;
+}
+
+/*
+ * Once the playback stops, the data it leaves behind is stale, and it may be
+ * overwritten by the next playback fill. Stop the zero-copy captures with it.
+ */
+static void loopback_zc_stop(struct loopback_pcm *dpcm)
+{
+	struct loopback_cable *cable = dpcm->cable;
+	struct snd_pcm_substream *stop[MAX_READERS];
+	struct loopback_pcm *capt;
+	unsigned int i, count = 0;
+
+	if (!dpcm->zc || dpcm->substream->stream != SNDRV_PCM_STREAM_PLAYBACK)
+		return;
+	spin_lock(&cable->lock);
+	for_each_capture(cable, capt, i) {
+		if (capt->zc == dpcm->zc && (cable->running & cable_bit(capt)))
+			stop[count++] = capt->substream;
+	}
+	spin_unlock(&cable->lock);
+	for (i = 0; i < count; i++)
+		snd_pcm_stop(stop[i], SNDRV_PCM_STATE_DRAINING);
+}
+
+static void copy_ring(char *dst, unsigned int dst_off, unsigned int dst_size,
+		      const char *src, unsigned int src_off,
+		      unsigned int src_size, unsigned int bytes)
+{
+	for (;;) {
+		unsigned int size = bytes;
+		if (src_off + size > src_size)
+			size = src_size - src_off;
+		if (dst_off + size > dst_size)
+			size = dst_size - dst_off;
+		memcpy(dst + dst_off, src + src_off, size);
+		bytes -= size;
+		if (!bytes)
+			break;
+		src_off = (src_off + size) % src_size;
+		dst_off = (dst_off + size) % dst_size;
+	}
+}
+
+/*
+ * The direct writes are only valid while both ends advance in lockstep, and
+ * no other capture reads the playback. Before either end stops or pauses, or
+ * another capture is opened, the data not played yet must move back to the
+ * playback buffer. Cancel the direct writes in flight, and have the cable
+ * worker move the data before it next advances the ends. call in cable->lock
+ */
+static void loopback_direct_stop(struct loopback_cable *cable)
+{
+	cable->direct_seq++;
+	cable->direct_flush = 1;
+}
+
+/*
+ * Move the direct range back to the playback buffer, from the positions the
+ * ends had in lockstep. Called by the cable worker, call in work_lock
+ */
+static void loopback_direct_flush(struct loopback_cable *cable)
+{
+	struct loopback_pcm *play = cable->streams[SNDRV_PCM_STREAM_PLAYBACK];
+	struct loopback_pcm *capt = loopback_single_capture(cable);
+	unsigned int lead, pos, bytes;
+
+	if (!play)
+		return;
+	spin_lock_irq(&cable->lock);
+	pos = play->direct_pos;
+	bytes = play->direct_bytes;
+	play->direct_bytes = 0;
+	spin_unlock_irq(&cable->lock);
+	if (!capt || !bytes)
+		return;
+
+	lead = (pos + play->pcm_buffer_size - play->buf_pos) %
+	       play->pcm_buffer_size;
+	copy_ring(play->substream->runtime->dma_area, pos,
+		  play->pcm_buffer_size, capt->substream->runtime->dma_area,
+		  (capt->buf_pos + lead) % capt->pcm_buffer_size,
+		  capt->pcm_buffer_size, bytes);
+}
+
+/* Cancel and flush the direct writes now. call in work_lock */
+static void loopback_direct_sync(struct loopback_cable *cable)
+{
+	spin_lock_irq(&cable->lock);
+	cable->direct_seq++;
+	spin_unlock_irq(&cable->lock);
+	loopback_direct_flush(cable);
+}
+
+/* the cable converts between sample formats, and rates if enabled */
+static bool loopback_format_mismatch(struct loopback_pcm *play,
+				     struct loopback_pcm *capt)
+{
+	struct snd_pcm_runtime *runtime = play->substream->runtime;
+	struct snd_pcm_runtime *cruntime = capt->substream->runtime;
+	const struct snd_avirt_route *route = get_route(capt);
+
+	return (runtime->rate != cruntime->rate && !capt->src) ||
+	       (route ? route->channels : runtime->channels) !=
+		       cruntime->channels;
+}
+
+static int loopback_check_format(struct loopback_pcm *dpcm)
+{
+	struct loopback_cable *cable = dpcm->cable;
+	struct loopback_pcm *play = cable->streams[SNDRV_PCM_STREAM_PLAYBACK];
+	struct snd_pcm_runtime *runtime;
+	struct loopback_setup *setup;
+	struct loopback_pcm *capt;
+	struct snd_card *card;
+	unsigned int i;
+	bool notify;
+
+	if (dpcm->substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		if (!(cable->valid & CABLE_VALID_PLAYBACK) ||
+		    !(cable->valid & cable_bit(dpcm)))
+			return 0;
+		return loopback_format_mismatch(play, dpcm) ? -EIO : 0;
+	}
+
+	/* the playback stops each capture it cannot feed */
+	notify = !(cable->valid & CABLE_VALID_CAPTURE);
+	for_each_capture(cable, capt, i) {
+		if (!(cable->valid & cable_bit(capt)) ||
+		    !loopback_format_mismatch(play, capt))
+			continue;
+		snd_pcm_stop(capt->substream, SNDRV_PCM_STATE_DRAINING);
+		notify = true;
+	}
+	if (notify) {
+		runtime = play->substream->runtime;
+		setup = get_setup(play);
+		card = play->loopback->card;
 		if (setup->format != runtime->format) {
 			snd_ctl_notify(card, SNDRV_CTL_EVENT_MASK_VALUE,
 				       &setup->format_id);
@@ -224,6 +618,20 @@ static int loopback_check_format(struct loopback_cable *cable, int stream)
 	return 0;
 }
 
+/* Realign the rate converters fed by @dpcm. call in cable->lock */
+static void loopback_src_prime(struct loopback_pcm *dpcm)
+{
+	struct loopback_pcm *capt;
+	unsigned int i;
+
+	if (dpcm->substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		dpcm->src_prime = 1;
+		return;
+	}
+	for_each_capture(dpcm->cable, capt, i)
+		capt->src_prime = 1;
+}
+
 static void loopback_active_notify(struct loopback_pcm *dpcm)
 {
 	snd_ctl_notify(dpcm->loopback->card, SNDRV_CTL_EVENT_MASK_VALUE,
@@ -235,50 +643,72 @@ static int loopback_trigger(struct snd_pcm_substream *substream, int cmd)
 	struct snd_pcm_runtime *runtime = substream->runtime;
 	struct loopback_pcm *dpcm = runtime->private_data;
 	struct loopback_cable *cable = dpcm->cable;
-	int err, stream = 1 << substream->stream;
+	int err, stream = cable_bit(dpcm);
+	u64 now;
 
 	AP_INFOK();
 
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
-		err = loopback_check_format(cable, substream->stream);
+		err = loopback_check_format(dpcm);
 		if (err < 0)
 			return err;
-		dpcm->last_jiffies = jiffies;
-		dpcm->pcm_rate_shift = 0;
+		dpcm->last_ns = loopback_clock_start(dpcm);
+		dpcm->pcm_rate_shift = get_rate_shift(dpcm);
 		dpcm->last_drift = 0;
 		spin_lock(&cable->lock);
+		err = loopback_zc_start(dpcm);
+		if (err < 0) {
+			spin_unlock(&cable->lock);
+			loopback_clock_stop(dpcm);
+			return err;
+		}
 		cable->running |= stream;
 		cable->pause &= ~stream;
-		loopback_timer_start(dpcm);
+		loopback_src_prime(dpcm);
+		loopback_timer_arm(dpcm);
 		spin_unlock(&cable->lock);
 		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
 			loopback_active_notify(dpcm);
 		break;
 	case SNDRV_PCM_TRIGGER_STOP:
 		spin_lock(&cable->lock);
+		loopback_direct_stop(cable);
 		cable->running &= ~stream;
 		cable->pause &= ~stream;
 		loopback_timer_stop(dpcm);
 		spin_unlock(&cable->lock);
+		loopback_clock_stop(dpcm);
+		loopback_zc_stop(dpcm);
 		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
 			loopback_active_notify(dpcm);
 		break;
 	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
 	case SNDRV_PCM_TRIGGER_SUSPEND:
 		spin_lock(&cable->lock);
+		loopback_direct_stop(cable);
 		cable->pause |= stream;
 		loopback_timer_stop(dpcm);
 		spin_unlock(&cable->lock);
+		loopback_clock_stop(dpcm);
+		loopback_zc_stop(dpcm);
 		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
 			loopback_active_notify(dpcm);
 		break;
 	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
 	case SNDRV_PCM_TRIGGER_RESUME:
+		now = loopback_clock_start(dpcm);
 		spin_lock(&cable->lock);
-		dpcm->last_jiffies = jiffies;
+		err = loopback_zc_start(dpcm);
+		if (err < 0) {
+			spin_unlock(&cable->lock);
+			loopback_clock_stop(dpcm);
+			return err;
+		}
+		dpcm->last_ns = now;
 		cable->pause &= ~stream;
-		loopback_timer_start(dpcm);
+		loopback_src_prime(dpcm);
+		loopback_timer_arm(dpcm);
 		spin_unlock(&cable->lock);
 		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
 			loopback_active_notify(dpcm);
@@ -295,36 +725,118 @@ static void params_change(struct snd_pcm_substream *substream)
 	struct loopback_pcm *dpcm = runtime->private_data;
 	struct loopback_cable *cable = dpcm->cable;
 
-	cable->hw.formats = pcm_format_to_bits(runtime->format);
-	cable->hw.rate_min = runtime->rate;
-	cable->hw.rate_max = runtime->rate;
+	/* with a rate converter, each end picks its own rate */
+	if (!get_setup(dpcm)->src) {
+		cable->hw.rate_min = runtime->rate;
+		cable->hw.rate_max = runtime->rate;
+	}
 	cable->hw.channels_min = runtime->channels;
 	cable->hw.channels_max = runtime->channels;
 }
 
+/*
+ * (Re)create the rate converter of a capture once both ends are prepared, if
+ * they run at different rates. call in loopback->cable_lock and work_lock
+ */
+static int loopback_src_setup(struct loopback_pcm *capt)
+{
+	struct loopback_cable *cable = capt->cable;
+	struct snd_pcm_runtime *runtime, *cruntime;
+	struct snd_avirt_src *src = NULL, *old_src;
+	s32 *buf = NULL, *old_buf;
+	/* event driven captures are written as the playback is */
+	unsigned int mode = cable->event ? SND_AVIRT_SRC_NONE :
+					   get_setup(capt)->src;
+	unsigned int channels;
+
+	if ((cable->valid & CABLE_VALID_PLAYBACK) &&
+	    (cable->valid & cable_bit(capt)) && mode != SND_AVIRT_SRC_NONE) {
+		runtime = cable->streams[SNDRV_PCM_STREAM_PLAYBACK]
+				  ->substream->runtime;
+		cruntime = capt->substream->runtime;
+		/* a routed capture converts its own channels */
+		channels = get_route(capt) ? get_route(capt)->channels :
+					     runtime->channels;
+		if (runtime->rate != cruntime->rate &&
+		    channels == cruntime->channels) {
+			src = snd_avirt_src_create(mode, runtime->rate,
+						   cruntime->rate, channels);
+			if (IS_ERR(src))
+				return PTR_ERR(src);
+			buf = kmalloc_array(2 * LOOPBACK_SRC_CHUNK * channels,
+					    sizeof(s32), GFP_KERNEL);
+			if (!buf) {
+				snd_avirt_src_free(src);
+				return -ENOMEM;
+			}
+		}
+	}
+
+	spin_lock_irq(&cable->lock);
+	old_src = capt->src;
+	old_buf = capt->src_buf;
+	capt->src = src;
+	capt->src_buf = buf;
+	capt->src_prime = 1;
+	spin_unlock_irq(&cable->lock);
+
+	snd_avirt_src_free(old_src);
+	kfree(old_buf);
+
+	return 0;
+}
+
+/* Set up the converters of every capture fed by @dpcm */
+static int loopback_src_setup_all(struct loopback_pcm *dpcm)
+{
+	struct loopback_pcm *capt;
+	unsigned int i;
+	int err;
+
+	if (dpcm->substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+		return loopback_src_setup(dpcm);
+	for_each_capture(dpcm->cable, capt, i) {
+		err = loopback_src_setup(capt);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
 static int loopback_prepare(struct snd_pcm_substream *substream)
 {
 	struct snd_pcm_runtime *runtime = substream->runtime;
 	struct loopback_pcm *dpcm = runtime->private_data;
 	struct loopback_cable *cable = dpcm->cable;
-	int bps, salign;
+	int bps, salign, err;
 
 	loopback_timer_stop_sync(dpcm);
 
-	salign =
-		(snd_pcm_format_width(runtime->format) * runtime->channels) / 8;
+	salign = snd_pcm_format_physical_width(runtime->format) *
+		 runtime->channels / 8;
 	bps = salign * runtime->rate;
 	if (bps <= 0 || salign <= 0)
 		return -EINVAL;
 
+	/* the cable worker keeps off the end while it is reset */
+	mutex_lock(&dpcm->loopback->cable_lock);
+	mutex_lock(&cable->work_lock);
+	/* no worker run may have flushed the direct writes since the stop */
+	loopback_direct_sync(cable);
 	dpcm->buf_pos = 0;
+	dpcm->direct_bytes = 0;
 	dpcm->pcm_buffer_size = frames_to_bytes(runtime, runtime->buffer_size);
 	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
-		/* clear capture buffer */
+		/* clear capture buffer, unless it holds the playback data */
 		dpcm->silent_size = dpcm->pcm_buffer_size;
-		snd_pcm_format_set_silence(runtime->format, runtime->dma_area,
-					   runtime->buffer_size *
-						   runtime->channels);
+		if (!dpcm->zc)
+			snd_pcm_format_set_silence(runtime->format,
+						   runtime->dma_area,
+						   runtime->buffer_size *
+							   runtime->channels);
+		/* the stream starts at the gain set, without a ramp */
+		snd_avirt_gain_reset(&dpcm->gain,
+				     READ_ONCE(get_setup(dpcm)->gain));
 	}
 
 	dpcm->irq_pos = 0;
@@ -332,16 +844,30 @@ static int loopback_prepare(struct snd_pcm_substream *substream)
 	dpcm->pcm_bps = bps;
 	dpcm->pcm_salign = salign;
 	dpcm->pcm_period_size = frames_to_bytes(runtime, runtime->period_size);
+	dpcm->period_size_frac = frac_pos(dpcm, dpcm->pcm_period_size);
 
-	mutex_lock(&dpcm->loopback->cable_lock);
-	if (!(cable->valid & ~(1 << substream->stream)) ||
+	dpcm->event_appl = runtime->control->appl_ptr;
+	dpcm->event_pending = 0;
+
+	if (cable->clock == SND_AVIRT_CLOCK_SHARED &&
+	    !loopback_event_capture(dpcm)) {
+		/* serialised with loopback_clock_move() by cable_lock */
+		err = loopback_clock_attach(dpcm,
+					    period_ns(dpcm, get_rate_shift(dpcm)));
+		if (err < 0)
+			goto unlock;
+	}
+	if (!(cable->valid & ~cable_bit(dpcm)) ||
 	    (get_setup(dpcm)->notify &&
 	     substream->stream == SNDRV_PCM_STREAM_PLAYBACK))
 		params_change(substream);
-	cable->valid |= 1 << substream->stream;
+	cable->valid |= cable_bit(dpcm);
+	err = loopback_src_setup_all(dpcm);
+unlock:
+	mutex_unlock(&cable->work_lock);
 	mutex_unlock(&dpcm->loopback->cable_lock);
 
-	return 0;
+	return err;
 }
 
 static void clear_capture_buf(struct loopback_pcm *dpcm, unsigned int bytes)
@@ -349,12 +875,15 @@ static void clear_capture_buf(struct loopback_pcm *dpcm, unsigned int bytes)
 	struct snd_pcm_runtime *runtime = dpcm->substream->runtime;
 	char *dst = runtime->dma_area;
 	unsigned int dst_off = dpcm->buf_pos;
+	struct snd_avirt_cpu cpu;
 
 	if (dpcm->silent_size >= dpcm->pcm_buffer_size)
 		return;
 	if (dpcm->silent_size + bytes > dpcm->pcm_buffer_size)
 		bytes = dpcm->pcm_buffer_size - dpcm->silent_size;
+	snd_avirt_stat_add(dpcm->substream, SND_AVIRT_STAT_SILENCE, bytes);
 
+	snd_avirt_cpu_enter(&cpu, &dpcm->cable->cpu_nested);
 	for (;;) {
 		unsigned int size = bytes;
 		if (dst_off + size > dpcm->pcm_buffer_size)
@@ -368,174 +897,925 @@ static void clear_capture_buf(struct loopback_pcm *dpcm, unsigned int bytes)
 			break;
 		dst_off = 0;
 	}
+	snd_avirt_stat_add(dpcm->substream, SND_AVIRT_STAT_CPU_SILENCE,
+			   snd_avirt_cpu_exit(&cpu, &dpcm->cable->cpu_nested));
+}
+
+/* call in work_lock */
+static void silence_buf(struct loopback_pcm *dpcm, unsigned int off,
+			unsigned int bytes)
+{
+	struct snd_pcm_runtime *runtime = dpcm->substream->runtime;
+	struct snd_avirt_cpu cpu;
+
+	snd_avirt_cpu_enter(&cpu, &dpcm->cable->cpu_nested);
+	for (;;) {
+		unsigned int size = bytes;
+		if (off + size > dpcm->pcm_buffer_size)
+			size = dpcm->pcm_buffer_size - off;
+		snd_pcm_format_set_silence(runtime->format,
+					   runtime->dma_area + off,
+					   bytes_to_frames(runtime, size) *
+						   runtime->channels);
+		bytes -= size;
+		if (!bytes)
+			break;
+		off = 0;
+	}
+	snd_avirt_stat_add(dpcm->substream, SND_AVIRT_STAT_CPU_SILENCE,
+			   snd_avirt_cpu_exit(&cpu, &dpcm->cable->cpu_nested));
+}
+
+/* call in work_lock */
+static void copy_frames(struct loopback_pcm *play, unsigned int src_off,
+			struct loopback_pcm *capt, unsigned int dst_off,
+			unsigned int frames, snd_avirt_convert_t convert)
+{
+	char *src = play->substream->runtime->dma_area;
+	char *dst = capt->substream->runtime->dma_area;
+	unsigned int channels = capt->substream->runtime->channels;
+	struct snd_avirt_cpu cpu;
+
+	snd_avirt_cpu_enter(&cpu, &capt->cable->cpu_nested);
+	capt->silent_size = 0;
+	while (frames) {
+		unsigned int n = frames;
+		n = min(n, (play->pcm_buffer_size - src_off) / play->pcm_salign);
+		n = min(n, (capt->pcm_buffer_size - dst_off) / capt->pcm_salign);
+		if (convert)
+			convert(dst + dst_off, src + src_off, n * channels);
+		else
+			memcpy(dst + dst_off, src + src_off, n * play->pcm_salign);
+		frames -= n;
+		src_off = (src_off + n * play->pcm_salign) % play->pcm_buffer_size;
+		dst_off = (dst_off + n * capt->pcm_salign) % capt->pcm_buffer_size;
+	}
+	snd_avirt_stat_add(capt->substream, SND_AVIRT_STAT_CPU_COPY,
+			   snd_avirt_cpu_exit(&cpu, &capt->cable->cpu_nested));
+}
+
+/*
+ * Copy @frames through the routing and gain of the capture, a chunk at a time
+ * through native s32 samples. call in work_lock
+ */
+static void conv_copy_frames(struct loopback_pcm *play, unsigned int src_off,
+			     struct loopback_pcm *capt, unsigned int dst_off,
+			     unsigned int frames, unsigned int gain)
+{
+	struct snd_pcm_runtime *runtime = play->substream->runtime;
+	struct snd_pcm_runtime *cruntime = capt->substream->runtime;
+	const struct snd_avirt_route *route = get_route(capt);
+	unsigned int channels = cruntime->channels;
+	s32 *in = capt->conv_buf, *out = capt->conv_buf;
+	snd_avirt_convert_t load, store;
+	struct snd_avirt_cpu cpu;
+
+	snd_avirt_cpu_enter(&cpu, &capt->cable->cpu_nested);
+	load = snd_avirt_convert_get(runtime->format, SNDRV_PCM_FORMAT_S32);
+	store = snd_avirt_convert_get(SNDRV_PCM_FORMAT_S32, cruntime->format);
+	if (route)
+		out += LOOPBACK_SRC_CHUNK * runtime->channels;
+	capt->silent_size = 0;
+	while (frames) {
+		unsigned int n = min_t(unsigned int, frames, LOOPBACK_SRC_CHUNK);
+		n = min(n, (play->pcm_buffer_size - src_off) / play->pcm_salign);
+		n = min(n, (capt->pcm_buffer_size - dst_off) / capt->pcm_salign);
+		load(in, runtime->dma_area + src_off, n * runtime->channels);
+		if (route)
+			snd_avirt_route_apply(route, out, in, n,
+					      runtime->channels);
+		if (!snd_avirt_gain_is_unity(&capt->gain, gain))
+			snd_avirt_gain_apply(&capt->gain, gain,
+					     cruntime->period_size, out, n,
+					     channels);
+		store(cruntime->dma_area + dst_off, out, n * channels);
+		frames -= n;
+		src_off = (src_off + n * play->pcm_salign) % play->pcm_buffer_size;
+		dst_off = (dst_off + n * capt->pcm_salign) % capt->pcm_buffer_size;
+	}
+	snd_avirt_stat_add(capt->substream, SND_AVIRT_STAT_CPU_COPY,
+			   snd_avirt_cpu_exit(&cpu, &capt->cable->cpu_nested));
+}
+
+/*
+ * Copy @frames the way the capture needs them: plain, with a format
+ * conversion, or through its routing and gain. call in work_lock
+ */
+static void cable_copy_frames(struct loopback_pcm *play, unsigned int src_off,
+			      struct loopback_pcm *capt, unsigned int dst_off,
+			      unsigned int frames)
+{
+	struct snd_pcm_runtime *runtime = play->substream->runtime;
+	struct snd_pcm_runtime *cruntime = capt->substream->runtime;
+	unsigned int gain = READ_ONCE(get_setup(capt)->gain);
+	snd_avirt_convert_t convert = NULL;
+
+	if (!snd_avirt_gain_is_unity(&capt->gain, gain) || get_route(capt)) {
+		conv_copy_frames(play, src_off, capt, dst_off, frames, gain);
+		return;
+	}
+	if (runtime->format != cruntime->format)
+		convert = snd_avirt_convert_get(runtime->format,
+						cruntime->format);
+	copy_frames(play, src_off, capt, dst_off, frames, convert);
+}
+
+/* Number of the next @frames holding playback data */
+static unsigned int play_valid_frames(struct loopback_pcm *play,
+				      unsigned int frames)
+{
+	struct snd_pcm_runtime *runtime = play->substream->runtime;
+
+	/* check if playback is draining, trim the capture copy size
+	 * when our pointer is at the end of playback ring buffer */
+	if (runtime->status->state == SNDRV_PCM_STATE_DRAINING &&
+	    snd_pcm_playback_hw_avail(runtime) < runtime->buffer_size) {
+		snd_pcm_uframes_t appl_ptr, appl_ptr1, diff;
+		appl_ptr = appl_ptr1 = runtime->control->appl_ptr;
+		appl_ptr1 -= appl_ptr1 % runtime->buffer_size;
+		appl_ptr1 += play->buf_pos / play->pcm_salign;
+		if (appl_ptr < appl_ptr1)
+			appl_ptr1 -= runtime->buffer_size;
+		diff = appl_ptr - appl_ptr1;
+		if (diff < frames)
+			return diff;
+	}
+	return frames;
+}
+
+/*
+ * Copy the @frames played after the first @offset frames from the playback
+ * position to the capture position. call in work_lock
+ */
+static void copy_play_buf(struct loopback_pcm *play, struct loopback_pcm *capt,
+			  unsigned int offset, unsigned int frames)
+{
+	unsigned int src_off = (play->buf_pos + offset * play->pcm_salign) %
+			       play->pcm_buffer_size;
+	unsigned int dst_off = capt->buf_pos;
+	unsigned int clear_frames, valid;
+	unsigned int lead, skip;
+
+	clear_frames = frames;
+	valid = play_valid_frames(play, offset + frames);
+	frames = valid > offset ? min(valid - offset, frames) : 0;
+	clear_frames -= frames;
+	trace_loopback_copy_play_buf(capt->substream, src_off, dst_off,
+				     frames * capt->pcm_salign,
+				     clear_frames * capt->pcm_salign);
+	snd_avirt_stat_add(capt->substream, SND_AVIRT_STAT_BYTES,
+			   frames * capt->pcm_salign);
+
+	if (capt->zc && capt->zc == play->zc) {
+		/* the capture reads in place, just hide what was not written */
+		if (clear_frames > 0)
+			silence_buf(capt,
+				    (dst_off + frames * capt->pcm_salign) %
+					    capt->pcm_buffer_size,
+				    clear_frames * capt->pcm_salign);
+		return;
+	}
+
+	/* the ack shrinks the direct range on a rewind */
+	spin_lock_irq(&play->cable->lock);
+	lead = (play->direct_pos + play->pcm_buffer_size - src_off) %
+	       play->pcm_buffer_size / play->pcm_salign;
+	skip = 0;
+	if (play->direct_bytes && lead < frames) {
+		/* same format on both ends, see loopback_direct_reserve() */
+		skip = min(frames - lead, play->direct_bytes / play->pcm_salign);
+		play->direct_pos = (play->direct_pos + skip * play->pcm_salign) %
+				   play->pcm_buffer_size;
+		play->direct_bytes -= skip * play->pcm_salign;
+	}
+	spin_unlock_irq(&play->cable->lock);
+
+	if (skip) {
+		/* copy up to the data already in place, then skip it */
+		copy_frames(play, src_off, capt, dst_off, lead, NULL);
+		skip += lead;
+		frames -= skip;
+		src_off = (src_off + skip * play->pcm_salign) %
+			  play->pcm_buffer_size;
+		dst_off = (dst_off + skip * capt->pcm_salign) %
+			  capt->pcm_buffer_size;
+	}
+
+	cable_copy_frames(play, src_off, capt, dst_off, frames);
+
+	if (clear_frames > 0) {
+		/* after the frames copied, not over them */
+		snd_avirt_stat_add(capt->substream, SND_AVIRT_STAT_SILENCE,
+				   clear_frames * capt->pcm_salign);
+		silence_buf(capt,
+			    (dst_off + frames * capt->pcm_salign) %
+				    capt->pcm_buffer_size,
+			    clear_frames * capt->pcm_salign);
+	}
+}
+
+/* Store converter output at the capture write offset. call in work_lock */
+static void src_store(struct loopback_pcm *capt, snd_avirt_convert_t store,
+		      const s32 *out, unsigned int frames)
+{
+	char *dst = capt->substream->runtime->dma_area;
+	unsigned int channels = capt->substream->runtime->channels;
+
+	while (frames) {
+		unsigned int n = frames;
+		n = min(n, (capt->pcm_buffer_size - capt->src_wpos) /
+				   capt->pcm_salign);
+		store(dst + capt->src_wpos, out, n * channels);
+		snd_avirt_stat_add(capt->substream, SND_AVIRT_STAT_BYTES,
+				   n * capt->pcm_salign);
+		out += n * channels;
+		frames -= n;
+		capt->src_wpos = (capt->src_wpos + n * capt->pcm_salign) %
+				 capt->pcm_buffer_size;
+	}
+}
+
+/*
+ * Feed @frames playback frames through the rate converter. The output is
+ * written LOOPBACK_SRC_MARGIN frames ahead of the capture position, so that
+ * the conversion jitter never exposes unwritten data. call in work_lock
+ */
+static void src_copy_play_buf(struct loopback_pcm *play,
+			      struct loopback_pcm *capt, unsigned int frames)
+{
+	struct snd_pcm_runtime *runtime = play->substream->runtime;
+	struct snd_pcm_runtime *cruntime = capt->substream->runtime;
+	const struct snd_avirt_route *route = get_route(capt);
+	/* the frames are routed before the conversion */
+	unsigned int channels = cruntime->channels;
+	unsigned int src_off = play->buf_pos;
+	unsigned int gain = READ_ONCE(get_setup(capt)->gain);
+	unsigned int valid, n, pos, used, done, ramp;
+	s32 *in = capt->src_buf;
+	s32 *out = capt->src_buf + LOOPBACK_SRC_CHUNK * channels;
+	snd_avirt_convert_t load, store;
+	struct snd_avirt_cpu cpu;
+
+	snd_avirt_cpu_enter(&cpu, &capt->cable->cpu_nested);
+	if (capt->src_prime) {
+		snd_avirt_src_reset(capt->src);
+		silence_buf(capt, capt->buf_pos,
+			    LOOPBACK_SRC_MARGIN * capt->pcm_salign);
+		capt->src_wpos = (capt->buf_pos +
+				  LOOPBACK_SRC_MARGIN * capt->pcm_salign) %
+				 capt->pcm_buffer_size;
+		capt->src_prime = 0;
+	}
+
+	load = snd_avirt_convert_get(runtime->format, SNDRV_PCM_FORMAT_S32);
+	store = snd_avirt_convert_get(SNDRV_PCM_FORMAT_S32, cruntime->format);
+	/* a gain ramp lasts a capture period, the frames are at the input rate */
+	ramp = mul_u64_u32_div(cruntime->period_size, runtime->rate,
+			       cruntime->rate);
+	valid = play_valid_frames(play, frames);
+	capt->silent_size = 0;
+
+	while (frames) {
+		n = min_t(unsigned int, frames, LOOPBACK_SRC_CHUNK);
+		if (valid) {
+			n = min(n, valid);
+			n = min(n, (play->pcm_buffer_size - src_off) /
+					   play->pcm_salign);
+			if (route) {
+				load(capt->conv_buf,
+				     runtime->dma_area + src_off,
+				     n * runtime->channels);
+				snd_avirt_route_apply(route, in, capt->conv_buf,
+						      n, runtime->channels);
+			} else {
+				load(in, runtime->dma_area + src_off,
+				     n * channels);
+			}
+			if (!snd_avirt_gain_is_unity(&capt->gain, gain))
+				snd_avirt_gain_apply(&capt->gain, gain, ramp,
+						     in, n, channels);
+			valid -= n;
+		} else {
+			/* past the end of a draining playback */
+			memset(in, 0, n * channels * sizeof(s32));
+		}
+		frames -= n;
+		src_off = (src_off + n * play->pcm_salign) %
+			  play->pcm_buffer_size;
+
+		for (pos = 0; pos < n; pos += used) {
+			used = n - pos;
+			done = snd_avirt_src_process(capt->src,
+						     in + pos * channels,
+						     &used, out,
+						     LOOPBACK_SRC_CHUNK);
+			src_store(capt, store, out, done);
+		}
+	}
+	snd_avirt_stat_add(capt->substream, SND_AVIRT_STAT_CPU_COPY,
+			   snd_avirt_cpu_exit(&cpu, &capt->cable->cpu_nested));
+}
+
+/* Realign the converter output once it drifts off its margin */
+static void src_check_lead(struct loopback_pcm *capt)
+{
+	unsigned int lead = (capt->src_wpos + capt->pcm_buffer_size -
+			     capt->buf_pos) %
+			    capt->pcm_buffer_size;
+
+	if (lead > 4 * LOOPBACK_SRC_MARGIN * capt->pcm_salign ||
+	    lead > capt->pcm_buffer_size / 2)
+		capt->src_prime = 1;
+}
+
+static inline unsigned int bytepos_delta(struct loopback_pcm *dpcm,
+					 u64 delta_ns)
+{
+	unsigned long last_pos;
+	unsigned int delta = 0;
+	u64 step_ns;
+
+	do {
+		step_ns = min_t(u64, delta_ns, MAX_DELTA_NS);
+		last_pos = byte_pos(dpcm, dpcm->irq_pos);
+		dpcm->irq_pos += frac_delta(dpcm, step_ns);
+		delta += byte_pos(dpcm, dpcm->irq_pos) - last_pos;
+		if (dpcm->irq_pos >= dpcm->period_size_frac) {
+			div64_u64_rem(dpcm->irq_pos, dpcm->period_size_frac,
+				      &dpcm->irq_pos);
+			dpcm->period_update_pending = 1;
+		}
+		delta_ns -= step_ns;
+	} while (delta_ns);
+	if (delta >= dpcm->last_drift)
+		delta -= dpcm->last_drift;
+	dpcm->last_drift = 0;
+	return delta;
+}
+
+/* Publish the new position of an end, read by its PCM callbacks */
+static inline void bytepos_finish(struct loopback_pcm *dpcm, unsigned int delta)
+{
+	WRITE_ONCE(dpcm->buf_pos,
+		   (dpcm->buf_pos + delta) % dpcm->pcm_buffer_size);
+}
+
+/*
+ * Advance every running end of the cable to now. Captures that ran while the
+ * playback did not record silence. Over the time both ran, each capture reads
+ * the frames just played. The playback and the captures without a rate
+ * converter advance in lockstep, by the largest of their frame counts, and
+ * each of them carries the excess over the smallest count into its next
+ * update as drift. A capture started after the last update reads the tail of
+ * the frames played.
+ *
+ * The ends to advance and by how much are taken in cable->lock, from the
+ * state the trigger left. The copies are then made outside of it, and only
+ * once an end holds its data is its new position published.
+ * Called by the cable worker, call in work_lock
+ */
+static unsigned int loopback_pos_update(struct loopback_cable *cable)
+{
+	struct loopback_pcm *dpcm_play =
+		cable->streams[SNDRV_PCM_STREAM_PLAYBACK];
+	struct loopback_pcm *dpcm_capt;
+	u64 now, delta_play = 0, window = 0, delta_capt[CABLE_ENDS] = { 0 };
+	unsigned int count_capt[CABLE_ENDS], clear[CABLE_ENDS] = { 0 };
+	unsigned int running, update, i, count1, count2, count_play, min_count;
+	unsigned int skip = 0;
+	bool flush;
+
+	spin_lock_irq(&cable->lock);
+	running = cable->running ^ cable->pause;
+	flush = cable->direct_flush;
+	cable->direct_flush = 0;
+	/* event driven captures only move as the playback is written */
+	update = cable->event ? running & CABLE_VALID_PLAYBACK : running;
+	now = ktime_get_ns();
+	if (update & CABLE_VALID_PLAYBACK) {
+		delta_play = now - dpcm_play->last_ns;
+		dpcm_play->last_ns += delta_play;
+	}
+
+	for_each_capture(cable, dpcm_capt, i) {
+		if (!(update & cable_bit(dpcm_capt)))
+			continue;
+		delta_capt[i] = now - dpcm_capt->last_ns;
+		dpcm_capt->last_ns += delta_capt[i];
+		if (delta_capt[i] > delta_play) {
+			clear[i] = bytepos_delta(dpcm_capt,
+						 delta_capt[i] - delta_play);
+			delta_capt[i] = delta_play;
+		}
+		window = max(window, delta_capt[i]);
+	}
+
+	if (delta_play > window)
+		skip = bytepos_delta(dpcm_play, delta_play - window);
+
+	count_play = count1 = min_count = 0;
+	if (window) {
+		/* note delta_capt <= delta_play == window at this moment */
+		count_play = bytepos_delta(dpcm_play, window) /
+			     dpcm_play->pcm_salign;
+		count1 = min_count = count_play;
+	}
+	for_each_capture(cable, dpcm_capt, i) {
+		if (!delta_capt[i])
+			continue;
+		count_capt[i] = bytepos_delta(dpcm_capt, delta_capt[i]);
+		/* sample formats may differ, so the ends advance in frames */
+		if (dpcm_capt->src || delta_capt[i] < window)
+			continue;
+		count2 = count_capt[i] / dpcm_capt->pcm_salign;
+		count1 = max(count1, count2);
+		min_count = min(min_count, count2);
+	}
+	spin_unlock_irq(&cable->lock);
+
+	/* from the positions the ends had in lockstep, before they move */
+	if (flush)
+		loopback_direct_flush(cable);
+
+	for_each_capture(cable, dpcm_capt, i) {
+		if (!clear[i])
+			continue;
+		clear_capture_buf(dpcm_capt, clear[i]);
+		bytepos_finish(dpcm_capt, clear[i]);
+	}
+	if (skip)
+		bytepos_finish(dpcm_play, skip);
+
+	if (window == 0)
+		goto unlock;
+
+	for_each_capture(cable, dpcm_capt, i) {
+		if (!delta_capt[i])
+			continue;
+		if (dpcm_capt->src) {
+			/* each end advances at its own rate */
+			src_copy_play_buf(dpcm_play, dpcm_capt, count1);
+			bytepos_finish(dpcm_capt, count_capt[i]);
+			src_check_lead(dpcm_capt);
+		} else if (delta_capt[i] < window) {
+			count2 = min(count_capt[i] / dpcm_capt->pcm_salign,
+				     count1);
+			copy_play_buf(dpcm_play, dpcm_capt, count1 - count2,
+				      count2);
+			bytepos_finish(dpcm_capt,
+				       count2 * dpcm_capt->pcm_salign);
+		} else {
+			count2 = count_capt[i] / dpcm_capt->pcm_salign;
+			dpcm_capt->last_drift =
+				(count2 - min_count) * dpcm_capt->pcm_salign;
+			if (dpcm_capt->last_drift)
+				snd_avirt_stat_add(dpcm_capt->substream,
+						   SND_AVIRT_STAT_DRIFT, 1);
+			copy_play_buf(dpcm_play, dpcm_capt, 0, count1);
+			bytepos_finish(dpcm_capt,
+				       count1 * dpcm_capt->pcm_salign);
+		}
+	}
+	dpcm_play->last_drift = (count_play - min_count) * dpcm_play->pcm_salign;
+	if (dpcm_play->last_drift)
+		snd_avirt_stat_add(dpcm_play->substream, SND_AVIRT_STAT_DRIFT,
+				   1);
+	bytepos_finish(dpcm_play, count1 * dpcm_play->pcm_salign);
+	trace_loopback_pos_update(dpcm_play->substream, dpcm_play->buf_pos,
+				  count1 * dpcm_play->pcm_salign, running,
+				  dpcm_play->last_drift);
+unlock:
+	return running;
+}
+
+/*
+ * The timers only flag their end as ticked and kick the cable worker. The
+ * worker advances the cable and makes every copy in process context, with
+ * interrupts enabled, so none of them runs in the timer, nor in the PCM
+ * callbacks: these only read the positions the worker published, and update
+ * the bookkeeping it picks up on its next run, in cable->lock. A position
+ * thus only moves on the ticks of the ends, see SNDRV_PCM_INFO_BATCH.
+ */
+static void loopback_timer_elapsed(struct loopback_pcm *dpcm)
+{
+	struct loopback_cable *cable = dpcm->cable;
+
+	set_bit(dpcm->index, &cable->ticked);
+	queue_work(system_highpri_wq, &cable->work);
+}
+
+static void loopback_timer_function(struct timer_list *t)
+{
+	struct loopback_pcm *dpcm = from_timer(dpcm, t, timer);
+
+	loopback_timer_elapsed(dpcm);
+}
+
+static enum hrtimer_restart loopback_hrtimer_function(struct hrtimer *t)
+{
+	struct loopback_pcm *dpcm =
+		container_of(t, struct loopback_pcm, hrtimer);
+
+	/* the worker re-arms the timer while the stream runs */
+	loopback_timer_elapsed(dpcm);
+	return HRTIMER_NORESTART;
+}
+
+static bool loopback_clock_tick(struct snd_avirt_clock_client *client)
+{
+	struct loopback_pcm *dpcm = client->substream->runtime->private_data;
+
+	/* the worker reports the elapsed period itself */
+	loopback_timer_elapsed(dpcm);
+	return false;
+}
+
+static snd_pcm_uframes_t loopback_pointer(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct loopback_pcm *dpcm = runtime->private_data;
+	u64 start = local_clock();
+	snd_pcm_uframes_t pos;
+
+	/* the frames pushed to an event driven capture are now reported */
+	spin_lock(&dpcm->cable->lock);
+	pos = bytes_to_frames(runtime, READ_ONCE(dpcm->buf_pos));
+	dpcm->event_pending = 0;
+	spin_unlock(&dpcm->cable->lock);
+	snd_avirt_stat_add(substream, SND_AVIRT_STAT_CPU_POINTER,
+			   local_clock() - start);
+	trace_avirt_pcm_pointer(substream, pos);
+	return pos;
+}
+
+/*
+ * Whether the frames pushed to an event driven capture should wake its
+ * reader. The PCM core takes a period elapsed that moves the position by
+ * less than a period, long after its last update, for a missed buffer wrap.
+ * Short of a period boundary, the reader is thus only woken while its
+ * position is fresh, and otherwise at the next boundary. call in cable->lock
+ */
+static bool loopback_event_wake(struct loopback_pcm *capt)
+{
+	struct snd_pcm_runtime *runtime = capt->substream->runtime;
+	snd_pcm_uframes_t hw_ptr = runtime->status->hw_ptr + capt->event_pending;
+	snd_pcm_sframes_t avail = hw_ptr - runtime->control->appl_ptr;
+
+	if (avail < 0)
+		avail += runtime->boundary;
+	if (avail < runtime->control->avail_min)
+		return false;
+	if (hw_ptr >= runtime->hw_ptr_interrupt + runtime->period_size)
+		return true;
+	return jiffies - runtime->hw_ptr_jiffies <=
+	       runtime->hw_ptr_buffer_jiffies / 2;
+}
+
+/* Frames an event driven capture has room for. call in cable->lock */
+static snd_pcm_uframes_t loopback_event_room(struct loopback_pcm *capt)
+{
+	struct snd_pcm_runtime *runtime = capt->substream->runtime;
+	snd_pcm_sframes_t avail = runtime->status->hw_ptr + capt->event_pending -
+				  runtime->control->appl_ptr;
+
+	if (avail < 0)
+		avail += runtime->boundary;
+	return avail < runtime->buffer_size ? runtime->buffer_size - avail : 0;
 }
 
-static void copy_play_buf(struct loopback_pcm *play, struct loopback_pcm *capt,
-			  unsigned int bytes)
+/*
+ * On an event driven cable, push the frames written to the playback to every
+ * running capture as soon as its application pointer moves, rather than once
+ * they are played. The frames pushed are delivered, so a rewind over them
+ * only holds off the pushes until the playback is written past them again.
+ * The captures to push to are picked in cable->lock, the frames are copied
+ * outside of it. Returns the captures that had no room for the frames, and
+ * overran. Called by the cable worker, call in work_lock
+ */
+static unsigned int loopback_event_push(struct loopback_cable *cable)
 {
-	struct snd_pcm_runtime *runtime = play->substream->runtime;
-	char *src = runtime->dma_area;
-	char *dst = capt->substream->runtime->dma_area;
-	unsigned int src_off = play->buf_pos;
-	unsigned int dst_off = capt->buf_pos;
-	unsigned int clear_bytes = 0;
+	struct loopback_pcm *play = cable->streams[SNDRV_PCM_STREAM_PLAYBACK];
+	struct snd_pcm_runtime *runtime;
+	struct loopback_pcm *capt;
+	snd_pcm_uframes_t appl, frames;
+	unsigned int i, push = 0, src_off, xrun = 0;
 
-	/* check if playback is draining, trim the capture copy size
-	 * when our pointer is at the end of playback ring buffer */
-	if (runtime->status->state == SNDRV_PCM_STATE_DRAINING &&
-	    snd_pcm_playback_hw_avail(runtime) < runtime->buffer_size) {
-		snd_pcm_uframes_t appl_ptr, appl_ptr1, diff;
-		appl_ptr = appl_ptr1 = runtime->control->appl_ptr;
-		appl_ptr1 -= appl_ptr1 % runtime->buffer_size;
-		appl_ptr1 += play->buf_pos / play->pcm_salign;
-		if (appl_ptr < appl_ptr1)
-			appl_ptr1 -= runtime->buffer_size;
-		diff = (appl_ptr - appl_ptr1) * play->pcm_salign;
-		if (diff < bytes) {
-			clear_bytes = bytes - diff;
-			bytes = diff;
-		}
+	if (!cable->event || !play || !(cable->valid & CABLE_VALID_PLAYBACK))
+		return 0;
+
+	runtime = play->substream->runtime;
+	appl = READ_ONCE(runtime->control->appl_ptr);
+	frames = appl >= play->event_appl ?
+			 appl - play->event_appl :
+			 appl + runtime->boundary - play->event_appl;
+	if (!frames)
+		return 0;
+	if (frames > runtime->buffer_size) {
+		/* behind the frames pushed after a rewind, keep them */
+		if (runtime->boundary - frames <= runtime->buffer_size)
+			return 0;
+		/* otherwise the playback was reset, start over from it */
+		play->event_appl = appl;
+		return 0;
 	}
+	play->event_appl = appl;
 
-	for (;;) {
-		unsigned int size = bytes;
-		if (src_off + size > play->pcm_buffer_size)
-			size = play->pcm_buffer_size - src_off;
-		if (dst_off + size > capt->pcm_buffer_size)
-			size = capt->pcm_buffer_size - dst_off;
-		memcpy(dst + dst_off, src + src_off, size);
-		capt->silent_size = 0;
-		bytes -= size;
-		if (!bytes)
-			break;
-		src_off = (src_off + size) % play->pcm_buffer_size;
-		dst_off = (dst_off + size) % capt->pcm_buffer_size;
+	spin_lock_irq(&cable->lock);
+	for_each_capture(cable, capt, i) {
+		if (!((cable->running ^ cable->pause) & cable_bit(capt)))
+			continue;
+		/* never overwrite the frames the capture has not read */
+		if (frames > loopback_event_room(capt))
+			xrun |= cable_bit(capt);
+		else
+			push |= cable_bit(capt);
+	}
+	spin_unlock_irq(&cable->lock);
+
+	src_off = frames_to_bytes(runtime,
+				  (appl - frames) % runtime->buffer_size);
+	for_each_capture(cable, capt, i) {
+		if (push & cable_bit(capt))
+			cable_copy_frames(play, src_off, capt, capt->buf_pos,
+					  frames);
 	}
 
-	if (clear_bytes > 0) {
-		clear_capture_buf(capt, clear_bytes);
-		capt->silent_size = 0;
+	spin_lock_irq(&cable->lock);
+	for_each_capture(cable, capt, i) {
+		if (!(push & cable_bit(capt)))
+			continue;
+		bytepos_finish(capt, frames * capt->pcm_salign);
+		capt->event_pending += frames;
+		if (loopback_event_wake(capt)) {
+			capt->period_update_pending = 1;
+			set_bit(capt->index, &cable->ticked);
+		}
 	}
+	spin_unlock_irq(&cable->lock);
+
+	return xrun;
 }
 
-static inline unsigned int bytepos_delta(struct loopback_pcm *dpcm,
-					 unsigned int jiffies_delta)
+/*
+ * Advance the cable on the ticks of its ends, and report the periods they
+ * completed. Runs in process context, see loopback_timer_elapsed().
+ */
+static void loopback_cable_work(struct work_struct *work)
 {
-	unsigned long last_pos;
-	unsigned int delta;
-
-	last_pos = byte_pos(dpcm, dpcm->irq_pos);
-	dpcm->irq_pos += jiffies_delta * dpcm->pcm_bps;
-	delta = byte_pos(dpcm, dpcm->irq_pos) - last_pos;
-	if (delta >= dpcm->last_drift)
-		delta -= dpcm->last_drift;
-	dpcm->last_drift = 0;
-	if (dpcm->irq_pos >= dpcm->period_size_frac) {
-		dpcm->irq_pos %= dpcm->period_size_frac;
-		dpcm->period_update_pending = 1;
+	struct loopback_cable *cable =
+		container_of(work, struct loopback_cable, work);
+	struct loopback_pcm *dpcm, *due[CABLE_ENDS], *any = NULL;
+	struct loopback_pcm *overrun[CABLE_ENDS];
+	unsigned int i, count = 0, xruns = 0, running, xrun;
+	struct snd_avirt_cpu cpu;
+	u64 cpu_ns;
+
+	mutex_lock(&cable->work_lock);
+	snd_avirt_cpu_enter(&cpu, &cable->cpu_nested);
+	xrun = loopback_event_push(cable);
+	loopback_pos_update(cable);
+	spin_lock_irq(&cable->lock);
+	/* the ends stopped meanwhile are not rearmed */
+	running = cable->running ^ cable->pause;
+	for (i = 0; i < CABLE_ENDS; i++) {
+		dpcm = cable->streams[i];
+		if (!dpcm)
+			continue;
+		any = dpcm;
+		if (xrun & cable_bit(dpcm)) {
+			overrun[xruns++] = dpcm;
+			continue;
+		}
+		if (!test_and_clear_bit(i, &cable->ticked))
+			continue;
+		if (!(running & cable_bit(dpcm)))
+			continue;
+		loopback_timer_start(dpcm);
+		if (dpcm->period_update_pending) {
+			dpcm->period_update_pending = 0;
+			due[count++] = dpcm;
+		}
 	}
-	return delta;
+	spin_unlock_irq(&cable->lock);
+	/* the ends of a cable share the statistics of its stream */
+	cpu_ns = snd_avirt_cpu_exit(&cpu, &cable->cpu_nested);
+	if (any)
+		snd_avirt_stat_add(any->substream, SND_AVIRT_STAT_CPU_TIMER,
+				   cpu_ns);
+	mutex_unlock(&cable->work_lock);
+
+	/* need to unlock before calling below */
+	for (i = 0; i < count; i++)
+		snd_avirt_pcm_period_elapsed(due[i]->substream);
+	for (i = 0; i < xruns; i++)
+		snd_pcm_stop_xrun(overrun[i]->substream);
 }
 
-static inline void bytepos_finish(struct loopback_pcm *dpcm, unsigned int delta)
+/*
+ * A rewind moves appl_ptr back over data written straight into the capture,
+ * which is then rewritten. Drop the rewound part from the direct range, so
+ * that the cable copies the new data from the playback buffer.
+ * call in cable->lock
+ */
+static void loopback_direct_rewind(struct loopback_pcm *play)
 {
-	dpcm->buf_pos += delta;
-	dpcm->buf_pos %= dpcm->pcm_buffer_size;
+	struct snd_pcm_runtime *runtime = play->substream->runtime;
+	snd_pcm_uframes_t appl = READ_ONCE(runtime->control->appl_ptr);
+	snd_pcm_sframes_t back = play->direct_appl - appl;
+	unsigned int bytes;
+
+	if (!play->direct_bytes)
+		return;
+	if (back < 0)
+		back += runtime->boundary;
+	if (!back || back > runtime->buffer_size)
+		return;
+	bytes = min_t(unsigned int, frames_to_bytes(runtime, back),
+		      play->direct_bytes);
+	play->direct_bytes -= bytes;
+	play->direct_appl = appl;
 }
 
-/* call in cable->lock */
-static unsigned int loopback_pos_update(struct loopback_cable *cable)
+/*
+ * The writes of an event driven playback are pushed by the cable worker.
+ * Also called when the playback is rewound.
+ */
+static int loopback_ack(struct snd_pcm_substream *substream)
 {
-	struct loopback_pcm *dpcm_play =
-		cable->streams[SNDRV_PCM_STREAM_PLAYBACK];
-	struct loopback_pcm *dpcm_capt =
-		cable->streams[SNDRV_PCM_STREAM_CAPTURE];
-	unsigned long delta_play = 0, delta_capt = 0;
-	unsigned int running, count1, count2;
+	struct loopback_pcm *dpcm = substream->runtime->private_data;
+	struct loopback_cable *cable = dpcm->cable;
 
-	running = cable->running ^ cable->pause;
-	if (running & (1 << SNDRV_PCM_STREAM_PLAYBACK)) {
-		delta_play = jiffies - dpcm_play->last_jiffies;
-		dpcm_play->last_jiffies += delta_play;
-	}
+	trace_avirt_pcm_ack(substream);
+	if (substream->stream != SNDRV_PCM_STREAM_PLAYBACK)
+		return 0;
+	if (cable->event)
+		queue_work(system_highpri_wq, &cable->work);
+	spin_lock(&cable->lock);
+	loopback_direct_rewind(dpcm);
+	spin_unlock(&cable->lock);
+	return 0;
+}
 
-	if (running & (1 << SNDRV_PCM_STREAM_CAPTURE)) {
-		delta_capt = jiffies - dpcm_capt->last_jiffies;
-		dpcm_capt->last_jiffies += delta_capt;
-	}
+/*
+ * Reserve the capture buffer range the playback data at @pos will be copied
+ * to, provided the data extends the current direct range and the capture
+ * has room for it. Returns the capture offset, or -EAGAIN. call in work_lock
+ * and cable->lock
+ */
+static int loopback_direct_reserve(struct loopback_pcm *play,
+				   unsigned int pos, unsigned int bytes)
+{
+	struct loopback_cable *cable = play->cable;
+	struct snd_pcm_runtime *runtime = play->substream->runtime;
+	struct loopback_pcm *capt = loopback_single_capture(cable);
+	struct snd_pcm_runtime *cruntime;
+	unsigned int lead, unread;
+
+	/* only a single capture can hold the played data */
+	if (!capt || play->zc || capt->zc || cable->event ||
+	    (cable->running ^ cable->pause) !=
+		    (CABLE_VALID_PLAYBACK | cable_bit(capt)))
+		return -EAGAIN;
+	cruntime = capt->substream->runtime;
+	if (runtime->format != cruntime->format ||
+	    runtime->rate != cruntime->rate ||
+	    runtime->channels != cruntime->channels)
+		return -EAGAIN;
+	/* the data written in place does not go through the gain or routes */
+	if (!snd_avirt_gain_is_unity(&capt->gain,
+				     READ_ONCE(get_setup(capt)->gain)) ||
+	    get_route(capt))
+		return -EAGAIN;
+
+	/*
+	 * The positions are those the cable worker last published. Both ends
+	 * must have advanced in lockstep then, which leaves them the same
+	 * last_ns, rather than one started or released since.
+	 */
+	if (play->last_ns != capt->last_ns)
+		return -EAGAIN;
+
+	lead = (pos + play->pcm_buffer_size - play->buf_pos) %
+	       play->pcm_buffer_size;
+	if (lead > frames_to_bytes(runtime, snd_pcm_playback_hw_avail(runtime)))
+		return -EAGAIN;
+	if (play->direct_bytes &&
+	    (play->direct_pos + play->direct_bytes) % play->pcm_buffer_size != pos)
+		return -EAGAIN;
+
+	/* keep clear of the data the capture has not read yet */
+	unread = frames_to_bytes(cruntime, snd_pcm_capture_avail(cruntime));
+	if (lead + bytes + unread + capt->pcm_period_size > capt->pcm_buffer_size)
+		return -EAGAIN;
+
+	return (capt->buf_pos + lead) % capt->pcm_buffer_size;
+}
 
-	if (delta_play == 0 && delta_capt == 0)
+/*
+ * Write the playback data straight into the capture buffer, at the offset the
+ * cable would copy it to once played. Returns 1 if the data was delivered, 0
+ * if it must go to the playback buffer, or a negative error code.
+ */
+static int loopback_direct_write(struct loopback_pcm *play, unsigned int pos,
+				 void __user *buf, unsigned int bytes, u64 *ns)
+{
+	struct snd_pcm_runtime *runtime = play->substream->runtime;
+	struct loopback_cable *cable = play->cable;
+	struct loopback_pcm *capt;
+	unsigned int seq, size;
+	int off, ret = 0;
+	char *dst;
+
+	/* pins the capture buffer, and the positions of the ends */
+	mutex_lock(&play->loopback->cable_lock);
+	mutex_lock(&cable->work_lock);
+	spin_lock_irq(&cable->lock);
+	off = loopback_direct_reserve(play, pos, bytes);
+	capt = loopback_single_capture(cable);
+	seq = cable->direct_seq;
+	spin_unlock_irq(&cable->lock);
+	if (off < 0)
 		goto unlock;
 
-	if (delta_play > delta_capt) {
-		count1 = bytepos_delta(dpcm_play, delta_play - delta_capt);
-		bytepos_finish(dpcm_play, count1);
-		delta_play = delta_capt;
-	} else if (delta_play < delta_capt) {
-		count1 = bytepos_delta(dpcm_capt, delta_capt - delta_play);
-		clear_capture_buf(dpcm_capt, count1);
-		bytepos_finish(dpcm_capt, count1);
-		delta_capt = delta_play;
-	}
-
-	if (delta_play == 0 && delta_capt == 0)
+	dst = capt->substream->runtime->dma_area;
+	size = min(bytes, capt->pcm_buffer_size - off);
+	if (snd_avirt_copy_from_user(dst + off, buf, size, ns) ||
+	    snd_avirt_copy_from_user(dst, buf + size, bytes - size, ns)) {
+		ret = -EFAULT;
 		goto unlock;
+	}
 
-	/* note delta_capt == delta_play at this moment */
-	count1 = bytepos_delta(dpcm_play, delta_play);
-	count2 = bytepos_delta(dpcm_capt, delta_capt);
-	if (count1 < count2) {
-		dpcm_capt->last_drift = count2 - count1;
-		count1 = count2;
-	} else if (count1 > count2) {
-		dpcm_play->last_drift = count1 - count2;
-	}
-	copy_play_buf(dpcm_play, dpcm_capt, count1);
-	bytepos_finish(dpcm_play, count1);
-	bytepos_finish(dpcm_capt, count1);
+	spin_lock_irq(&cable->lock);
+	if (seq == cable->direct_seq) {
+		if (!play->direct_bytes)
+			play->direct_pos = pos;
+		play->direct_bytes += bytes;
+		/* the write starts at appl_ptr, which moves past it after */
+		play->direct_appl = (runtime->control->appl_ptr +
+				     bytes_to_frames(runtime, bytes)) %
+				    runtime->boundary;
+		ret = 1;
+	}
+	spin_unlock_irq(&cable->lock);
 unlock:
-	return running;
+	mutex_unlock(&cable->work_lock);
+	mutex_unlock(&play->loopback->cable_lock);
+	return ret;
 }
 
-static void loopback_timer_function(struct timer_list *t)
+/* loopback is interleaved only, so @channel is always 0 */
+static int loopback_copy_user(struct snd_pcm_substream *substream, int channel,
+			      unsigned long pos, void __user *buf,
+			      unsigned long bytes)
 {
-	struct loopback_pcm *dpcm = from_timer(dpcm, t, timer);
-	unsigned long flags;
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct loopback_pcm *dpcm = runtime->private_data;
+	u64 ns = 0;
+	int err = 0;
 
-	spin_lock_irqsave(&dpcm->cable->lock, flags);
-	if (loopback_pos_update(dpcm->cable) & (1 << dpcm->substream->stream)) {
-		loopback_timer_start(dpcm);
-		if (dpcm->period_update_pending) {
-			dpcm->period_update_pending = 0;
-			spin_unlock_irqrestore(&dpcm->cable->lock, flags);
-			/* need to unlock before calling below */
-			snd_avirt_pcm_period_elapsed(dpcm->substream);
-			return;
-		}
+	trace_avirt_pcm_copy_user(substream, pos, bytes);
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		if (snd_avirt_copy_to_user(buf, runtime->dma_area + pos, bytes,
+					   &ns))
+			err = -EFAULT;
+		goto out;
+	}
+
+	err = loopback_direct_write(dpcm, pos, buf, bytes, &ns);
+	if (err) {
+		err = err < 0 ? err : 0;
+		goto out;
 	}
-	spin_unlock_irqrestore(&dpcm->cable->lock, flags);
+	if (snd_avirt_copy_from_user(runtime->dma_area + pos, buf, bytes, &ns))
+		err = -EFAULT;
+out:
+	/* the cable lock and the page faults are not part of the copy */
+	snd_avirt_stat_add(substream, SND_AVIRT_STAT_CPU_COPY, ns);
+	return err;
 }
 
-static snd_pcm_uframes_t loopback_pointer(struct snd_pcm_substream *substream)
+static int loopback_copy_kernel(struct snd_pcm_substream *substream,
+				int channel, unsigned long pos, void *buf,
+				unsigned long bytes)
 {
 	struct snd_pcm_runtime *runtime = substream->runtime;
-	struct loopback_pcm *dpcm = runtime->private_data;
-	snd_pcm_uframes_t pos;
+	u64 start = local_clock();
 
-	spin_lock(&dpcm->cable->lock);
-	loopback_pos_update(dpcm->cable);
-	pos = dpcm->buf_pos;
-	spin_unlock(&dpcm->cable->lock);
-	return bytes_to_frames(runtime, pos);
+	trace_avirt_pcm_copy_kernel(substream, pos, bytes);
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+		memcpy(buf, runtime->dma_area + pos, bytes);
+	else
+		memcpy(runtime->dma_area + pos, buf, bytes);
+	snd_avirt_stat_add(substream, SND_AVIRT_STAT_CPU_COPY,
+			   local_clock() - start);
+	return 0;
 }
 
 static const struct snd_pcm_hardware loopbackap_pcm_hardware = {
 	.info = (SNDRV_PCM_INFO_INTERLEAVED | SNDRV_PCM_INFO_MMAP |
 		 SNDRV_PCM_INFO_MMAP_VALID | SNDRV_PCM_INFO_PAUSE |
-		 SNDRV_PCM_INFO_RESUME),
-	.formats = (SNDRV_PCM_FMTBIT_S16_LE | SNDRV_PCM_FMTBIT_S16_BE |
-		    SNDRV_PCM_FMTBIT_S32_LE | SNDRV_PCM_FMTBIT_S32_BE |
-		    SNDRV_PCM_FMTBIT_FLOAT_LE | SNDRV_PCM_FMTBIT_FLOAT_BE),
+		 SNDRV_PCM_INFO_RESUME | SNDRV_PCM_INFO_BATCH),
+	.formats = SND_AVIRT_CONVERT_FORMATS,
 	.rates = SNDRV_PCM_RATE_CONTINUOUS | SNDRV_PCM_RATE_8000_192000,
 	.rate_min = 8000,
 	.rate_max = 192000,
@@ -543,8 +1823,6 @@ static const struct snd_pcm_hardware loopbackap_pcm_hardware = {
 	.channels_max = 32,
 	.buffer_bytes_max = 2 * 1024 * 1024,
 	.period_bytes_min = 64,
-	/* note check overflow in frac_pos() using pcm_rate_shift before
-	   changing period_bytes_max value */
 	.period_bytes_max = 1024 * 1024,
 	.periods_min = 1,
 	.periods_max = 1024,
@@ -554,9 +1832,119 @@ static const struct snd_pcm_hardware loopbackap_pcm_hardware = {
 static void loopback_runtime_free(struct snd_pcm_runtime *runtime)
 {
 	struct loopback_pcm *dpcm = runtime->private_data;
+
+	snd_avirt_src_free(dpcm->src);
+	kfree(dpcm->src_buf);
+	kfree(dpcm->conv_buf);
 	kfree(dpcm);
 }
 
+/* call in loopback->cable_lock */
+static bool loopback_zc_usable(struct loopback_pcm *dpcm,
+			       struct loopback_zc *zc,
+			       struct snd_pcm_hw_params *params)
+{
+	struct loopback_cable *cable = dpcm->cable;
+	bool usable;
+
+	if (zc->format != params_format(params) ||
+	    zc->rate != params_rate(params) ||
+	    zc->channels != params_channels(params) ||
+	    zc->bytes != params_buffer_bytes(params))
+		return false;
+	if (dpcm->substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+		return true;
+	/* the gain and routes cannot be applied to data read in place */
+	if (get_setup(dpcm)->gain != SND_AVIRT_GAIN_UNITY || get_route(dpcm) ||
+	    cable->event)
+		return false;
+
+	/* the capture joins a running playback, else it uses its own buffer */
+	spin_lock_irq(&cable->lock);
+	usable = loopback_zc_playing(cable, zc);
+	spin_unlock_irq(&cable->lock);
+	return usable;
+}
+
+/* call in loopback->cable_lock and work_lock */
+static void loopback_zc_put(struct loopback_pcm *dpcm)
+{
+	struct snd_pcm_runtime *runtime = dpcm->substream->runtime;
+	struct loopback_zc *zc = dpcm->zc;
+
+	if (!zc)
+		return;
+	runtime->dma_area = NULL;
+	runtime->dma_bytes = 0;
+	dpcm->zc = NULL;
+	if (--zc->users)
+		return;
+	if (dpcm->cable->zc == zc)
+		dpcm->cable->zc = NULL;
+	vfree(zc->area);
+	kfree(zc);
+}
+
+/* call in loopback->cable_lock and work_lock */
+static int loopback_zc_get(struct loopback_pcm *dpcm,
+			   struct snd_pcm_hw_params *params)
+{
+	struct snd_pcm_substream *substream = dpcm->substream;
+	struct loopback_cable *cable = dpcm->cable;
+	struct loopback_zc *zc = cable->zc;
+
+	if (zc && !loopback_zc_usable(dpcm, zc, params))
+		zc = NULL;
+	if (!zc) {
+		if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+			return 0;
+		zc = kzalloc(sizeof(*zc), GFP_KERNEL);
+		if (!zc)
+			return -ENOMEM;
+		zc->bytes = params_buffer_bytes(params);
+		zc->area = vzalloc(zc->bytes);
+		if (!zc->area) {
+			kfree(zc);
+			return -ENOMEM;
+		}
+		zc->format = params_format(params);
+		zc->rate = params_rate(params);
+		zc->channels = params_channels(params);
+		cable->zc = zc;
+	}
+
+	/* detach the buffer allocated by the core, if any */
+	snd_avirt_pcm_buffer_release(substream);
+	zc->users++;
+	dpcm->zc = zc;
+	substream->runtime->dma_area = zc->area;
+	substream->runtime->dma_bytes = zc->bytes;
+
+	return 1;
+}
+
+static int loopback_hw_params(struct snd_pcm_substream *substream,
+			      struct snd_pcm_hw_params *params)
+{
+	struct loopback_pcm *dpcm = substream->runtime->private_data;
+	int err = 0;
+
+	mutex_lock(&dpcm->loopback->cable_lock);
+	mutex_lock(&dpcm->cable->work_lock);
+	if (dpcm->zc && loopback_zc_usable(dpcm, dpcm->zc, params)) {
+		err = 1;
+		goto unlock;
+	}
+	loopback_zc_put(dpcm);
+	if (get_setup(dpcm)->zero_copy)
+		err = loopback_zc_get(dpcm, params);
+unlock:
+	mutex_unlock(&dpcm->cable->work_lock);
+	mutex_unlock(&dpcm->loopback->cable_lock);
+
+	return err;
+}
+
 static int loopback_hw_free(struct snd_pcm_substream *substream)
 {
 	struct snd_pcm_runtime *runtime = substream->runtime;
@@ -564,7 +1952,12 @@ static int loopback_hw_free(struct snd_pcm_substream *substream)
 	struct loopback_cable *cable = dpcm->cable;
 
 	mutex_lock(&dpcm->loopback->cable_lock);
-	cable->valid &= ~(1 << substream->stream);
+	mutex_lock(&cable->work_lock);
+	/* before the buffer holding them goes */
+	loopback_direct_sync(cable);
+	cable->valid &= ~cable_bit(dpcm);
+	loopback_zc_put(dpcm);
+	mutex_unlock(&cable->work_lock);
 	mutex_unlock(&dpcm->loopback->cable_lock);
 
 	return 0;
@@ -608,6 +2001,9 @@ static int rule_channels(struct snd_pcm_hw_params *params,
 	struct loopback_cable *cable = dpcm->cable;
 	struct snd_interval t;
 
+	/* the ends of a routed cable run their own channel counts */
+	if (get_route(dpcm))
+		return 0;
 	mutex_lock(&dpcm->loopback->cable_lock);
 	t.min = cable->hw.channels_min;
 	t.max = cable->hw.channels_max;
@@ -620,18 +2016,28 @@ static int rule_channels(struct snd_pcm_hw_params *params,
 static void free_cable(struct snd_pcm_substream *substream)
 {
 	struct loopback_cable *cable;
+	unsigned int i, index = substream->stream + substream->number;
 
 	cable = loopback->cables[substream->pcm->device];
 	if (!cable)
 		return;
-	if (cable->streams[!substream->stream]) {
+	for (i = 0; i < CABLE_ENDS; i++) {
+		if (i != index && cable->streams[i])
+			break;
+	}
+	if (i < CABLE_ENDS) {
 		/* other stream is still alive */
+		mutex_lock(&cable->work_lock);
 		spin_lock_irq(&cable->lock);
-		cable->streams[substream->stream] = NULL;
+		cable->streams[index] = NULL;
 		spin_unlock_irq(&cable->lock);
+		mutex_unlock(&cable->work_lock);
+		/* a worker run may still be reporting this stream */
+		flush_work(&cable->work);
 	} else {
 		/* free the cable */
 		loopback->cables[substream->pcm->device] = NULL;
+		cancel_work_sync(&cable->work);
 		kfree(cable);
 	}
 }
@@ -641,6 +2047,7 @@ static int loopback_open(struct snd_pcm_substream *substream)
 	struct snd_pcm_runtime *runtime = substream->runtime;
 	struct loopback_pcm *dpcm;
 	struct loopback_cable *cable = NULL;
+	unsigned int i;
 	int err = 0;
 
 	mutex_lock(&loopback->cable_lock);
@@ -651,7 +2058,25 @@ static int loopback_open(struct snd_pcm_substream *substream)
 	}
 	dpcm->loopback = loopback;
 	dpcm->substream = substream;
+	dpcm->index = substream->stream + substream->number;
 	timer_setup(&dpcm->timer, loopback_timer_function, 0);
+	hrtimer_init(&dpcm->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dpcm->hrtimer.function = loopback_hrtimer_function;
+	for (i = 0; i < ARRAY_SIZE(dpcm->clock_clients); i++) {
+		dpcm->clock_clients[i].tick = loopback_clock_tick;
+		dpcm->clock_clients[i].substream = substream;
+	}
+	dpcm->clock_client = dpcm->clock_clients;
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		dpcm->conv_buf =
+			kmalloc_array(2 * LOOPBACK_SRC_CHUNK *
+					      loopbackap_pcm_hardware.channels_max,
+				      sizeof(s32), GFP_KERNEL);
+		if (!dpcm->conv_buf) {
+			err = -ENOMEM;
+			goto unlock;
+		}
+	}
 
 	cable = loopback->cables[substream->pcm->device];
 	if (!cable) {
@@ -661,7 +2086,11 @@ static int loopback_open(struct snd_pcm_substream *substream)
 			goto unlock;
 		}
 		spin_lock_init(&cable->lock);
+		mutex_init(&cable->work_lock);
+		INIT_WORK(&cable->work, loopback_cable_work);
 		cable->hw = loopbackap_pcm_hardware;
+		cable->clock = loopback->setup[substream->pcm->device].clock;
+		cable->event = loopback->setup[substream->pcm->device].event;
 		loopback->cables[substream->pcm->device] = cable;
 	}
 	dpcm->cable = cable;
@@ -692,14 +2121,24 @@ static int loopback_open(struct snd_pcm_substream *substream)
 		runtime->hw = loopbackap_pcm_hardware;
 	else
 		runtime->hw = cable->hw;
-
+	/* have the application pointer updates reach loopback_ack() */
+	if (cable->event)
+		runtime->hw.info |= SNDRV_PCM_INFO_SYNC_APPLPTR;
+
+	mutex_lock(&cable->work_lock);
+	/* the played data must reach every capture through the cable */
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+		loopback_direct_sync(cable);
 	spin_lock_irq(&cable->lock);
-	cable->streams[substream->stream] = dpcm;
+	cable->streams[dpcm->index] = dpcm;
 	spin_unlock_irq(&cable->lock);
+	mutex_unlock(&cable->work_lock);
 
 unlock:
 	if (err < 0) {
 		free_cable(substream);
+		if (dpcm)
+			kfree(dpcm->conv_buf);
 		kfree(dpcm);
 	}
 	mutex_unlock(&loopback->cable_lock);
@@ -712,6 +2151,7 @@ static int loopback_close(struct snd_pcm_substream *substream)
 
 	loopback_timer_stop_sync(dpcm);
 	mutex_lock(&loopback->cable_lock);
+	snd_avirt_clock_detach(dpcm->clock_client);
 	free_cable(substream);
 	mutex_unlock(&loopback->cable_lock);
 	return 0;
@@ -720,10 +2160,14 @@ static int loopback_close(struct snd_pcm_substream *substream)
 static const struct snd_pcm_ops loopbackap_pcm_ops = {
 	.open = loopback_open,
 	.close = loopback_close,
+	.hw_params = loopback_hw_params,
 	.hw_free = loopback_hw_free,
 	.prepare = loopback_prepare,
 	.trigger = loopback_trigger,
 	.pointer = loopback_pointer,
+	.copy_user = loopback_copy_user,
+	.copy_kernel = loopback_copy_kernel,
+	.ack = loopback_ack,
 };
 
 static int loopback_rate_shift_info(struct snd_kcontrol *kcontrol,
@@ -753,8 +2197,10 @@ static int loopback_rate_shift_put(struct snd_kcontrol *kcontrol,
 				   struct snd_ctl_elem_value *ucontrol)
 {
 	struct loopback *loopback = snd_kcontrol_chip(kcontrol);
-	unsigned int val;
-	int change = 0;
+	struct loopback_cable *cable;
+	struct loopback_pcm *dpcm;
+	unsigned int val, i;
+	int err, change = 0;
 
 	val = ucontrol->value.integer.value[0];
 	if (val < 80000)
@@ -764,6 +2210,18 @@ static int loopback_rate_shift_put(struct snd_kcontrol *kcontrol,
 	mutex_lock(&loopback->cable_lock);
 	if (val != loopback->setup[kcontrol->id.device].rate_shift) {
 		loopback->setup[kcontrol->id.device].rate_shift = val;
+		/* the shared clock ticks at the shifted period */
+		cable = loopback->cables[kcontrol->id.device];
+		for (i = 0; cable && i < CABLE_ENDS; i++) {
+			dpcm = cable->streams[i];
+			/* only prepared ends of a shared clock cable */
+			if (!dpcm || !dpcm->clock_period_ns)
+				continue;
+			err = loopback_clock_move(dpcm, period_ns(dpcm, val));
+			if (err < 0)
+				AP_ERRORK("cannot move to shifted clock: %d",
+					  err);
+		}
 		change = 1;
 	}
 	mutex_unlock(&loopback->cable_lock);
@@ -798,6 +2256,113 @@ static int loopback_notify_put(struct snd_kcontrol *kcontrol,
 	return change;
 }
 
+static int loopback_zero_copy_get(struct snd_kcontrol *kcontrol,
+				  struct snd_ctl_elem_value *ucontrol)
+{
+	struct loopback *loopback = snd_kcontrol_chip(kcontrol);
+
+	mutex_lock(&loopback->cable_lock);
+	ucontrol->value.integer.value[0] =
+		loopback->setup[kcontrol->id.device].zero_copy;
+	mutex_unlock(&loopback->cable_lock);
+	return 0;
+}
+
+static int loopback_zero_copy_put(struct snd_kcontrol *kcontrol,
+				  struct snd_ctl_elem_value *ucontrol)
+{
+	struct loopback *loopback = snd_kcontrol_chip(kcontrol);
+	unsigned int val;
+	int change = 0;
+
+	val = ucontrol->value.integer.value[0] ? 1 : 0;
+	mutex_lock(&loopback->cable_lock);
+	if (val != loopback->setup[kcontrol->id.device].zero_copy) {
+		loopback->setup[kcontrol->id.device].zero_copy = val;
+		change = 1;
+	}
+	mutex_unlock(&loopback->cable_lock);
+	return change;
+}
+
+static int loopback_gain_info(struct snd_kcontrol *kcontrol,
+			      struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = SND_AVIRT_GAIN_UNITY;
+	uinfo->value.integer.step = 1;
+	return 0;
+}
+
+static int loopback_gain_get(struct snd_kcontrol *kcontrol,
+			     struct snd_ctl_elem_value *ucontrol)
+{
+	struct loopback *loopback = snd_kcontrol_chip(kcontrol);
+
+	mutex_lock(&loopback->cable_lock);
+	ucontrol->value.integer.value[0] =
+		loopback->setup[kcontrol->id.device].gain;
+	mutex_unlock(&loopback->cable_lock);
+	return 0;
+}
+
+static int loopback_gain_put(struct snd_kcontrol *kcontrol,
+			     struct snd_ctl_elem_value *ucontrol)
+{
+	struct loopback *loopback = snd_kcontrol_chip(kcontrol);
+	struct loopback_cable *cable;
+	unsigned int val;
+	int change = 0;
+
+	val = clamp_t(long, ucontrol->value.integer.value[0], 0,
+		      SND_AVIRT_GAIN_UNITY);
+	mutex_lock(&loopback->cable_lock);
+	if (val != loopback->setup[kcontrol->id.device].gain) {
+		WRITE_ONCE(loopback->setup[kcontrol->id.device].gain, val);
+		/* data written in place must now go through the gain */
+		cable = loopback->cables[kcontrol->id.device];
+		if (cable) {
+			mutex_lock(&cable->work_lock);
+			loopback_direct_sync(cable);
+			mutex_unlock(&cable->work_lock);
+		}
+		change = 1;
+	}
+	mutex_unlock(&loopback->cable_lock);
+	return change;
+}
+
+static int loopback_event_get(struct snd_kcontrol *kcontrol,
+			      struct snd_ctl_elem_value *ucontrol)
+{
+	struct loopback *loopback = snd_kcontrol_chip(kcontrol);
+
+	mutex_lock(&loopback->cable_lock);
+	ucontrol->value.integer.value[0] =
+		loopback->setup[kcontrol->id.device].event;
+	mutex_unlock(&loopback->cable_lock);
+	return 0;
+}
+
+static int loopback_event_put(struct snd_kcontrol *kcontrol,
+			      struct snd_ctl_elem_value *ucontrol)
+{
+	struct loopback *loopback = snd_kcontrol_chip(kcontrol);
+	unsigned int val;
+	int change = 0;
+
+	val = ucontrol->value.integer.value[0] ? 1 : 0;
+	mutex_lock(&loopback->cable_lock);
+	if (val != loopback->setup[kcontrol->id.device].event) {
+		loopback->setup[kcontrol->id.device].event = val;
+		change = 1;
+	}
+	mutex_unlock(&loopback->cable_lock);
+	return change;
+}
+
 static int loopback_active_get(struct snd_kcontrol *kcontrol,
 			       struct snd_ctl_elem_value *ucontrol)
 {
@@ -924,7 +2489,28 @@ static struct snd_kcontrol_new loopback_controls[] = {
 	  .iface = SNDRV_CTL_ELEM_IFACE_PCM,
 	  .name = "PCM Slave Channels",
 	  .info = loopback_channels_info,
-	  .get = loopback_channels_get }
+	  .get = loopback_channels_get },
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = "PCM Zero Copy",
+		.info = snd_ctl_boolean_mono_info,
+		.get = loopback_zero_copy_get,
+		.put = loopback_zero_copy_put,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = "PCM Playback Volume",
+		.info = loopback_gain_info,
+		.get = loopback_gain_get,
+		.put = loopback_gain_put,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = "PCM Event Driven",
+		.info = snd_ctl_boolean_mono_info,
+		.get = loopback_event_get,
+		.put = loopback_event_put,
+	}
 };
 
 static int loopback_mixer_new(struct loopback *loopback, int notify)
@@ -933,12 +2519,17 @@ static int loopback_mixer_new(struct loopback *loopback, int notify)
 	struct snd_pcm *pcm;
 	struct snd_kcontrol *kctl;
 	struct loopback_setup *setup;
-	int dev, dev_count, idx, err;
+	int dev, idx, err;
 
 	strcpy(card->mixername, "Loopback Mixer");
-	dev_count = snd_avirt_stream_count(SNDRV_PCM_STREAM_PLAYBACK);
-	for (dev = 0; dev < dev_count; dev++) {
+	for (dev = 0; dev < loopback->devices; dev++) {
 		pcm = loopback->pcm[dev];
+		/*
+		 * only the devices mapped here, the other Audio Paths name
+		 * their own controls alike
+		 */
+		if (!pcm)
+			continue;
 		setup = &loopback->setup[dev];
 		setup->notify = notify;
 		setup->rate_shift = NO_PITCH;
@@ -986,23 +2577,43 @@ static void print_dpcm_info(struct snd_info_buffer *buffer,
 	snd_iprintf(buffer, "    buffer_size:\t%u\n", dpcm->pcm_buffer_size);
 	snd_iprintf(buffer, "    buffer_pos:\t\t%u\n", dpcm->buf_pos);
 	snd_iprintf(buffer, "    silent_size:\t%u\n", dpcm->silent_size);
+	snd_iprintf(buffer, "    zero_copy:\t\t%u\n", dpcm->zc ? 1 : 0);
+	snd_iprintf(buffer, "    direct_bytes:\t%u\n", dpcm->direct_bytes);
 	snd_iprintf(buffer, "    period_size:\t%u\n", dpcm->pcm_period_size);
 	snd_iprintf(buffer, "    bytes_per_sec:\t%u\n", dpcm->pcm_bps);
 	snd_iprintf(buffer, "    sample_align:\t%u\n", dpcm->pcm_salign);
 	snd_iprintf(buffer, "    rate_shift:\t\t%u\n", dpcm->pcm_rate_shift);
 	snd_iprintf(buffer, "    update_pending:\t%u\n",
 		    dpcm->period_update_pending);
-	snd_iprintf(buffer, "    irq_pos:\t\t%u\n", dpcm->irq_pos);
-	snd_iprintf(buffer, "    period_frac:\t%u\n", dpcm->period_size_frac);
-	snd_iprintf(buffer, "    last_jiffies:\t%lu (%lu)\n",
-		    dpcm->last_jiffies, jiffies);
-	snd_iprintf(buffer, "    timer_expires:\t%lu\n", dpcm->timer.expires);
+	snd_iprintf(buffer, "    irq_pos:\t\t%llu\n", dpcm->irq_pos);
+	snd_iprintf(buffer, "    period_frac:\t%llu\n", dpcm->period_size_frac);
+	snd_iprintf(buffer, "    last_ns:\t\t%llu (%llu)\n", dpcm->last_ns,
+		    ktime_get_ns());
+	if (dpcm->cable->clock == SND_AVIRT_CLOCK_HRTIMER)
+		snd_iprintf(buffer, "    timer_expires:\t%lld ns\n",
+			    ktime_to_ns(hrtimer_get_expires(&dpcm->hrtimer)));
+	else if (dpcm->cable->clock == SND_AVIRT_CLOCK_SYSTIMER)
+		snd_iprintf(buffer, "    timer_expires:\t%lu\n",
+			    dpcm->timer.expires);
 }
 
 static void print_substream_info(struct snd_info_buffer *buffer,
 				 struct loopback *loopback, int device)
 {
+	static const char *const clock_names[] = {
+		[SND_AVIRT_CLOCK_SYSTIMER] = "systimer",
+		[SND_AVIRT_CLOCK_HRTIMER] = "hrtimer",
+		[SND_AVIRT_CLOCK_SHARED] = "shared",
+	};
+	static const char *const src_names[] = {
+		[SND_AVIRT_SRC_NONE] = "none",
+		[SND_AVIRT_SRC_LINEAR] = "linear",
+		[SND_AVIRT_SRC_POLYPHASE] = "polyphase",
+	};
 	struct loopback_cable *cable = loopback->cables[device];
+	struct loopback_pcm *capt;
+	unsigned int i;
+	char id[16];
 
 	snd_iprintf(buffer, "Cable device %i:\n", device);
 	if (cable == NULL) {
@@ -1012,8 +2623,26 @@ static void print_substream_info(struct snd_info_buffer *buffer,
 	snd_iprintf(buffer, "  valid: %u\n", cable->valid);
 	snd_iprintf(buffer, "  running: %u\n", cable->running);
 	snd_iprintf(buffer, "  pause: %u\n", cable->pause);
+	snd_iprintf(buffer, "  clock: %s\n", clock_names[cable->clock]);
+	snd_iprintf(buffer, "  event: %u\n", cable->event);
+	snd_iprintf(buffer, "  gain: %u\n", loopback->setup[device].gain);
+	snd_iprintf(buffer, "  routes: %u to %u channels\n",
+		    loopback->setup[device].route.count,
+		    loopback->setup[device].route.channels);
 	print_dpcm_info(buffer, cable->streams[0], "Playback");
-	print_dpcm_info(buffer, cable->streams[1], "Capture");
+	for (i = SNDRV_PCM_STREAM_CAPTURE; i < CABLE_ENDS; i++) {
+		capt = cable->streams[i];
+		if (i > SNDRV_PCM_STREAM_CAPTURE && !capt)
+			continue;
+		snprintf(id, sizeof(id), "Capture #%u",
+			 i - SNDRV_PCM_STREAM_CAPTURE);
+		print_dpcm_info(buffer, capt, id);
+		if (capt)
+			snd_iprintf(buffer, "    src:\t\t\t%s\n",
+				    capt->src ?
+					    src_names[loopback->setup[device].src] :
+					    "none");
+	}
 }
 
 static void print_cable_info(struct snd_info_entry *entry,
@@ -1023,7 +2652,7 @@ static void print_cable_info(struct snd_info_entry *entry,
 	int device;
 
 	mutex_lock(&loopback->cable_lock);
-	for (device = 0; device < MAX_STREAMS; device++)
+	for (device = 0; device < loopback->devices; device++)
 		print_substream_info(buffer, loopback, device);
 	mutex_unlock(&loopback->cable_lock);
 }
@@ -1056,12 +2685,31 @@ static int loopbackap_configure(struct snd_card *card,
 	loopback->card = card;
 	mutex_init(&loopback->cable_lock);
 
+	loopback->devices = stream_count;
+	loopback->cables = kcalloc(stream_count, sizeof(*loopback->cables),
+				   GFP_KERNEL);
+	loopback->pcm = kcalloc(stream_count, sizeof(*loopback->pcm),
+				GFP_KERNEL);
+	loopback->setup = kcalloc(stream_count, sizeof(*loopback->setup),
+				  GFP_KERNEL);
+	if (!loopback->cables || !loopback->pcm || !loopback->setup) {
+		err = -ENOMEM;
+		goto free_loopback;
+	}
+
 	list_for_each (entry, &snd_avirt_stream_group->cg_children) {
 		struct config_item *item =
 			container_of(entry, struct config_item, ci_entry);
 		struct snd_avirt_stream *stream =
 			snd_avirt_stream_from_config_item(item);
+
+		if (strcmp(stream->map, AP_UID))
+			continue;
 		loopback->pcm[stream->device] = stream->pcm;
+		loopback->setup[stream->device].clock = stream->clock;
+		loopback->setup[stream->device].src = stream->src;
+		loopback->setup[stream->device].gain = stream->gain;
+		loopback->setup[stream->device].route = stream->route;
 
 		AP_INFOK("stream name:%s device:%d channels:%d", stream->name,
 			 stream->device, stream->channels);
@@ -1075,6 +2723,14 @@ static int loopbackap_configure(struct snd_card *card,
 	loopback_proc_new(loopback, 1);
 
 	return 0;
+
+free_loopback:
+	kfree(loopback->setup);
+	kfree(loopback->pcm);
+	kfree(loopback->cables);
+	kfree(loopback);
+	loopback = NULL;
+	return err;
 }
 
 /*******************************************************************************
@@ -1087,6 +2743,8 @@ static struct snd_avirt_audiopath loopbackap_module = {
 	.hw = &loopbackap_pcm_hardware,
 	.pcm_ops = &loopbackap_pcm_ops,
 	.configure = loopbackap_configure,
+	.flags = SND_AVIRT_AP_DIRECT_OPS,
+	.owner = THIS_MODULE,
 };
 
 static int __init alsa_card_loopback_init(void)
@@ -1109,3 +2767,7 @@ static void __exit alsa_card_loopback_exit(void)
 
 module_init(alsa_card_loopback_init);
 module_exit(alsa_card_loopback_exit)
+
+#if IS_ENABLED(CONFIG_AVIRT_AP_LOOPBACK_KUNIT_TEST)
+#include "loopback_test.c"
+#endif
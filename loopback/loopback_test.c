@@ -0,0 +1,771 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * AVIRT - ALSA Virtual Soundcard
+ *
+ * Copyright (c) 2010-2018 Fiberdyne Systems Pty Ltd
+ *
+ * loopback_test.c - KUnit tests of the loopback position math and copies
+ *
+ * Included at the end of loopback.c, to reach its static functions. The
+ * positions are checked bit-exact against a reference computed from the total
+ * time elapsed, and the copies frame by frame, across sample formats, rates,
+ * rate shifts and buffer geometries. The avirt_loopback_bench suite reports
+ * the throughput of the copy and silence routines.
+ *
+ * Builds against Linux 5.5 only: KUnit first shipped in 5.5, and AVIRT still
+ * uses struct timespec in its get_time_info callback, which 5.6 dropped. In
+ * 5.5, kunit_test_suite() runs a suite from a late_initcall, which a module
+ * turns into a second module_init(), so the loopback must be built in
+ * (CONFIG_AVIRT_AP_LOOPBACK=y, as in .kunitconfig). With =m, Kconfig does
+ * not offer the tests.
+ */
+
+#include <kunit/test.h>
+
+struct lb_test_end {
+	struct snd_pcm_substream substream;
+	struct snd_pcm_runtime runtime;
+	struct snd_pcm_mmap_status status;
+	struct snd_pcm_mmap_control control;
+	struct loopback_pcm dpcm;
+};
+
+/* A single device cable, with a playback and one capture */
+struct lb_test {
+	struct snd_card card;
+	struct snd_pcm pcm;
+	struct snd_avirt_stream stream;
+	struct snd_avirt_stats stats;
+	struct loopback loopback;
+	struct loopback_setup setup;
+	struct loopback_cable cable;
+	struct lb_test_end play;
+	struct lb_test_end capt;
+};
+
+struct lb_test_format {
+	snd_pcm_format_t format;
+	unsigned int channels;
+};
+
+static const struct lb_test_format lb_test_formats[] = {
+	{ SNDRV_PCM_FORMAT_S16_LE, 2 },	  { SNDRV_PCM_FORMAT_S24_3LE, 2 },
+	{ SNDRV_PCM_FORMAT_S24_3LE, 5 },  { SNDRV_PCM_FORMAT_S24_LE, 6 },
+	{ SNDRV_PCM_FORMAT_S32_LE, 8 },	  { SNDRV_PCM_FORMAT_FLOAT_LE, 1 },
+	{ SNDRV_PCM_FORMAT_S16_BE, 32 },
+};
+
+static const unsigned int lb_test_rates[] = { 8000,  11025, 44100,
+					      48000, 96000, 192000 };
+
+static const unsigned int lb_test_rate_shifts[] = { 80000, 99999, NO_PITCH,
+						    100001, 120000 };
+
+/* Period size in frames, and periods per buffer */
+static const unsigned int lb_test_geometries[][2] = {
+	{ 64, 4 }, { 441, 3 }, { 1000, 2 }, { 4096, 2 },
+};
+
+/* Deterministic, so that a failure can be reproduced */
+static u32 lb_test_rand(u32 *seed)
+{
+	*seed = *seed * 1664525 + 1013904223;
+	return *seed >> 8;
+}
+
+static void lb_test_end_init(struct lb_test *t, struct lb_test_end *e,
+			     int stream)
+{
+	e->substream.pcm = &t->pcm;
+	e->substream.stream = stream;
+	e->substream.runtime = &e->runtime;
+	e->runtime.status = &e->status;
+	e->runtime.control = &e->control;
+	e->runtime.private_data = &e->dpcm;
+	e->status.state = SNDRV_PCM_STATE_RUNNING;
+
+	e->dpcm.loopback = &t->loopback;
+	e->dpcm.substream = &e->substream;
+	e->dpcm.cable = &t->cable;
+	e->dpcm.index = stream;
+	snd_avirt_gain_reset(&e->dpcm.gain, SND_AVIRT_GAIN_UNITY);
+	t->cable.streams[e->dpcm.index] = &e->dpcm;
+}
+
+static struct lb_test *lb_test_alloc(struct kunit *test)
+{
+	struct lb_test *t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t);
+	t->pcm.card = &t->card;
+	t->pcm.private_data = &t->stream;
+	t->stream.stats = &t->stats;
+	t->loopback.devices = 1;
+	t->loopback.setup = &t->setup;
+	t->setup.rate_shift = NO_PITCH;
+	t->setup.gain = SND_AVIRT_GAIN_UNITY;
+	spin_lock_init(&t->cable.lock);
+	mutex_init(&t->cable.work_lock);
+	lb_test_end_init(t, &t->play, SNDRV_PCM_STREAM_PLAYBACK);
+	lb_test_end_init(t, &t->capt, SNDRV_PCM_STREAM_CAPTURE);
+
+	return t;
+}
+
+/* Set the geometry of an end, as loopback_prepare() does */
+static void lb_test_end_setup(struct lb_test_end *e, snd_pcm_format_t format,
+			      unsigned int channels, unsigned int rate,
+			      unsigned int period, unsigned int periods)
+{
+	struct snd_pcm_runtime *runtime = &e->runtime;
+	struct loopback_pcm *dpcm = &e->dpcm;
+
+	runtime->format = format;
+	runtime->channels = channels;
+	runtime->rate = rate;
+	runtime->sample_bits = snd_pcm_format_physical_width(format);
+	runtime->frame_bits = runtime->sample_bits * channels;
+	runtime->period_size = period;
+	runtime->buffer_size = period * periods;
+	runtime->boundary = runtime->buffer_size << 10;
+	runtime->dma_bytes = frames_to_bytes(runtime, runtime->buffer_size);
+
+	dpcm->buf_pos = 0;
+	dpcm->silent_size = 0;
+	dpcm->direct_bytes = 0;
+	dpcm->last_drift = 0;
+	dpcm->irq_pos = 0;
+	dpcm->period_update_pending = 0;
+	dpcm->pcm_buffer_size = runtime->dma_bytes;
+	dpcm->pcm_salign = runtime->frame_bits / 8;
+	dpcm->pcm_bps = dpcm->pcm_salign * rate;
+	dpcm->pcm_period_size = frames_to_bytes(runtime, period);
+	dpcm->period_size_frac = frac_pos(dpcm, dpcm->pcm_period_size);
+	dpcm->pcm_rate_shift = NO_PITCH;
+}
+
+static void lb_test_end_alloc(struct kunit *test, struct lb_test_end *e)
+{
+	e->runtime.dma_area =
+		kunit_kzalloc(test, e->runtime.dma_bytes, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, e->runtime.dma_area);
+	if (e->substream.stream == SNDRV_PCM_STREAM_PLAYBACK)
+		return;
+	e->dpcm.conv_buf =
+		kunit_kzalloc(test,
+			      2 * LOOPBACK_SRC_CHUNK *
+				      loopbackap_pcm_hardware.channels_max *
+				      sizeof(s32),
+			      GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, e->dpcm.conv_buf);
+}
+
+/* A sample pattern that differs from frame to frame and byte to byte */
+static void lb_test_fill(struct lb_test_end *e, u8 seed)
+{
+	size_t i;
+
+	for (i = 0; i < e->runtime.dma_bytes; i++)
+		e->runtime.dma_area[i] = (u8)(i * 7 + i / 251 + seed);
+}
+
+/*
+ * Reference frac_delta() over an update of any length, in steps of
+ * MAX_DELTA_NS, exact without a 128-bit product
+ */
+static u64 lb_ref_frac(u64 delta_ns, unsigned int bps, unsigned int shift)
+{
+	u64 x, q, rem, step_ns, frac = 0;
+
+	do {
+		step_ns = min_t(u64, delta_ns, MAX_DELTA_NS);
+		x = step_ns * bps;
+		if (shift == NO_PITCH) {
+			frac += x;
+		} else {
+			q = div64_u64_rem(x, shift, &rem);
+			frac += q * NO_PITCH + div_u64(rem * NO_PITCH, shift);
+		}
+		delta_ns -= step_ns;
+	} while (delta_ns);
+
+	return frac;
+}
+
+/* Reference byte_pos(), of a position that never wraps at the period */
+static u64 lb_ref_pos(u64 frac, unsigned int salign)
+{
+	u64 pos = div_u64(frac, NSEC_PER_SEC);
+	u32 rem;
+
+	div_u64_rem(pos, salign, &rem);
+	return pos - rem;
+}
+
+/*******************************************************************************
+ * Position math
+ ******************************************************************************/
+static void lb_test_byte_pos(struct kunit *test)
+{
+	static const unsigned int pos[] = { 0,	      1,	 2,
+					    3,	      191,	 192,
+					    193,      65535,	 1 << 20,
+					    12345679, 0x7fffffff, 0xfffffff0 };
+	struct loopback_pcm dpcm = { 0 };
+	const struct lb_test_format *f;
+	unsigned int i, j, aligned;
+	u64 frac;
+
+	for (i = 0; i < ARRAY_SIZE(lb_test_formats); i++) {
+		f = &lb_test_formats[i];
+		dpcm.pcm_salign = snd_pcm_format_physical_width(f->format) *
+				  f->channels / 8;
+		for (j = 0; j < ARRAY_SIZE(pos); j++) {
+			aligned = pos[j] - pos[j] % dpcm.pcm_salign;
+			frac = frac_pos(&dpcm, pos[j]);
+			KUNIT_EXPECT_EQ(test, byte_pos(&dpcm, frac), aligned);
+			/* a fraction of a byte does not move the position */
+			KUNIT_EXPECT_EQ(test,
+					byte_pos(&dpcm, frac + NSEC_PER_SEC - 1),
+					aligned);
+			if (!aligned)
+				continue;
+			frac = frac_pos(&dpcm, aligned);
+			KUNIT_EXPECT_EQ(test, byte_pos(&dpcm, frac - 1),
+					aligned - dpcm.pcm_salign);
+		}
+	}
+}
+
+/*
+ * Run updates of pseudo random length through bytepos_delta() and
+ * bytepos_finish(), and check every step against the reference. The last
+ * update spans a few MAX_DELTA_NS steps, and keeps all of its time.
+ */
+static bool lb_test_bytepos_run(struct kunit *test, struct lb_test_end *e,
+				u32 seed)
+{
+	struct loopback_pcm *dpcm = &e->dpcm;
+	u64 total = 0, last, expected, frac, pos, periods, last_periods = 0;
+	unsigned int i, delta, updates = 200;
+	u64 delta_ns;
+
+	for (i = 0; i <= updates; i++) {
+		delta_ns = i < updates ? lb_test_rand(&seed) % 20000000 :
+					 2 * MAX_DELTA_NS + NSEC_PER_SEC;
+		last = lb_ref_pos(total, dpcm->pcm_salign);
+		total += lb_ref_frac(delta_ns, dpcm->pcm_bps,
+				     dpcm->pcm_rate_shift);
+		expected = lb_ref_pos(total, dpcm->pcm_salign) - last;
+
+		dpcm->period_update_pending = 0;
+		delta = bytepos_delta(dpcm, delta_ns);
+		bytepos_finish(dpcm, delta);
+
+		periods = div64_u64_rem(total, dpcm->period_size_frac, &frac);
+		div64_u64_rem(lb_ref_pos(total, dpcm->pcm_salign),
+			      dpcm->pcm_buffer_size, &pos);
+		if (delta != expected || dpcm->irq_pos != frac ||
+		    dpcm->period_update_pending != (periods != last_periods) ||
+		    dpcm->buf_pos != pos) {
+			KUNIT_FAIL(test,
+				   "%s %uch %uHz shift %u period %lu x %u: update %u of %llu ns moved %u bytes to %u, irq_pos %llu",
+				   snd_pcm_format_name(e->runtime.format),
+				   e->runtime.channels, e->runtime.rate,
+				   dpcm->pcm_rate_shift,
+				   e->runtime.period_size,
+				   (unsigned int)(e->runtime.buffer_size /
+						  e->runtime.period_size),
+				   i, delta_ns, delta, dpcm->buf_pos,
+				   dpcm->irq_pos);
+			return false;
+		}
+		last_periods = periods;
+	}
+
+	return true;
+}
+
+static void lb_test_bytepos_delta(struct kunit *test)
+{
+	struct lb_test *t = lb_test_alloc(test);
+	const struct lb_test_format *f;
+	unsigned int i, j, k, l;
+
+	for (i = 0; i < ARRAY_SIZE(lb_test_formats); i++) {
+		f = &lb_test_formats[i];
+		for (j = 0; j < ARRAY_SIZE(lb_test_rates); j++)
+			for (k = 0; k < ARRAY_SIZE(lb_test_rate_shifts); k++)
+				for (l = 0; l < ARRAY_SIZE(lb_test_geometries);
+				     l++) {
+					lb_test_end_setup(
+						&t->play, f->format,
+						f->channels, lb_test_rates[j],
+						lb_test_geometries[l][0],
+						lb_test_geometries[l][1]);
+					t->play.dpcm.pcm_rate_shift =
+						lb_test_rate_shifts[k];
+					if (!lb_test_bytepos_run(test, &t->play,
+								 i + j + k + l))
+						return;
+				}
+	}
+}
+
+/* The drift carried over is taken off the next update, if it is that long */
+static void lb_test_bytepos_drift(struct kunit *test)
+{
+	struct lb_test *t = lb_test_alloc(test);
+	struct loopback_pcm *dpcm = &t->play.dpcm;
+	/* 4 bytes per frame, 192 bytes per ms */
+	u64 ms = NSEC_PER_MSEC;
+
+	lb_test_end_setup(&t->play, SNDRV_PCM_FORMAT_S16_LE, 2, 48000, 480, 4);
+
+	dpcm->last_drift = 8;
+	KUNIT_EXPECT_EQ(test, bytepos_delta(dpcm, ms), 192u - 8u);
+	KUNIT_EXPECT_EQ(test, dpcm->last_drift, 0u);
+	KUNIT_EXPECT_EQ(test, bytepos_delta(dpcm, ms), 192u);
+
+	dpcm->last_drift = 192;
+	KUNIT_EXPECT_EQ(test, bytepos_delta(dpcm, ms), 0u);
+
+	/* a shorter update keeps all of its frames, the drift is dropped */
+	dpcm->last_drift = 196;
+	KUNIT_EXPECT_EQ(test, bytepos_delta(dpcm, ms), 192u);
+	KUNIT_EXPECT_EQ(test, dpcm->last_drift, 0u);
+}
+
+/*******************************************************************************
+ * Cable updates
+ ******************************************************************************/
+/* Check that @bytes at @dst_off of the capture match the playback at @src_off */
+static bool lb_test_match(struct kunit *test, struct lb_test *t,
+			  unsigned int src_off, unsigned int dst_off,
+			  unsigned int bytes)
+{
+	struct loopback_pcm *play = &t->play.dpcm, *capt = &t->capt.dpcm;
+	unsigned int i;
+	u8 src, dst;
+
+	for (i = 0; i < bytes; i++) {
+		src = t->play.runtime.dma_area[(src_off + i) %
+					       play->pcm_buffer_size];
+		dst = t->capt.runtime.dma_area[(dst_off + i) %
+					       capt->pcm_buffer_size];
+		if (src != dst) {
+			KUNIT_FAIL(test,
+				   "capture byte %u at %u is %#x, played %#x at %u",
+				   i, dst_off, dst, src, src_off);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Update the cable @delta_ns after its last update, returns the actual delta */
+static u64 lb_test_pos_update(struct lb_test *t, u64 delta_ns)
+{
+	u64 last_ns = ktime_get_ns() - delta_ns;
+	unsigned int i;
+
+	for (i = 0; i < CABLE_ENDS; i++)
+		if (t->cable.streams[i])
+			t->cable.streams[i]->last_ns = last_ns;
+
+	mutex_lock(&t->cable.work_lock);
+	loopback_pos_update(&t->cable);
+	mutex_unlock(&t->cable.work_lock);
+
+	return t->capt.dpcm.last_ns - last_ns;
+}
+
+/*
+ * The ends of a cable advance in lockstep, by the larger of their frame
+ * counts, and the larger end carries the excess into its next update. So the
+ * cable runs at the mean of the two clocks: twice the frames advanced always
+ * add up to the frames of both clocks, plus the drift carried. The updates
+ * come at a steady interval, as the timers give, so the drift stays well
+ * within an update and is never dropped.
+ */
+static void lb_test_pos_update_drift(struct kunit *test)
+{
+	static const unsigned int shifts[] = { NO_PITCH, 100050, 110000,
+					       90000 };
+	static const u64 intervals[] = { NSEC_PER_MSEC, 2900000,
+					 5 * NSEC_PER_MSEC };
+	struct lb_test *t = lb_test_alloc(test);
+	struct loopback_pcm *play = &t->play.dpcm, *capt = &t->capt.dpcm;
+	atomic64_t *drift = &t->stats.count[SND_AVIRT_STAT_DRIFT];
+	unsigned int i, n, play_pos, capt_pos, frames, total;
+	u64 delta_ns, play_frac, capt_frac;
+
+	for (n = 0; n < ARRAY_SIZE(shifts) * ARRAY_SIZE(intervals); n++) {
+		lb_test_end_setup(&t->play, SNDRV_PCM_FORMAT_S16_LE, 2, 48000,
+				  441, 3);
+		lb_test_end_setup(&t->capt, SNDRV_PCM_FORMAT_S16_LE, 2, 48000,
+				  441, 3);
+		lb_test_end_alloc(test, &t->play);
+		lb_test_end_alloc(test, &t->capt);
+		lb_test_fill(&t->play, n);
+		capt->pcm_rate_shift = shifts[n % ARRAY_SIZE(shifts)];
+		t->cable.valid = t->cable.running =
+			cable_bit(play) | cable_bit(capt);
+		atomic64_set(drift, 0);
+		play_frac = capt_frac = 0;
+		total = 0;
+
+		for (i = 0; i < 300; i++) {
+			play_pos = play->buf_pos;
+			capt_pos = capt->buf_pos;
+			delta_ns = lb_test_pos_update(
+				t, intervals[n / ARRAY_SIZE(shifts)]);
+			play_frac += lb_ref_frac(delta_ns, play->pcm_bps,
+						 play->pcm_rate_shift);
+			capt_frac += lb_ref_frac(delta_ns, capt->pcm_bps,
+						 capt->pcm_rate_shift);
+
+			frames = (play->buf_pos + play->pcm_buffer_size -
+				  play_pos) %
+				 play->pcm_buffer_size / play->pcm_salign;
+			KUNIT_ASSERT_EQ(test, frames,
+					(capt->buf_pos + capt->pcm_buffer_size -
+					 capt_pos) %
+						capt->pcm_buffer_size /
+						capt->pcm_salign);
+			if (!lb_test_match(test, t, play_pos, capt_pos,
+					   frames * play->pcm_salign))
+				return;
+			total += frames;
+		}
+
+		KUNIT_EXPECT_EQ(test, 2 * (u64)total * play->pcm_salign,
+				lb_ref_pos(play_frac, play->pcm_salign) +
+					lb_ref_pos(capt_frac, play->pcm_salign) +
+					play->last_drift + capt->last_drift);
+		/* the end with the smaller count carries no drift */
+		KUNIT_EXPECT_TRUE(test, !play->last_drift || !capt->last_drift);
+		if (capt->pcm_rate_shift == NO_PITCH)
+			KUNIT_EXPECT_EQ(test, atomic64_read(drift), 0LL);
+		else
+			KUNIT_EXPECT_GT(test, atomic64_read(drift), 0LL);
+	}
+}
+
+/* A capture running without its playback records silence, once */
+static void lb_test_pos_update_silence(struct kunit *test)
+{
+	struct lb_test *t = lb_test_alloc(test);
+	struct loopback_pcm *capt = &t->capt.dpcm;
+	u64 capt_frac = 0, pos;
+	unsigned int i;
+
+	lb_test_end_setup(&t->play, SNDRV_PCM_FORMAT_U8, 1, 48000, 441, 3);
+	lb_test_end_setup(&t->capt, SNDRV_PCM_FORMAT_U8, 1, 48000, 441, 3);
+	lb_test_end_alloc(test, &t->capt);
+	t->cable.valid = t->cable.running = cable_bit(capt);
+
+	for (i = 0; i < 100; i++)
+		capt_frac += lb_ref_frac(lb_test_pos_update(t, NSEC_PER_MSEC),
+					 capt->pcm_bps, capt->pcm_rate_shift);
+
+	div64_u64_rem(lb_ref_pos(capt_frac, 1), capt->pcm_buffer_size, &pos);
+	KUNIT_EXPECT_EQ(test, (u64)capt->buf_pos, pos);
+	KUNIT_EXPECT_EQ(test, capt->silent_size, capt->pcm_buffer_size);
+	KUNIT_EXPECT_EQ(test,
+			atomic64_read(&t->stats.count[SND_AVIRT_STAT_SILENCE]),
+			(s64)capt->pcm_buffer_size);
+	KUNIT_EXPECT_PTR_EQ(test,
+			    memchr_inv(t->capt.runtime.dma_area, 0x80,
+				       capt->pcm_buffer_size),
+			    NULL);
+}
+
+/*******************************************************************************
+ * Copies
+ ******************************************************************************/
+/* Check a capture frame is silence, in the capture format */
+static bool lb_test_is_silence(struct lb_test_end *e, unsigned int off)
+{
+	struct snd_pcm_runtime *runtime = &e->runtime;
+	u8 silence[32 * 4];
+
+	snd_pcm_format_set_silence(runtime->format, silence, runtime->channels);
+	return !memcmp(runtime->dma_area + off, silence,
+		       e->dpcm.pcm_salign);
+}
+
+/* Check a capture frame still holds the pattern it was filled with */
+static bool lb_test_is_untouched(struct lb_test_end *e, unsigned int off)
+{
+	return !memchr_inv(e->runtime.dma_area + off, 0xa5, e->dpcm.pcm_salign);
+}
+
+/*
+ * Copy frames across the end of both buffers, from an offset past the playback
+ * position, then check every capture frame: converted from the playback frame,
+ * silence for the frames the playback has not written, or left untouched.
+ */
+static void lb_test_copy_check(struct kunit *test, struct lb_test *t,
+			       snd_pcm_format_t play_format,
+			       snd_pcm_format_t capt_format,
+			       unsigned int valid)
+{
+	struct loopback_pcm *play = &t->play.dpcm, *capt = &t->capt.dpcm;
+	snd_avirt_convert_t convert = NULL;
+	unsigned int offset = 3, frames = 20, i, src_off, dst_off;
+	u8 expected[8 * 4];
+
+	lb_test_end_setup(&t->play, play_format, 2, 48000, 441, 3);
+	lb_test_end_setup(&t->capt, capt_format, 2, 48000, 400, 3);
+	lb_test_end_alloc(test, &t->play);
+	lb_test_end_alloc(test, &t->capt);
+	lb_test_fill(&t->play, 1);
+	memset(t->capt.runtime.dma_area, 0xa5, capt->pcm_buffer_size);
+	if (play_format != capt_format)
+		convert = snd_avirt_convert_get(play_format, capt_format);
+
+	play->buf_pos = play->pcm_buffer_size - 5 * play->pcm_salign;
+	capt->buf_pos = capt->pcm_buffer_size - 7 * capt->pcm_salign;
+	if (valid < offset + frames) {
+		/* draining, with @valid frames written after the position */
+		t->play.status.state = SNDRV_PCM_STATE_DRAINING;
+		t->play.status.hw_ptr = play->buf_pos / play->pcm_salign;
+		t->play.control.appl_ptr = t->play.status.hw_ptr + valid;
+	} else {
+		t->play.status.state = SNDRV_PCM_STATE_RUNNING;
+	}
+	atomic64_set(&t->stats.count[SND_AVIRT_STAT_SILENCE], 0);
+
+	copy_play_buf(play, capt, offset, frames);
+
+	for (i = 0; i < capt->pcm_buffer_size / capt->pcm_salign; i++) {
+		unsigned int k = (i * capt->pcm_salign + capt->pcm_buffer_size -
+				  capt->buf_pos) %
+				 capt->pcm_buffer_size / capt->pcm_salign;
+
+		dst_off = i * capt->pcm_salign;
+		if (k >= frames) {
+			KUNIT_ASSERT_TRUE(test,
+					  lb_test_is_untouched(&t->capt,
+							       dst_off));
+		} else if (offset + k >= valid) {
+			KUNIT_ASSERT_TRUE(test,
+					  lb_test_is_silence(&t->capt,
+							     dst_off));
+		} else {
+			src_off = (play->buf_pos +
+				   (offset + k) * play->pcm_salign) %
+				  play->pcm_buffer_size;
+			if (convert)
+				convert(expected,
+					t->play.runtime.dma_area + src_off, 2);
+			else
+				memcpy(expected,
+				       t->play.runtime.dma_area + src_off,
+				       play->pcm_salign);
+			KUNIT_ASSERT_EQ(test,
+					memcmp(t->capt.runtime.dma_area +
+						       dst_off,
+					       expected, capt->pcm_salign),
+					0);
+		}
+	}
+
+	frames = min(frames, valid > offset ? valid - offset : 0);
+	KUNIT_EXPECT_EQ(test,
+			atomic64_read(&t->stats.count[SND_AVIRT_STAT_SILENCE]),
+			(s64)((20 - frames) * capt->pcm_salign));
+}
+
+static void lb_test_copy_play_buf(struct kunit *test)
+{
+	static const snd_pcm_format_t formats[][2] = {
+		{ SNDRV_PCM_FORMAT_S16_LE, SNDRV_PCM_FORMAT_S16_LE },
+		{ SNDRV_PCM_FORMAT_S24_3LE, SNDRV_PCM_FORMAT_S24_3LE },
+		{ SNDRV_PCM_FORMAT_S32_LE, SNDRV_PCM_FORMAT_S32_LE },
+		{ SNDRV_PCM_FORMAT_S16_LE, SNDRV_PCM_FORMAT_S32_LE },
+		{ SNDRV_PCM_FORMAT_S24_3LE, SNDRV_PCM_FORMAT_S16_BE },
+		{ SNDRV_PCM_FORMAT_FLOAT_LE, SNDRV_PCM_FORMAT_S24_LE },
+	};
+	struct lb_test *t = lb_test_alloc(test);
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(formats); i++) {
+		lb_test_copy_check(test, t, formats[i][0], formats[i][1], ~0u);
+		/* the playback drains before the end of the copy */
+		lb_test_copy_check(test, t, formats[i][0], formats[i][1], 10);
+		lb_test_copy_check(test, t, formats[i][0], formats[i][1], 0);
+	}
+}
+
+/*
+ * Clear across the end of the buffer, in formats whose silence is not all
+ * zero bytes, then check the buffer only ever gets cleared once
+ */
+static void lb_test_clear_capture_buf(struct kunit *test)
+{
+	static const snd_pcm_format_t formats[] = {
+		SNDRV_PCM_FORMAT_U8,	  SNDRV_PCM_FORMAT_U16_LE,
+		SNDRV_PCM_FORMAT_S16_LE,  SNDRV_PCM_FORMAT_S24_3LE,
+		SNDRV_PCM_FORMAT_FLOAT_LE,
+	};
+	struct lb_test *t = lb_test_alloc(test);
+	struct loopback_pcm *capt = &t->capt.dpcm;
+	atomic64_t *silence = &t->stats.count[SND_AVIRT_STAT_SILENCE];
+	unsigned int i, j, frames, off;
+
+	for (i = 0; i < ARRAY_SIZE(formats); i++) {
+		lb_test_end_setup(&t->capt, formats[i], 3, 44100, 100, 2);
+		lb_test_end_alloc(test, &t->capt);
+		memset(t->capt.runtime.dma_area, 0xa5, capt->pcm_buffer_size);
+		atomic64_set(silence, 0);
+		frames = capt->pcm_buffer_size / capt->pcm_salign;
+
+		capt->buf_pos = (frames - 3) * capt->pcm_salign;
+		clear_capture_buf(capt, 7 * capt->pcm_salign);
+		KUNIT_EXPECT_EQ(test, capt->silent_size, 7 * capt->pcm_salign);
+		for (j = 0; j < frames; j++) {
+			off = j * capt->pcm_salign;
+			if ((j + 3) % frames < 7)
+				KUNIT_EXPECT_TRUE(test,
+						  lb_test_is_silence(&t->capt, off));
+			else
+				KUNIT_EXPECT_TRUE(test,
+						  lb_test_is_untouched(&t->capt,
+								       off));
+		}
+
+		/* silence is only written up to the buffer size */
+		bytepos_finish(capt, 7 * capt->pcm_salign);
+		clear_capture_buf(capt, 2 * capt->pcm_buffer_size);
+		bytepos_finish(capt, capt->pcm_buffer_size - 7 * capt->pcm_salign);
+		clear_capture_buf(capt, capt->pcm_salign);
+		KUNIT_EXPECT_EQ(test, capt->silent_size, capt->pcm_buffer_size);
+		KUNIT_EXPECT_EQ(test, atomic64_read(silence),
+				(s64)capt->pcm_buffer_size);
+		for (j = 0; j < frames; j++)
+			KUNIT_EXPECT_TRUE(test,
+					  lb_test_is_silence(&t->capt,
+							     j * capt->pcm_salign));
+	}
+}
+
+static struct kunit_case lb_test_cases[] = {
+	KUNIT_CASE(lb_test_byte_pos),
+	KUNIT_CASE(lb_test_bytepos_delta),
+	KUNIT_CASE(lb_test_bytepos_drift),
+	KUNIT_CASE(lb_test_pos_update_drift),
+	KUNIT_CASE(lb_test_pos_update_silence),
+	KUNIT_CASE(lb_test_copy_play_buf),
+	KUNIT_CASE(lb_test_clear_capture_buf),
+	{}
+};
+
+static struct kunit_suite lb_test_suite = {
+	.name = "avirt_loopback",
+	.test_cases = lb_test_cases,
+};
+
+/*******************************************************************************
+ * Benchmarks
+ ******************************************************************************/
+#define LB_BENCH_BYTES (64 << 20)
+
+enum lb_bench_op {
+	LB_BENCH_COPY,
+	LB_BENCH_SILENCE,
+};
+
+/*
+ * Move LB_BENCH_BYTES of capture data a period at a time, through the rings as
+ * the cable does, and report the capture bytes written per second
+ */
+static void lb_bench(struct kunit *test, const char *name,
+		     snd_pcm_format_t play_format, snd_pcm_format_t capt_format,
+		     unsigned int channels, unsigned int gain,
+		     enum lb_bench_op op)
+{
+	struct lb_test *t = lb_test_alloc(test);
+	struct loopback_pcm *play = &t->play.dpcm, *capt = &t->capt.dpcm;
+	unsigned int period = 1024;
+	u64 bytes = 0, start, ns;
+
+	lb_test_end_setup(&t->play, play_format, channels, 48000, period, 4);
+	lb_test_end_setup(&t->capt, capt_format, channels, 48000, period, 4);
+	lb_test_end_alloc(test, &t->play);
+	lb_test_end_alloc(test, &t->capt);
+	lb_test_fill(&t->play, 0);
+	t->setup.gain = gain;
+	snd_avirt_gain_reset(&capt->gain, gain);
+
+	start = ktime_get_ns();
+	while (bytes < LB_BENCH_BYTES) {
+		if (op == LB_BENCH_COPY) {
+			copy_play_buf(play, capt, 0, period);
+		} else {
+			capt->silent_size = 0;
+			clear_capture_buf(capt, period * capt->pcm_salign);
+		}
+		bytepos_finish(play, period * play->pcm_salign);
+		bytepos_finish(capt, period * capt->pcm_salign);
+		bytes += period * capt->pcm_salign;
+	}
+	ns = max_t(u64, ktime_get_ns() - start, 1);
+
+	kunit_info(test, "%s: %llu MB/s\n", name,
+		   div64_u64(bytes * NSEC_PER_SEC, ns * 1000000));
+}
+
+static void lb_bench_copy(struct kunit *test)
+{
+	lb_bench(test, "copy S16_LE 2ch", SNDRV_PCM_FORMAT_S16_LE,
+		 SNDRV_PCM_FORMAT_S16_LE, 2, SND_AVIRT_GAIN_UNITY,
+		 LB_BENCH_COPY);
+	lb_bench(test, "copy S32_LE 8ch", SNDRV_PCM_FORMAT_S32_LE,
+		 SNDRV_PCM_FORMAT_S32_LE, 8, SND_AVIRT_GAIN_UNITY,
+		 LB_BENCH_COPY);
+}
+
+static void lb_bench_convert(struct kunit *test)
+{
+	lb_bench(test, "convert S16_LE to S32_LE 2ch", SNDRV_PCM_FORMAT_S16_LE,
+		 SNDRV_PCM_FORMAT_S32_LE, 2, SND_AVIRT_GAIN_UNITY,
+		 LB_BENCH_COPY);
+	lb_bench(test, "convert FLOAT_LE to S24_3LE 8ch",
+		 SNDRV_PCM_FORMAT_FLOAT_LE, SNDRV_PCM_FORMAT_S24_3LE, 8,
+		 SND_AVIRT_GAIN_UNITY, LB_BENCH_COPY);
+}
+
+static void lb_bench_gain(struct kunit *test)
+{
+	lb_bench(test, "gain S16_LE 2ch", SNDRV_PCM_FORMAT_S16_LE,
+		 SNDRV_PCM_FORMAT_S16_LE, 2, SND_AVIRT_GAIN_UNITY / 2,
+		 LB_BENCH_COPY);
+}
+
+static void lb_bench_silence(struct kunit *test)
+{
+	lb_bench(test, "silence S16_LE 2ch", SNDRV_PCM_FORMAT_S16_LE,
+		 SNDRV_PCM_FORMAT_S16_LE, 2, SND_AVIRT_GAIN_UNITY,
+		 LB_BENCH_SILENCE);
+	lb_bench(test, "silence U8 2ch", SNDRV_PCM_FORMAT_U8,
+		 SNDRV_PCM_FORMAT_U8, 2, SND_AVIRT_GAIN_UNITY,
+		 LB_BENCH_SILENCE);
+}
+
+static struct kunit_case lb_bench_cases[] = {
+	KUNIT_CASE(lb_bench_copy),
+	KUNIT_CASE(lb_bench_convert),
+	KUNIT_CASE(lb_bench_gain),
+	KUNIT_CASE(lb_bench_silence),
+	{}
+};
+
+static struct kunit_suite lb_bench_suite = {
+	.name = "avirt_loopback_bench",
+	.test_cases = lb_bench_cases,
+};
+
+kunit_test_suite(lb_test_suite);
+kunit_test_suite(lb_bench_suite);
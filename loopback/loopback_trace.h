@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * AVIRT - ALSA Virtual Soundcard
+ *
+ * Copyright (c) 2010-2018 Fiberdyne Systems Pty Ltd
+ *
+ * loopback_trace.h - AVIRT Loopback Audio Path tracepoints
+ *
+ * The events name their substream and carry a position and a byte count in
+ * bytes, as the AVIRT PCM events do.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM avirt_loopback
+
+#if !defined(_LOOPBACK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOOPBACK_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <sound/pcm.h>
+
+/*
+ * The cable is advanced to now, the playback position moving by bytes. running
+ * has a bit set for each running end of the cable, and drift is the excess the
+ * playback carries into its next update.
+ */
+TRACE_EVENT(loopback_pos_update,
+	TP_PROTO(struct snd_pcm_substream *substream, unsigned int pos,
+		 unsigned int bytes, unsigned int running, unsigned int drift),
+	TP_ARGS(substream, pos, bytes, running, drift),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(int, device)
+		__field(int, stream)
+		__field(int, number)
+		__field(unsigned int, pos)
+		__field(unsigned int, bytes)
+		__field(unsigned int, running)
+		__field(unsigned int, drift)
+	),
+	TP_fast_assign(
+		__entry->card = substream->pcm->card->number;
+		__entry->device = substream->pcm->device;
+		__entry->stream = substream->stream;
+		__entry->number = substream->number;
+		__entry->pos = pos;
+		__entry->bytes = bytes;
+		__entry->running = running;
+		__entry->drift = drift;
+	),
+	TP_printk("pcmC%dD%d%c:%d pos=%u bytes=%u running=%#x drift=%u",
+		  __entry->card, __entry->device,
+		  __entry->stream ? 'c' : 'p', __entry->number, __entry->pos,
+		  __entry->bytes, __entry->running, __entry->drift)
+);
+
+/*
+ * Played frames are copied to a capture, from src in the playback buffer to pos
+ * in the capture buffer. silence is what the capture gets in place of frames
+ * that were not played yet.
+ */
+TRACE_EVENT(loopback_copy_play_buf,
+	TP_PROTO(struct snd_pcm_substream *substream, unsigned int src,
+		 unsigned int pos, unsigned int bytes, unsigned int silence),
+	TP_ARGS(substream, src, pos, bytes, silence),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(int, device)
+		__field(int, stream)
+		__field(int, number)
+		__field(unsigned int, src)
+		__field(unsigned int, pos)
+		__field(unsigned int, bytes)
+		__field(unsigned int, silence)
+	),
+	TP_fast_assign(
+		__entry->card = substream->pcm->card->number;
+		__entry->device = substream->pcm->device;
+		__entry->stream = substream->stream;
+		__entry->number = substream->number;
+		__entry->src = src;
+		__entry->pos = pos;
+		__entry->bytes = bytes;
+		__entry->silence = silence;
+	),
+	TP_printk("pcmC%dD%d%c:%d pos=%u bytes=%u src=%u silence=%u",
+		  __entry->card, __entry->device,
+		  __entry->stream ? 'c' : 'p', __entry->number, __entry->pos,
+		  __entry->bytes, __entry->src, __entry->silence)
+);
+
+#endif /* _LOOPBACK_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE loopback_trace
+
+#include <trace/define_trace.h>
@@ -0,0 +1,659 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Mixer Audio Path for AVIRT
+ *
+ * Copyright (c) 2010-2018 Fiberdyne Systems Pty Ltd
+ *
+ * mixer.c - Mixer Audio Path driver implementation for AVIRT
+ *
+ * Every playback stream mapped to this Audio Path is an input, and every
+ * capture stream is an output bus. All running inputs are mixed into all
+ * running buses in kernel context, so that a user-space softmixer is not
+ * needed to sum the streams.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <sound/control.h>
+#include <sound/avirt.h>
+
+#include "avirt_trace.h"
+
+MODULE_AUTHOR("James O'Shannessy <james.oshannessy@fiberdyne.com.au>");
+MODULE_AUTHOR("Mark Farrugia <mark.farrugia@fiberdyne.com.au>");
+MODULE_DESCRIPTION("Mixer Audio Path for AVIRT");
+MODULE_LICENSE("GPL v2");
+
+#define AP_UID "ap_mixer"
+
+#define AP_INFOK(fmt, args...) DINFO(AP_UID, fmt, ##args)
+#define AP_PRINTK(fmt, args...) DDEBUG(AP_UID, fmt, ##args)
+#define AP_ERRORK(fmt, args...) DERROR(AP_UID, fmt, ##args)
+
+#define MIXER_SAMPLE_RATE 48000
+#define MIXER_CHANNELS_MAX 8
+#define MIXER_PERIODS_MIN 1
+#define MIXER_PERIODS_MAX 32
+#define MIXER_PERIOD_BYTES_MIN 64
+#define MIXER_BUFFER_BYTES_MAX (256 * 1024)
+
+/* Frames mixed per pass */
+#define MIXER_CHUNK 256
+
+static struct snd_avirt_coreinfo *coreinfo;
+
+/**
+ * struct mixer_pcm - Mixer substream data
+ * @substream: The ALSA substream
+ * @list: Entry in the engine's inputs or buses, while running
+ * @due: Entry in the list of streams to notify of an elapsed period
+ * @buf_pos: Position in the buffer, in frames
+ * @period_pos: Position in the current period, in frames
+ * @elapsed: A period boundary was crossed since the last notification
+ * @convert: Input load to, or bus store from, native s32 samples
+ * @gain: Input gain ramp
+ * @acc: Bus accumulator, MIXER_CHUNK frames
+ */
+struct mixer_pcm {
+	struct snd_pcm_substream *substream;
+	struct list_head list;
+	struct list_head due;
+	unsigned int buf_pos;
+	unsigned int period_pos;
+	bool elapsed;
+	snd_avirt_convert_t convert;
+	struct snd_avirt_gain gain;
+	s64 *acc;
+};
+
+/**
+ * struct mixer_engine - The mixing engine, shared by all mixer streams
+ * @lock: Protects the fields below, and the running streams' positions
+ * @inputs: Running playback streams
+ * @buses: Running capture streams
+ * @timer: Wakes the engine at the next period boundary of any stream
+ * @base_ns: ktime of the engine's frame 0
+ * @frames: Frames mixed since @base_ns
+ * @in: One chunk of an input, in native s32
+ * @gain: Input gain of each playback device, Q16, sized at configure time
+ * @cpu_nested: CPU time accounting, see struct snd_avirt_cpu
+ */
+struct mixer_engine {
+	spinlock_t lock;
+	struct list_head inputs;
+	struct list_head buses;
+	struct hrtimer timer;
+	u64 base_ns;
+	u64 frames;
+	s32 in[MIXER_CHUNK * MIXER_CHANNELS_MAX];
+	unsigned int *gain;
+	u64 cpu_nested;
+};
+
+static struct mixer_engine *mixer;
+
+/*******************************************************************************
+ * Mixing
+ *
+ * The inputs are scaled by their gain, and summed into a 64-bit accumulator
+ * per bus, which is saturated to s32 once all inputs are in. The mix is plain
+ * scalar integer code: kernel C is built without the FPU or SIMD registers,
+ * and there is no kernel_fpu_begin() guarded vector path.
+ ******************************************************************************/
+static void mixer_accumulate(s64 *acc, unsigned int acc_ch, const s32 *in,
+			     unsigned int in_ch, unsigned int frames)
+{
+	unsigned int f, c, n;
+	s64 v, recip;
+
+	if (in_ch == acc_ch) {
+		n = frames * in_ch;
+		for (f = 0; f < n; f++)
+			acc[f] += in[f];
+	} else if (in_ch == 1) {
+		/* mono input feeds every bus channel */
+		for (f = 0; f < frames; f++)
+			for (c = 0; c < acc_ch; c++)
+				acc[f * acc_ch + c] += in[f];
+	} else if (acc_ch == 1) {
+		/*
+		 * mono bus takes the average of the input channels, scaled by
+		 * a Q28 reciprocal: MIXER_CHANNELS_MAX s32 sums fit it in s64
+		 */
+		recip = DIV_ROUND_CLOSEST(1 << 28, in_ch);
+		for (f = 0; f < frames; f++) {
+			v = 0;
+			for (c = 0; c < in_ch; c++)
+				v += in[f * in_ch + c];
+			acc[f] += (v * recip) >> 28;
+		}
+	} else {
+		/* otherwise, channels map one to one */
+		n = min(in_ch, acc_ch);
+		for (f = 0; f < frames; f++)
+			for (c = 0; c < n; c++)
+				acc[f * acc_ch + c] += in[f * in_ch + c];
+	}
+}
+
+static void mixer_saturate(s32 *out, const s64 *acc, unsigned int samples)
+{
+	unsigned int i;
+
+	for (i = 0; i < samples; i++)
+		out[i] = clamp_t(s64, acc[i], S32_MIN, S32_MAX);
+}
+
+/* Load @frames of an input into @in, from its buffer position */
+static void mixer_load(struct mixer_pcm *dpcm, s32 *in, unsigned int frames)
+{
+	struct snd_pcm_runtime *runtime = dpcm->substream->runtime;
+	unsigned int pos = dpcm->buf_pos, n;
+	struct snd_avirt_cpu cpu;
+
+	snd_avirt_stat_add(dpcm->substream, SND_AVIRT_STAT_BYTES,
+			   frames_to_bytes(runtime, frames));
+	snd_avirt_cpu_enter(&cpu, &mixer->cpu_nested);
+	while (frames) {
+		n = min_t(unsigned int, frames, runtime->buffer_size - pos);
+		dpcm->convert(in, runtime->dma_area + frames_to_bytes(runtime, pos),
+			      n * runtime->channels);
+		in += n * runtime->channels;
+		frames -= n;
+		pos = (pos + n) % runtime->buffer_size;
+	}
+	snd_avirt_stat_add(dpcm->substream, SND_AVIRT_STAT_CPU_COPY,
+			   snd_avirt_cpu_exit(&cpu, &mixer->cpu_nested));
+}
+
+/* Store @frames of a bus accumulator at its buffer position */
+static void mixer_store(struct mixer_pcm *dpcm, s32 *out, unsigned int frames)
+{
+	struct snd_pcm_runtime *runtime = dpcm->substream->runtime;
+	unsigned int pos = dpcm->buf_pos, n;
+	struct snd_avirt_cpu cpu;
+
+	snd_avirt_cpu_enter(&cpu, &mixer->cpu_nested);
+	mixer_saturate(out, dpcm->acc, frames * runtime->channels);
+	snd_avirt_stat_add(dpcm->substream, SND_AVIRT_STAT_BYTES,
+			   frames_to_bytes(runtime, frames));
+	while (frames) {
+		n = min_t(unsigned int, frames, runtime->buffer_size - pos);
+		dpcm->convert(runtime->dma_area + frames_to_bytes(runtime, pos),
+			      out, n * runtime->channels);
+		out += n * runtime->channels;
+		frames -= n;
+		pos = (pos + n) % runtime->buffer_size;
+	}
+	snd_avirt_stat_add(dpcm->substream, SND_AVIRT_STAT_CPU_COPY,
+			   snd_avirt_cpu_exit(&cpu, &mixer->cpu_nested));
+}
+
+static void mixer_advance(struct mixer_pcm *dpcm, unsigned int frames)
+{
+	struct snd_pcm_runtime *runtime = dpcm->substream->runtime;
+
+	dpcm->buf_pos = (dpcm->buf_pos + frames) % runtime->buffer_size;
+	dpcm->period_pos += frames;
+	if (dpcm->period_pos >= runtime->period_size) {
+		dpcm->period_pos %= runtime->period_size;
+		dpcm->elapsed = true;
+	}
+}
+
+/* call in mixer->lock */
+static void mixer_mix(struct mixer_engine *m, unsigned int frames)
+{
+	struct mixer_pcm *input, *bus;
+	unsigned int n;
+
+	while (frames) {
+		n = min_t(unsigned int, frames, MIXER_CHUNK);
+
+		list_for_each_entry(bus, &m->buses, list)
+			memset(bus->acc, 0, n * bus->substream->runtime->channels *
+						    sizeof(s64));
+
+		list_for_each_entry(input, &m->inputs, list) {
+			struct snd_pcm_runtime *runtime = input->substream->runtime;
+			unsigned int gain = m->gain[input->substream->pcm->device];
+
+			if (list_empty(&m->buses))
+				continue;
+			mixer_load(input, m->in, n);
+			if (!snd_avirt_gain_is_unity(&input->gain, gain))
+				snd_avirt_gain_apply(&input->gain, gain,
+						     runtime->period_size, m->in,
+						     n, runtime->channels);
+			list_for_each_entry(bus, &m->buses, list)
+				mixer_accumulate(bus->acc,
+						 bus->substream->runtime->channels,
+						 m->in, runtime->channels, n);
+		}
+
+		/* the bus is done with its chunk, reuse the input buffer */
+		list_for_each_entry(bus, &m->buses, list) {
+			mixer_store(bus, m->in, n);
+			mixer_advance(bus, n);
+		}
+		list_for_each_entry(input, &m->inputs, list)
+			mixer_advance(input, n);
+
+		frames -= n;
+	}
+}
+
+/*******************************************************************************
+ * Engine clock
+ ******************************************************************************/
+static inline bool mixer_running(struct mixer_engine *m)
+{
+	return !list_empty(&m->inputs) || !list_empty(&m->buses);
+}
+
+/* Mix up to now. call in mixer->lock */
+static void mixer_update(struct mixer_engine *m)
+{
+	u64 target;
+
+	if (!mixer_running(m))
+		return;
+	target = mul_u64_u32_div(ktime_get_ns() - m->base_ns,
+				 MIXER_SAMPLE_RATE, NSEC_PER_SEC);
+	if (target <= m->frames)
+		return;
+	mixer_mix(m, target - m->frames);
+	m->frames = target;
+}
+
+/* Wake at the next period boundary of any running stream. call in mixer->lock */
+static void mixer_arm(struct mixer_engine *m)
+{
+	struct list_head *lists[] = { &m->inputs, &m->buses };
+	unsigned int rest = UINT_MAX, i;
+	struct mixer_pcm *dpcm;
+	u64 ns;
+
+	for (i = 0; i < ARRAY_SIZE(lists); i++)
+		list_for_each_entry(dpcm, lists[i], list)
+			rest = min_t(unsigned int, rest,
+				     dpcm->substream->runtime->period_size -
+					     dpcm->period_pos);
+	if (rest == UINT_MAX)
+		return;
+
+	ns = mul_u64_u32_div(m->frames + rest, NSEC_PER_SEC,
+			     MIXER_SAMPLE_RATE) + 1;
+	hrtimer_start(&m->timer, ns_to_ktime(m->base_ns + ns),
+		      HRTIMER_MODE_ABS);
+}
+
+/* Move the streams that crossed a period boundary to @due. call in mixer->lock */
+static void mixer_collect(struct mixer_engine *m, struct list_head *due)
+{
+	struct list_head *lists[] = { &m->inputs, &m->buses };
+	struct mixer_pcm *dpcm;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(lists); i++) {
+		list_for_each_entry(dpcm, lists[i], list) {
+			if (!dpcm->elapsed)
+				continue;
+			dpcm->elapsed = false;
+			list_add_tail(&dpcm->due, due);
+		}
+	}
+}
+
+/*
+ * Share the engine time, mostly mixing, evenly among the running streams.
+ * call in mixer->lock
+ */
+static void mixer_charge(struct mixer_engine *m, u64 ns)
+{
+	struct list_head *lists[] = { &m->inputs, &m->buses };
+	unsigned int count = 0, i;
+	struct mixer_pcm *dpcm;
+
+	for (i = 0; i < ARRAY_SIZE(lists); i++)
+		list_for_each_entry(dpcm, lists[i], list)
+			count++;
+	if (!count)
+		return;
+
+	ns = div_u64(ns, count);
+	for (i = 0; i < ARRAY_SIZE(lists); i++)
+		list_for_each_entry(dpcm, lists[i], list)
+			snd_avirt_stat_add(dpcm->substream,
+					   SND_AVIRT_STAT_CPU_TIMER, ns);
+}
+
+static enum hrtimer_restart mixer_timer_function(struct hrtimer *t)
+{
+	struct mixer_engine *m = container_of(t, struct mixer_engine, timer);
+	struct mixer_pcm *dpcm, *tmp;
+	struct snd_avirt_cpu cpu;
+	unsigned long flags;
+	LIST_HEAD(due);
+
+	spin_lock_irqsave(&m->lock, flags);
+	snd_avirt_cpu_enter(&cpu, &m->cpu_nested);
+	mixer_update(m);
+	mixer_collect(m, &due);
+	/* mixer_arm() re-arms the timer while any stream runs */
+	mixer_arm(m);
+	mixer_charge(m, snd_avirt_cpu_exit(&cpu, &m->cpu_nested));
+	spin_unlock_irqrestore(&m->lock, flags);
+
+	/* need to unlock before calling below, it may stop the stream */
+	list_for_each_entry_safe(dpcm, tmp, &due, due) {
+		list_del_init(&dpcm->due);
+		snd_avirt_pcm_period_elapsed(dpcm->substream);
+	}
+
+	return HRTIMER_NORESTART;
+}
+
+/*******************************************************************************
+ * Audio Path ALSA PCM Callbacks
+ ******************************************************************************/
+static int mixer_pcm_open(struct snd_pcm_substream *substream)
+{
+	struct mixer_pcm *dpcm;
+
+	dpcm = kzalloc(sizeof(*dpcm), GFP_KERNEL);
+	if (!dpcm)
+		return -ENOMEM;
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		dpcm->acc = kcalloc(MIXER_CHUNK * MIXER_CHANNELS_MAX,
+				    sizeof(s64), GFP_KERNEL);
+		if (!dpcm->acc) {
+			kfree(dpcm);
+			return -ENOMEM;
+		}
+	}
+	dpcm->substream = substream;
+	INIT_LIST_HEAD(&dpcm->list);
+	INIT_LIST_HEAD(&dpcm->due);
+	substream->runtime->private_data = dpcm;
+
+	return 0;
+}
+
+static int mixer_pcm_close(struct snd_pcm_substream *substream)
+{
+	struct mixer_pcm *dpcm = substream->runtime->private_data;
+
+	/* Synchronise with a tick that may hold this stream on its due list */
+	hrtimer_cancel(&mixer->timer);
+	spin_lock_irq(&mixer->lock);
+	list_del_init(&dpcm->list);
+	mixer_arm(mixer);
+	spin_unlock_irq(&mixer->lock);
+
+	kfree(dpcm->acc);
+	kfree(dpcm);
+
+	return 0;
+}
+
+static int mixer_pcm_prepare(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct mixer_pcm *dpcm = runtime->private_data;
+
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+		dpcm->convert =
+			snd_avirt_convert_get(runtime->format,
+					      SNDRV_PCM_FORMAT_S32);
+	else
+		dpcm->convert = snd_avirt_convert_get(SNDRV_PCM_FORMAT_S32,
+						      runtime->format);
+	if (!dpcm->convert)
+		return -EINVAL;
+
+	dpcm->buf_pos = 0;
+	dpcm->period_pos = 0;
+	dpcm->elapsed = false;
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		spin_lock_irq(&mixer->lock);
+		snd_avirt_gain_reset(&dpcm->gain,
+				     mixer->gain[substream->pcm->device]);
+		spin_unlock_irq(&mixer->lock);
+	}
+
+	return 0;
+}
+
+static int mixer_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+	struct mixer_pcm *dpcm = substream->runtime->private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mixer->lock, flags);
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+	case SNDRV_PCM_TRIGGER_RESUME:
+		if (!mixer_running(mixer)) {
+			mixer->base_ns = ktime_get_ns();
+			mixer->frames = 0;
+		} else {
+			mixer_update(mixer);
+		}
+		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+			list_add_tail(&dpcm->list, &mixer->inputs);
+		else
+			list_add_tail(&dpcm->list, &mixer->buses);
+		mixer_arm(mixer);
+		break;
+	case SNDRV_PCM_TRIGGER_STOP:
+	case SNDRV_PCM_TRIGGER_SUSPEND:
+		mixer_update(mixer);
+		/* the timer stops once no stream is left to re-arm it */
+		list_del_init(&dpcm->list);
+		break;
+	default:
+		spin_unlock_irqrestore(&mixer->lock, flags);
+		return -EINVAL;
+	}
+	spin_unlock_irqrestore(&mixer->lock, flags);
+
+	return 0;
+}
+
+static snd_pcm_uframes_t mixer_pcm_pointer(struct snd_pcm_substream *substream)
+{
+	struct mixer_pcm *dpcm = substream->runtime->private_data;
+	struct snd_avirt_cpu cpu;
+	snd_pcm_uframes_t pos;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mixer->lock, flags);
+	snd_avirt_cpu_enter(&cpu, &mixer->cpu_nested);
+	mixer_update(mixer);
+	pos = dpcm->buf_pos;
+	snd_avirt_stat_add(substream, SND_AVIRT_STAT_CPU_POINTER,
+			   snd_avirt_cpu_exit(&cpu, &mixer->cpu_nested));
+	spin_unlock_irqrestore(&mixer->lock, flags);
+	trace_avirt_pcm_pointer(substream, pos);
+
+	return pos;
+}
+
+static struct snd_pcm_ops mixerap_pcm_ops = {
+	.open = mixer_pcm_open,
+	.close = mixer_pcm_close,
+	.prepare = mixer_pcm_prepare,
+	.pointer = mixer_pcm_pointer,
+	.trigger = mixer_pcm_trigger,
+};
+
+/*******************************************************************************
+ * Mixer controls
+ ******************************************************************************/
+static int mixer_gain_info(struct snd_kcontrol *kcontrol,
+			   struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = SND_AVIRT_GAIN_UNITY;
+	uinfo->value.integer.step = 1;
+	return 0;
+}
+
+static int mixer_gain_get(struct snd_kcontrol *kcontrol,
+			  struct snd_ctl_elem_value *ucontrol)
+{
+	struct mixer_engine *m = snd_kcontrol_chip(kcontrol);
+
+	spin_lock_irq(&m->lock);
+	ucontrol->value.integer.value[0] = m->gain[kcontrol->id.device];
+	spin_unlock_irq(&m->lock);
+	return 0;
+}
+
+static int mixer_gain_put(struct snd_kcontrol *kcontrol,
+			  struct snd_ctl_elem_value *ucontrol)
+{
+	struct mixer_engine *m = snd_kcontrol_chip(kcontrol);
+	unsigned int val;
+	int change = 0;
+
+	val = clamp_t(long, ucontrol->value.integer.value[0], 0,
+		      SND_AVIRT_GAIN_UNITY);
+	spin_lock_irq(&m->lock);
+	if (val != m->gain[kcontrol->id.device]) {
+		m->gain[kcontrol->id.device] = val;
+		change = 1;
+	}
+	spin_unlock_irq(&m->lock);
+	return change;
+}
+
+static struct snd_kcontrol_new mixer_gain_control = {
+	.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+	.name = "PCM Playback Volume",
+	.info = mixer_gain_info,
+	.get = mixer_gain_get,
+	.put = mixer_gain_put,
+};
+
+/*******************************************************************************
+ * Mixer Audio Path AVIRT registration
+ ******************************************************************************/
+static int mixer_configure(struct snd_card *card,
+			   struct config_group *snd_avirt_stream_group,
+			   unsigned int stream_count)
+{
+	struct snd_kcontrol *kctl;
+	struct list_head *entry;
+	int err, ret = 0;
+
+	mixer->gain = kcalloc(stream_count, sizeof(*mixer->gain), GFP_KERNEL);
+	if (!mixer->gain)
+		return -ENOMEM;
+
+	list_for_each (entry, &snd_avirt_stream_group->cg_children) {
+		struct config_item *item =
+			container_of(entry, struct config_item, ci_entry);
+		struct snd_avirt_stream *stream =
+			snd_avirt_stream_from_config_item(item);
+
+		if (strcmp(stream->map, AP_UID))
+			continue;
+		AP_INFOK("stream name:%s device:%d channels:%d", stream->name,
+			 stream->device, stream->channels);
+		/*
+		 * The engine buffers hold MIXER_CHANNELS_MAX channels, and the
+		 * core refuses to open a stream with more
+		 */
+		if (stream->channels < 1 ||
+		    stream->channels > MIXER_CHANNELS_MAX) {
+			AP_ERRORK("stream %s: %d channels, at most %d supported",
+				  stream->name, stream->channels,
+				  MIXER_CHANNELS_MAX);
+			ret = -EINVAL;
+			continue;
+		}
+		if (stream->direction != SNDRV_PCM_STREAM_PLAYBACK)
+			continue;
+
+		/* each input gets its own gain */
+		mixer->gain[stream->device] = stream->gain;
+		kctl = snd_ctl_new1(&mixer_gain_control, mixer);
+		if (!kctl)
+			return -ENOMEM;
+		kctl->id.device = stream->device;
+		kctl->id.subdevice = 0;
+		err = snd_ctl_add(card, kctl);
+		if (err < 0)
+			return err;
+	}
+
+	return ret;
+}
+
+static struct snd_pcm_hardware mixerap_hw = {
+	.formats = SND_AVIRT_CONVERT_FORMATS,
+	.info = (SNDRV_PCM_INFO_INTERLEAVED // Channel interleaved audio
+		 | SNDRV_PCM_INFO_BLOCK_TRANSFER | SNDRV_PCM_INFO_MMAP |
+		 SNDRV_PCM_INFO_MMAP_VALID),
+	.rates = SNDRV_PCM_RATE_48000,
+	.rate_min = MIXER_SAMPLE_RATE,
+	.rate_max = MIXER_SAMPLE_RATE,
+	.channels_min = 1,
+	.channels_max = MIXER_CHANNELS_MAX,
+	.buffer_bytes_max = MIXER_BUFFER_BYTES_MAX,
+	.period_bytes_min = MIXER_PERIOD_BYTES_MIN,
+	.period_bytes_max = MIXER_BUFFER_BYTES_MAX,
+	.periods_min = MIXER_PERIODS_MIN,
+	.periods_max = MIXER_PERIODS_MAX,
+};
+
+static struct snd_avirt_audiopath mixerap_module = {
+	.uid = AP_UID,
+	.name = "Mixer Audio Path",
+	.version = { 0, 0, 1 },
+	.hw = &mixerap_hw,
+	.pcm_ops = &mixerap_pcm_ops,
+	.configure = mixer_configure,
+	.flags = SND_AVIRT_AP_DIRECT_OPS,
+	.owner = THIS_MODULE,
+};
+
+static int __init mixer_init(void)
+{
+	int err = 0;
+
+	mixer = kzalloc(sizeof(*mixer), GFP_KERNEL);
+	if (!mixer)
+		return -ENOMEM;
+	spin_lock_init(&mixer->lock);
+	INIT_LIST_HEAD(&mixer->inputs);
+	INIT_LIST_HEAD(&mixer->buses);
+	hrtimer_init(&mixer->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	mixer->timer.function = mixer_timer_function;
+
+	err = snd_avirt_audiopath_register(&mixerap_module, &coreinfo);
+	if ((err < 0) || (!coreinfo)) {
+		AP_ERRORK("coreinfo is NULL!");
+		kfree(mixer);
+		return err;
+	}
+
+	return 0;
+}
+
+static void __exit mixer_exit(void)
+{
+	snd_avirt_audiopath_deregister(&mixerap_module);
+	hrtimer_cancel(&mixer->timer);
+	kfree(mixer->gain);
+	kfree(mixer);
+}
+
+module_init(mixer_init);
+module_exit(mixer_exit);
@@ -7,8 +7,23 @@
  * pcm.c - AVIRT PCM interface
  */
 
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/rcupdate.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
 #include "core.h"
 
+#define CREATE_TRACE_POINTS
+#include "avirt_trace.h"
+
+/* Audio Paths with direct callbacks trace them themselves */
+EXPORT_TRACEPOINT_SYMBOL_GPL(avirt_pcm_pointer);
+EXPORT_TRACEPOINT_SYMBOL_GPL(avirt_pcm_ack);
+EXPORT_TRACEPOINT_SYMBOL_GPL(avirt_pcm_copy_user);
+EXPORT_TRACEPOINT_SYMBOL_GPL(avirt_pcm_copy_kernel);
+
 #define D_LOGNAME "pcm"
 
 #define D_INFOK(fmt, args...) DINFO(D_LOGNAME, fmt, ##args)
@@ -29,11 +44,163 @@
  */
 void snd_avirt_pcm_period_elapsed(struct snd_pcm_substream *substream)
 {
+	trace_avirt_pcm_period_elapsed(substream);
+
 	// Notify ALSA middle layer of the elapsed period boundary
 	snd_pcm_period_elapsed(substream);
+	// The lateness is measured from the position it updated
+	snd_avirt_stats_period(substream);
 }
 EXPORT_SYMBOL_GPL(snd_avirt_pcm_period_elapsed);
 
+/*******************************************************************************
+ * PCM buffer cache
+ ******************************************************************************/
+static struct snd_avirt_pcm_buffer *
+pcm_buffer_get(struct snd_pcm_substream *substream)
+{
+	struct snd_avirt_stream *stream = substream->pcm->private_data;
+
+	return &stream->buffers->buf[snd_avirt_substream_index(substream)];
+}
+
+/*
+ * The backend of a stream's buffers is set on the stream itself, or else by
+ * its Audio Path
+ */
+static unsigned int pcm_buffer_backend(struct snd_pcm_substream *substream)
+{
+	struct snd_avirt_stream *stream = substream->pcm->private_data;
+	struct snd_avirt_audiopath *audiopath = substream->private_data;
+
+	if (stream->buffer != SND_AVIRT_BUFFER_DEFAULT)
+		return stream->buffer;
+	if (audiopath->buffer != SND_AVIRT_BUFFER_DEFAULT)
+		return audiopath->buffer;
+	return SND_AVIRT_BUFFER_VMALLOC;
+}
+
+static void pcm_buffer_free(struct snd_avirt_pcm_buffer *buf)
+{
+	if (is_vmalloc_addr(buf->area))
+		vfree(buf->area);
+	else if (buf->area)
+		free_pages_exact(buf->area, buf->bytes);
+	buf->area = NULL;
+	buf->bytes = 0;
+}
+
+/*
+ * Physically contiguous buffers live in the kernel linear mapping, which most
+ * architectures map with huge pages, so copies to and from them touch far fewer
+ * TLB entries. They fall back to vmalloc when memory is too fragmented.
+ */
+static int pcm_buffer_alloc(struct snd_avirt_pcm_buffer *buf, size_t size,
+			    unsigned int backend)
+{
+	if (backend == SND_AVIRT_BUFFER_CONTIG) {
+		buf->area = alloc_pages_exact(size, GFP_KERNEL | __GFP_ZERO |
+							    __GFP_NOWARN);
+		if (!buf->area)
+			D_INFOK("No contiguous %zu byte buffer, using vmalloc",
+				size);
+	}
+	if (!buf->area)
+		buf->area = vzalloc(size);
+	if (!buf->area)
+		return -ENOMEM;
+	buf->bytes = size;
+	buf->backend = backend;
+
+	return 0;
+}
+
+/*
+ * Attach a buffer of exactly 'bytes' to the runtime, reusing the cached one
+ * when its size and backend are unchanged
+ */
+static int pcm_buffer_attach(struct snd_pcm_substream *substream,
+			     size_t bytes)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct snd_avirt_pcm_buffer *buf = pcm_buffer_get(substream);
+	unsigned int backend = pcm_buffer_backend(substream);
+	size_t size = PAGE_ALIGN(bytes);
+	int err;
+
+	if (buf->area && buf->bytes == size && buf->backend == backend) {
+		// Do not leak the previous user's audio
+		memset(buf->area, 0, size);
+	} else {
+		pcm_buffer_free(buf);
+		err = pcm_buffer_alloc(buf, size, backend);
+		if (err < 0)
+			return err;
+	}
+
+	buf->used = bytes;
+	runtime->dma_area = buf->area;
+	runtime->dma_bytes = bytes;
+
+	return 0;
+}
+
+void snd_avirt_pcm_buffer_release(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct snd_avirt_pcm_buffer *buf = pcm_buffer_get(substream);
+
+	if (!buf->used || runtime->dma_area != buf->area)
+		return;
+	buf->used = 0;
+	runtime->dma_area = NULL;
+	runtime->dma_bytes = 0;
+}
+EXPORT_SYMBOL_GPL(snd_avirt_pcm_buffer_release);
+
+int snd_avirt_pcm_buffers_alloc(struct snd_avirt_stream *stream)
+{
+	struct snd_pcm *pcm = stream->pcm;
+	unsigned int count = pcm->streams[SNDRV_PCM_STREAM_PLAYBACK]
+				     .substream_count +
+			     pcm->streams[SNDRV_PCM_STREAM_CAPTURE]
+				     .substream_count;
+
+	stream->buffers = kzalloc(sizeof(*stream->buffers) +
+					  count * sizeof(stream->buffers->buf[0]),
+				  GFP_KERNEL);
+	if (!stream->buffers)
+		return -ENOMEM;
+	stream->buffers->count = count;
+
+	return 0;
+}
+
+void snd_avirt_pcm_buffers_free(struct snd_avirt_stream *stream)
+{
+	unsigned int i;
+
+	if (!stream->buffers)
+		return;
+	for (i = 0; i < stream->buffers->count; i++)
+		pcm_buffer_free(&stream->buffers->buf[i]);
+	kfree(stream->buffers);
+	stream->buffers = NULL;
+}
+
+/*
+ * The capture end of a routed stream reads the destination channels of its
+ * routing matrix, every other end the stream channels
+ */
+static unsigned int stream_channels(struct snd_avirt_stream *stream,
+				    struct snd_pcm_substream *substream)
+{
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE &&
+	    stream->route.channels)
+		return stream->route.channels;
+	return stream->channels;
+}
+
 /*******************************************************************************
  * ALSA PCM Callbacks
  ******************************************************************************/
@@ -52,27 +219,43 @@ static int pcm_open(struct snd_pcm_substream *substream)
 	struct snd_avirt_stream *stream;
 	struct snd_pcm_hardware *hw;
 	unsigned int chans = 0;
+	int err;
 
-	stream = snd_avirt_stream_find_by_device(substream->pcm->device);
-	audiopath = snd_avirt_audiopath_get(stream->map);
+	// The stream and its Audio Path are bound to the PCM when sealed
+	stream = substream->pcm->private_data;
+	rcu_read_lock();
+	audiopath = rcu_dereference(stream->audiopath);
+	// Keep the Audio Path loaded for as long as the substream is open
+	if (audiopath && !try_module_get(audiopath->owner))
+		audiopath = NULL;
+	rcu_read_unlock();
 	CHK_NULL_V(audiopath, "Cannot find Audio Path uid: '%s'!", stream->map);
 	substream->private_data = audiopath;
+	trace_avirt_pcm_open(substream);
 
 	// Copy the hw params from the audiopath to the pcm
 	hw = &substream->runtime->hw;
 	memcpy(hw, audiopath->hw, sizeof(struct snd_pcm_hardware));
 
-	stream = snd_avirt_stream_find_by_device(substream->pcm->device);
-	if (IS_ERR_VALUE(stream) || !stream)
-		return PTR_ERR(stream);
-
-	// Setup remaining hw properties
-	chans = stream->channels;
+	// Setup remaining hw properties, within the Audio Path's own limits
+	chans = stream_channels(stream, substream);
+	if (hw->channels_max &&
+	    (chans < hw->channels_min || chans > hw->channels_max)) {
+		D_ERRORK("Audio Path %s supports %d to %d channels, not %d",
+			 audiopath->uid, hw->channels_min, hw->channels_max,
+			 chans);
+		module_put(audiopath->owner);
+		return -EINVAL;
+	}
 	hw->channels_min = chans;
 	hw->channels_max = chans;
 
 	// Do additional Audio Path 'open' callback
-	return DO_AUDIOPATH_CB(audiopath, open, substream);
+	err = DO_AUDIOPATH_CB(audiopath, open, substream);
+	if (err < 0)
+		module_put(audiopath->owner);
+
+	return err;
 }
 
 /**
@@ -85,10 +268,14 @@ static int pcm_open(struct snd_pcm_substream *substream)
  */
 static int pcm_close(struct snd_pcm_substream *substream)
 {
+	struct snd_avirt_audiopath *audiopath = substream->private_data;
+	int err;
+
 	// Do additional Audio Path 'close' callback
-	return DO_AUDIOPATH_CB(
-		((struct snd_avirt_audiopath *)substream->private_data), close,
-		substream);
+	err = DO_AUDIOPATH_CB(audiopath, close, substream);
+	module_put(audiopath->owner);
+
+	return err;
 }
 
 /**
@@ -98,6 +285,9 @@ static int pcm_close(struct snd_pcm_substream *substream)
  *
  * This is called when the hardware parameters are set, including buffer size,
  * the period size, the format, etc. The buffer allocation should be done here.
+ * An Audio Path may supply the buffer itself from its 'hw_params' callback, by
+ * setting runtime->dma_area and returning a positive value. It then owns that
+ * buffer, and releases it in its 'hw_free' callback.
  *
  * Returns 0 on success or error code otherwise.
  */
@@ -105,25 +295,26 @@ static int pcm_hw_params(struct snd_pcm_substream *substream,
 			 struct snd_pcm_hw_params *hw_params)
 {
 	int retval;
-	size_t bufsz;
 	struct snd_avirt_audiopath *audiopath;
-	struct snd_avirt_stream *stream;
-
-	stream = snd_avirt_stream_find_by_device(substream->pcm->device);
-	if (IS_ERR_VALUE(stream) || !stream)
-		return PTR_ERR(stream);
+	struct snd_avirt_stream *stream = substream->pcm->private_data;
 
-	if ((params_channels(hw_params) > stream->channels) ||
-	    (params_channels(hw_params) < stream->channels)) {
+	if (params_channels(hw_params) != stream_channels(stream, substream)) {
 		D_ERRORK("Requested number of channels: %d not supported",
 			 params_channels(hw_params));
 		return -EINVAL;
 	}
 
 	audiopath = ((struct snd_avirt_audiopath *)substream->private_data);
-	bufsz = params_buffer_bytes(hw_params) * audiopath->hw->periods_max;
+	trace_avirt_pcm_hw_params(substream, hw_params);
 
-	retval = snd_pcm_lib_alloc_vmalloc_buffer(substream, bufsz);
+	// Do additional Audio Path 'hw_params' callback
+	retval = DO_AUDIOPATH_CB(audiopath, hw_params, substream, hw_params);
+	if (retval < 0)
+		return retval;
+	if (retval > 0)
+		return 0;
+
+	retval = pcm_buffer_attach(substream, params_buffer_bytes(hw_params));
 	if (retval < 0)
 		D_ERRORK("pcm: buffer allocation failed: %d", retval);
 
@@ -148,7 +339,10 @@ static int pcm_hw_free(struct snd_pcm_substream *substream)
 		((struct snd_avirt_audiopath *)substream->private_data),
 		hw_free, substream);
 
-	return snd_pcm_lib_free_vmalloc_buffer(substream);
+	// The buffer itself is kept for the next 'hw_params'
+	snd_avirt_pcm_buffer_release(substream);
+
+	return err;
 }
 
 /**
@@ -163,6 +357,10 @@ static int pcm_hw_free(struct snd_pcm_substream *substream)
  */
 static int pcm_prepare(struct snd_pcm_substream *substream)
 {
+	// Preparing again is how applications recover from an xrun
+	if (substream->runtime->status->state == SNDRV_PCM_STATE_XRUN)
+		snd_avirt_stat_add(substream, SND_AVIRT_STAT_XRUNS, 1);
+
 	// Do additional Audio Path 'prepare' callback
 	return DO_AUDIOPATH_CB(
 		((struct snd_avirt_audiopath *)substream->private_data),
@@ -181,9 +379,13 @@ static int pcm_prepare(struct snd_pcm_substream *substream)
  */
 static int pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 {
+	trace_avirt_pcm_trigger(substream, cmd);
+
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
 	case SNDRV_PCM_TRIGGER_RESUME:
+		snd_avirt_stats_start(substream);
+		break;
 	case SNDRV_PCM_TRIGGER_STOP:
 	case SNDRV_PCM_TRIGGER_SUSPEND:
 		break;
@@ -210,10 +412,18 @@ static int pcm_trigger(struct snd_pcm_substream *substream, int cmd)
  */
 static snd_pcm_uframes_t pcm_pointer(struct snd_pcm_substream *substream)
 {
+	u64 start = local_clock();
+	snd_pcm_uframes_t pos;
+
 	// Do additional Audio Path 'pointer' callback
-	return DO_AUDIOPATH_CB(
+	pos = DO_AUDIOPATH_CB(
 		((struct snd_avirt_audiopath *)substream->private_data),
 		pointer, substream);
+	snd_avirt_stat_add(substream, SND_AVIRT_STAT_CPU_POINTER,
+			   local_clock() - start);
+	trace_avirt_pcm_pointer(substream, pos);
+
+	return pos;
 }
 
 /**
@@ -240,15 +450,24 @@ static int pcm_get_time_info(
 		audio_tstamp_config, audio_tstamp_report);
 }
 
+static void *pcm_dma_ptr(struct snd_pcm_runtime *runtime, int channel,
+			 unsigned long pos)
+{
+	return runtime->dma_area + pos +
+	       channel * (runtime->dma_bytes / runtime->channels);
+}
+
 /**
  * pcm_copy_user - Implements 'copy_user' callback for PCM middle layer
  * @substream: pointer to ALSA PCM substream
- * @channel:
- * @pos: The offset in the DMA
- * @src: Audio PCM data from the user space
- * @count:
+ * @channel: The channel, or 0 for interleaved access
+ * @pos: The offset in the DMA buffer, in bytes
+ * @src: Audio PCM data from/to the user space
+ * @count: The number of bytes to copy
  *
- * This is where we need to copy user audio PCM data into the sound driver
+ * This is where we need to copy user audio PCM data into the sound driver.
+ * Audio Paths without a 'copy_user' callback get the plain DMA buffer copy,
+ * the others account the CPU time of their copies themselves.
  *
  * Returns 0 on success or error code otherwise.
  *
@@ -257,27 +476,42 @@ static int pcm_copy_user(struct snd_pcm_substream *substream, int channel,
 			 snd_pcm_uframes_t pos, void __user *src,
 			 snd_pcm_uframes_t count)
 {
-	// struct snd_pcm_runtime *runtime;
-	// int offset;
+	struct snd_avirt_audiopath *audiopath = substream->private_data;
+	void *dma_ptr;
+	u64 ns = 0;
+	int err = 0;
 
-	// runtime = substream->runtime;
-	// offset = frames_to_bytes(runtime, pos);
+	trace_avirt_pcm_copy_user(substream, pos, count);
 
 	// Do additional Audio Path 'copy_user' callback
-	return DO_AUDIOPATH_CB(
-		((struct snd_avirt_audiopath *)substream->private_data),
-		copy_user, substream, channel, pos, src, count);
+	if (audiopath->pcm_ops->copy_user)
+		return audiopath->pcm_ops->copy_user(substream, channel, pos,
+						     src, count);
+
+	dma_ptr = pcm_dma_ptr(substream->runtime, channel, pos);
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		if (snd_avirt_copy_from_user(dma_ptr, src, count, &ns))
+			err = -EFAULT;
+	} else {
+		if (snd_avirt_copy_to_user(src, dma_ptr, count, &ns))
+			err = -EFAULT;
+	}
+
+	snd_avirt_stat_add(substream, SND_AVIRT_STAT_CPU_COPY, ns);
+	return err;
 }
 
 /**
  * pcm_copy_kernel - Implements 'copy_kernel' callback for PCM middle layer
  * @substream: pointer to ALSA PCM substream
- * @channel:
- * @pos: The offset in the DMA
- * @src: Audio PCM data from the user space
- * @count:
+ * @channel: The channel, or 0 for interleaved access
+ * @pos: The offset in the DMA buffer, in bytes
+ * @buf: Audio PCM data from/to the kernel space
+ * @count: The number of bytes to copy
  *
- * This is where we need to copy kernel audio PCM data into the sound driver
+ * This is where we need to copy kernel audio PCM data into the sound driver.
+ * Audio Paths without a 'copy_kernel' callback get the plain DMA buffer copy,
+ * the others account the CPU time of their copies themselves.
  *
  * Returns 0 on success or error code otherwise.
  *
@@ -285,9 +519,26 @@ static int pcm_copy_user(struct snd_pcm_substream *substream, int channel,
 static int pcm_copy_kernel(struct snd_pcm_substream *substream, int channel,
 			   unsigned long pos, void *buf, unsigned long count)
 {
-	return DO_AUDIOPATH_CB(
-		((struct snd_avirt_audiopath *)substream->private_data),
-		copy_kernel, substream, channel, pos, buf, count);
+	struct snd_avirt_audiopath *audiopath = substream->private_data;
+	u64 start;
+	void *dma_ptr;
+
+	trace_avirt_pcm_copy_kernel(substream, pos, count);
+
+	if (audiopath->pcm_ops->copy_kernel)
+		return audiopath->pcm_ops->copy_kernel(substream, channel, pos,
+						       buf, count);
+
+	start = local_clock();
+	dma_ptr = pcm_dma_ptr(substream->runtime, channel, pos);
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+		memcpy(dma_ptr, buf, count);
+	else
+		memcpy(buf, dma_ptr, count);
+
+	snd_avirt_stat_add(substream, SND_AVIRT_STAT_CPU_COPY,
+			   local_clock() - start);
+	return 0;
 }
 
 /**
@@ -301,6 +552,8 @@ static int pcm_copy_kernel(struct snd_pcm_substream *substream, int channel,
  */
 static int pcm_ack(struct snd_pcm_substream *substream)
 {
+	trace_avirt_pcm_ack(substream);
+
 	return DO_AUDIOPATH_CB(
 		((struct snd_avirt_audiopath *)substream->private_data), ack,
 		substream);
@@ -309,12 +562,85 @@ static int pcm_ack(struct snd_pcm_substream *substream)
 static int pcm_silence(struct snd_pcm_substream *substream, int channel,
 		       snd_pcm_uframes_t pos, snd_pcm_uframes_t count)
 {
-	return DO_AUDIOPATH_CB(
+	u64 start = local_clock();
+	int err;
+
+	err = DO_AUDIOPATH_CB(
 		((struct snd_avirt_audiopath *)substream->private_data),
 		fill_silence, substream, channel, pos, count);
+	snd_avirt_stat_add(substream, SND_AVIRT_STAT_CPU_SILENCE,
+			   local_clock() - start);
+
+	return err;
+}
+
+/**
+ * pcm_page - Implements 'page' callback for PCM middle layer
+ * @substream: pointer to ALSA PCM substream
+ * @offset: The offset in the DMA buffer, in bytes
+ *
+ * Returns the page backing the DMA buffer at the given offset, for buffers
+ * from either backend, or supplied by the Audio Path.
+ */
+static struct page *pcm_page(struct snd_pcm_substream *substream,
+			     unsigned long offset)
+{
+	void *addr = substream->runtime->dma_area + offset;
+
+	if (is_vmalloc_addr(addr))
+		return vmalloc_to_page(addr);
+	return virt_to_page(addr);
+}
+
+static void pcm_vm_open(struct vm_area_struct *area)
+{
+	struct snd_pcm_substream *substream = area->vm_private_data;
+
+	atomic_inc(&substream->mmap_count);
+}
+
+static void pcm_vm_close(struct vm_area_struct *area)
+{
+	struct snd_pcm_substream *substream = area->vm_private_data;
+
+	atomic_dec(&substream->mmap_count);
+}
+
+static const struct vm_operations_struct pcm_vm_ops = {
+	.open = pcm_vm_open,
+	.close = pcm_vm_close,
+};
+
+/**
+ * pcm_mmap - Implements 'mmap' callback for PCM middle layer
+ * @substream: pointer to ALSA PCM substream
+ * @area: The user space mapping of the DMA buffer
+ *
+ * Physically contiguous buffers are mapped in one go, rather than faulted in
+ * page by page as vmalloc buffers are.
+ *
+ * Returns 0 on success or error code otherwise.
+ */
+static int pcm_mmap(struct snd_pcm_substream *substream,
+		    struct vm_area_struct *area)
+{
+	void *addr = substream->runtime->dma_area;
+
+	if (is_vmalloc_addr(addr))
+		return snd_pcm_lib_default_mmap(substream, area);
+
+	area->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	area->vm_ops = &pcm_vm_ops;
+	area->vm_private_data = substream;
+
+	return remap_pfn_range(area, area->vm_start,
+			       (virt_to_phys(addr) >> PAGE_SHIFT) +
+				       area->vm_pgoff,
+			       area->vm_end - area->vm_start,
+			       area->vm_page_prot);
 }
 
-struct snd_pcm_ops pcm_ops = {
+const struct snd_pcm_ops pcm_ops = {
 	.open = pcm_open,
 	.close = pcm_close,
 	.ioctl = snd_pcm_lib_ioctl,
@@ -327,6 +653,43 @@ struct snd_pcm_ops pcm_ops = {
 	.fill_silence = pcm_silence,
 	.copy_user = pcm_copy_user,
 	.copy_kernel = pcm_copy_kernel,
-	.page = snd_pcm_lib_get_vmalloc_page,
+	.page = pcm_page,
+	.mmap = pcm_mmap,
 	.ack = pcm_ack,
 };
+
+/**
+ * snd_avirt_pcm_ops_build - Build the PCM op table of an Audio Path
+ * @ops: The op table to fill in
+ * @audiopath: The Audio Path the table is built for
+ *
+ * Starts from the AVIRT callbacks, and drops the optional callbacks the Audio
+ * Path does not implement, so that the PCM middle layer falls back to its own
+ * handling of them. Audio Paths with SND_AVIRT_AP_DIRECT_OPS set have their hot
+ * callbacks called directly, as there is nothing for AVIRT to add to those.
+ */
+void snd_avirt_pcm_ops_build(struct snd_pcm_ops *ops,
+			     const struct snd_avirt_audiopath *audiopath)
+{
+	const struct snd_pcm_ops *ap_ops = audiopath->pcm_ops;
+
+	*ops = pcm_ops;
+	if (!ap_ops->get_time_info)
+		ops->get_time_info = NULL;
+	if (!ap_ops->fill_silence)
+		ops->fill_silence = NULL;
+	if (!ap_ops->ack)
+		ops->ack = NULL;
+
+	if (!(audiopath->flags & SND_AVIRT_AP_DIRECT_OPS))
+		return;
+
+	if (ap_ops->pointer)
+		ops->pointer = ap_ops->pointer;
+	if (ap_ops->ack)
+		ops->ack = ap_ops->ack;
+	if (ap_ops->copy_user)
+		ops->copy_user = ap_ops->copy_user;
+	if (ap_ops->copy_kernel)
+		ops->copy_kernel = ap_ops->copy_kernel;
+}
@@ -0,0 +1,308 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * AVIRT - ALSA Virtual Soundcard
+ *
+ * Copyright (c) 2010-2018 Fiberdyne Systems Pty Ltd
+ *
+ * resample.c - AVIRT sample rate conversion
+ */
+
+#include <linux/slab.h>
+#include <linux/math64.h>
+
+#include "core.h"
+
+#define SRC_ONE (1ULL << 32)
+
+/*
+ * Blackman windowed sinc low-pass prototypes, 8 taps per phase, Q15.
+ * The cutoff is 0.45 / factor of the higher rate, every phase sums to
+ * 32768 / factor.
+ */
+static const s16 src_fir2[16] = {
+	0, 6, 146, 37, -1142, -1006, 5036, 13307,
+	13307, 5036, -1006, -1142, 37, 146, 6, 0,
+};
+
+static const s16 src_fir3[24] = {
+	0, -3, 15, 89, 141, -61, -633, -1085,
+	-318, 2431, 6410, 9398, 9398, 6410, 2431, -318,
+	-1085, -633, -61, 141, 89, 15, -3, 0,
+};
+
+static const s16 src_fir4[32] = {
+	0, -2, -1, 17, 62, 109, 85, -89,
+	-423, -758, -761, -64, 1497, 3681, 5841, 7190,
+	7190, 5841, 3681, 1497, -64, -761, -758, -423,
+	-89, 85, 109, 62, 17, -1, -2, 0,
+};
+
+static const s16 src_fir6[48] = {
+	0, -1, -2, -2, 4, 17, 38, 63,
+	78, 68, 14, -93, -246, -413, -536, -540,
+	-349, 92, 792, 1701, 2715, 3681, 4442, 4861,
+	4861, 4442, 3681, 2715, 1701, 792, 92, -349,
+	-540, -536, -413, -246, -93, 14, 68, 78,
+	63, 38, 17, 4, -2, -2, -1, 0,
+};
+
+enum src_kind {
+	SRC_LINEAR = 0,
+	SRC_DECIMATE,
+	SRC_INTERPOLATE,
+};
+
+/**
+ * struct snd_avirt_src - Sample rate converter state
+ * @channels: Interleaved channels per frame
+ * @kind: The conversion algorithm (enum src_kind)
+ * @factor: Integer rate ratio of the FIR paths
+ * @coef: FIR prototype, factor * 8 taps
+ * @hist_len: FIR history length, in frames
+ * @hpos: FIR history write position, in frames
+ * @phase: Decimation phase, in input frames
+ * @step: Linear input step per output frame, Q32
+ * @pos: Linear position between the two last input frames, Q32
+ * @state: Linear last two input frames, or FIR history (twice, so that the
+ *         latest hist_len frames are always contiguous)
+ */
+struct snd_avirt_src {
+	unsigned int channels;
+	unsigned int kind;
+	unsigned int factor;
+	const s16 *coef;
+	unsigned int hist_len;
+	unsigned int hpos;
+	unsigned int phase;
+	u64 step;
+	u64 pos;
+	s32 state[];
+};
+
+static const s16 *src_fir(unsigned int factor)
+{
+	switch (factor) {
+	case 2:
+		return src_fir2;
+	case 3:
+		return src_fir3;
+	case 4:
+		return src_fir4;
+	case 6:
+		return src_fir6;
+	default:
+		return NULL;
+	}
+}
+
+static inline s32 src_sat(s64 v)
+{
+	return clamp_t(s64, v, S32_MIN, S32_MAX);
+}
+
+/* Push an input frame into the FIR history, returns the latest frames */
+static inline const s32 *src_push(struct snd_avirt_src *src, const s32 *in)
+{
+	unsigned int ch = src->channels;
+
+	memcpy(src->state + src->hpos * ch, in, ch * sizeof(s32));
+	memcpy(src->state + (src->hpos + src->hist_len) * ch, in,
+	       ch * sizeof(s32));
+	src->hpos = (src->hpos + 1) % src->hist_len;
+
+	return src->state + src->hpos * ch;
+}
+
+static unsigned int src_decimate(struct snd_avirt_src *src, const s32 *in,
+				 unsigned int *in_frames, s32 *out,
+				 unsigned int out_frames)
+{
+	unsigned int ch = src->channels, taps = src->hist_len;
+	unsigned int i, c, k, produced = 0;
+	const s32 *win;
+	s64 acc;
+
+	for (i = 0; i < *in_frames; i++, in += ch) {
+		if (src->phase == src->factor - 1 && produced == out_frames)
+			break;
+		win = src_push(src, in);
+		if (++src->phase < src->factor)
+			continue;
+		src->phase = 0;
+		/* symmetric prototype, the window order does not matter */
+		for (c = 0; c < ch; c++) {
+			acc = 0;
+			for (k = 0; k < taps; k++)
+				acc += (s64)src->coef[k] * win[k * ch + c];
+			out[c] = src_sat(acc >> 15);
+		}
+		out += ch;
+		produced++;
+	}
+	*in_frames = i;
+
+	return produced;
+}
+
+static unsigned int src_interpolate(struct snd_avirt_src *src, const s32 *in,
+				    unsigned int *in_frames, s32 *out,
+				    unsigned int out_frames)
+{
+	unsigned int ch = src->channels, len = src->hist_len, l = src->factor;
+	unsigned int i, c, j, p, produced = 0;
+	const s32 *win;
+	s64 acc;
+
+	for (i = 0; i < *in_frames; i++, in += ch) {
+		if (out_frames - produced < l)
+			break;
+		win = src_push(src, in);
+		for (p = 0; p < l; p++) {
+			for (c = 0; c < ch; c++) {
+				acc = 0;
+				for (j = 0; j < len; j++)
+					acc += (s64)src->coef[p + j * l] *
+					       win[(len - 1 - j) * ch + c];
+				out[c] = src_sat((acc * l) >> 15);
+			}
+			out += ch;
+		}
+		produced += l;
+	}
+	*in_frames = i;
+
+	return produced;
+}
+
+static unsigned int src_linear(struct snd_avirt_src *src, const s32 *in,
+			       unsigned int *in_frames, s32 *out,
+			       unsigned int out_frames)
+{
+	unsigned int ch = src->channels, i = 0, c, produced = 0;
+	s32 *x0 = src->state, *x1 = src->state + ch;
+	s64 frac;
+
+	while (produced < out_frames) {
+		while (src->pos >= SRC_ONE) {
+			if (i == *in_frames)
+				goto out;
+			memcpy(x0, x1, ch * sizeof(s32));
+			memcpy(x1, in + i * ch, ch * sizeof(s32));
+			src->pos -= SRC_ONE;
+			i++;
+		}
+		frac = src->pos >> 16;
+		for (c = 0; c < ch; c++)
+			out[c] = x0[c] + ((((s64)x1[c] - x0[c]) * frac) >> 16);
+		out += ch;
+		produced++;
+		src->pos += src->step;
+	}
+out:
+	*in_frames = i;
+
+	return produced;
+}
+
+/**
+ * snd_avirt_src_create - Create a sample rate converter
+ * @mode: The conversion mode (enum snd_avirt_src_mode)
+ * @in_rate: The input rate
+ * @out_rate: The output rate
+ * @channels: The number of interleaved channels
+ * @return: The converter on success, or an error pointer otherwise
+ *
+ * The polyphase mode uses a FIR for integer ratios of 2, 3, 4 and 6 (eg.
+ * 48kHz <-> 16kHz/8kHz), and falls back to linear interpolation otherwise.
+ * May sleep.
+ */
+struct snd_avirt_src *snd_avirt_src_create(unsigned int mode,
+					   unsigned int in_rate,
+					   unsigned int out_rate,
+					   unsigned int channels)
+{
+	struct snd_avirt_src *src;
+	unsigned int kind = SRC_LINEAR, factor = 1, hist_len = 2;
+
+	if (mode == SND_AVIRT_SRC_NONE || !in_rate || !out_rate || !channels)
+		return ERR_PTR(-EINVAL);
+
+	if (mode == SND_AVIRT_SRC_POLYPHASE) {
+		if (!(in_rate % out_rate) && src_fir(in_rate / out_rate)) {
+			kind = SRC_DECIMATE;
+			factor = in_rate / out_rate;
+			hist_len = factor * 8;
+		} else if (!(out_rate % in_rate) &&
+			   src_fir(out_rate / in_rate)) {
+			kind = SRC_INTERPOLATE;
+			factor = out_rate / in_rate;
+			hist_len = 8;
+		}
+	}
+
+	src = kzalloc(sizeof(*src) + 2 * hist_len * channels * sizeof(s32),
+		      GFP_KERNEL);
+	if (!src)
+		return ERR_PTR(-ENOMEM);
+
+	src->channels = channels;
+	src->kind = kind;
+	src->factor = factor;
+	src->coef = src_fir(factor);
+	src->hist_len = hist_len;
+	src->step = div_u64((u64)in_rate << 32, out_rate);
+	snd_avirt_src_reset(src);
+
+	return src;
+}
+EXPORT_SYMBOL_GPL(snd_avirt_src_create);
+
+/**
+ * snd_avirt_src_free - Free a sample rate converter
+ * @src: The converter, may be NULL
+ */
+void snd_avirt_src_free(struct snd_avirt_src *src)
+{
+	kfree(src);
+}
+EXPORT_SYMBOL_GPL(snd_avirt_src_free);
+
+/**
+ * snd_avirt_src_reset - Drop the converter history
+ * @src: The converter
+ */
+void snd_avirt_src_reset(struct snd_avirt_src *src)
+{
+	memset(src->state, 0, 2 * src->hist_len * src->channels * sizeof(s32));
+	src->hpos = 0;
+	src->phase = 0;
+	src->pos = SRC_ONE;
+}
+EXPORT_SYMBOL_GPL(snd_avirt_src_reset);
+
+/**
+ * snd_avirt_src_process - Convert interleaved s32 frames
+ * @src: The converter
+ * @in: The input frames
+ * @in_frames: The number of input frames, set to the number consumed
+ * @out: The output frames
+ * @out_frames: The room in @out, in frames, at least the FIR ratio
+ * @return: The number of output frames produced
+ *
+ * Stops when either all input is consumed or the output is full. Safe to call
+ * from atomic context.
+ */
+unsigned int snd_avirt_src_process(struct snd_avirt_src *src, const s32 *in,
+				   unsigned int *in_frames, s32 *out,
+				   unsigned int out_frames)
+{
+	switch (src->kind) {
+	case SRC_DECIMATE:
+		return src_decimate(src, in, in_frames, out, out_frames);
+	case SRC_INTERPOLATE:
+		return src_interpolate(src, in, in_frames, out, out_frames);
+	default:
+		return src_linear(src, in, in_frames, out, out_frames);
+	}
+}
+EXPORT_SYMBOL_GPL(snd_avirt_src_process);
@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * AVIRT - ALSA Virtual Soundcard
+ *
+ * Copyright (c) 2010-2018 Fiberdyne Systems Pty Ltd
+ *
+ * route.c - AVIRT stream channel routing
+ */
+
+#include <linux/string.h>
+
+#include "core.h"
+
+/*
+ * Each destination channel is the sum of its routes, accumulated in 64 bits
+ * and saturated once, so that a downmix of full scale channels clips rather
+ * than wraps.
+ */
+void snd_avirt_route_apply(const struct snd_avirt_route *route, s32 *dst,
+			   const s32 *src, unsigned int frames,
+			   unsigned int src_channels)
+{
+	s64 acc[SND_AVIRT_ROUTE_CHANNELS_MAX];
+	const struct snd_avirt_route_entry *e, *end = route->map + route->count;
+	unsigned int f, c;
+
+	for (f = 0; f < frames; f++) {
+		memset(acc, 0, route->channels * sizeof(s64));
+		for (e = route->map; e < end; e++)
+			acc[e->dst] += (s64)src[e->src] * e->coef;
+		for (c = 0; c < route->channels; c++)
+			dst[c] = clamp_t(s64, acc[c] >> SND_AVIRT_GAIN_SHIFT,
+					 S32_MIN, S32_MAX);
+		src += src_channels;
+		dst += route->channels;
+	}
+}
+EXPORT_SYMBOL_GPL(snd_avirt_route_apply);
@@ -0,0 +1,466 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * AVIRT - ALSA Virtual Soundcard
+ *
+ * Copyright (c) 2010-2018 Fiberdyne Systems Pty Ltd
+ *
+ * avirt_latency.c - Round trip latency of loopback playback/capture pairs
+ *
+ * Plays silence on each playback device, with a full scale impulse at the
+ * start of a period every interval, and reads the paired capture device. The
+ * latency of an impulse runs from the write that queues it to the read that
+ * returns it, so it includes the playback queue and the capture period, as an
+ * application sees it. One summary row is printed per run: the latency
+ * percentiles over all pairs, the impulses lost, the xruns and the CPU load of
+ * the whole system.
+ *
+ * Build with: gcc -O2 -Wall -o avirt_latency avirt_latency.c -lasound
+ *
+ * Usage: avirt_latency [options] <playback> <capture> [<playback> <capture>...]
+ */
+
+#include <alsa/asoundlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PENDING 16
+#define IMPULSE 0x7fff
+#define IMPULSE_THRESHOLD 0x4000
+#define LOST_NS 1000000000ULL /* an impulse not back by then is lost */
+
+struct pair {
+	const char *play_name, *capt_name;
+	snd_pcm_t *play, *capt;
+	snd_pcm_uframes_t play_period, capt_period;
+	short *buf;
+	struct pollfd *play_fds, *capt_fds;
+	int play_nfds, capt_nfds;
+	unsigned long long periods; /* played since the last impulse */
+	/* write times of the impulses in flight, oldest first */
+	unsigned long long pending[MAX_PENDING];
+	unsigned int head, count;
+	unsigned int xruns, lost;
+};
+
+static unsigned int rate = 48000;
+static unsigned int channels = 2;
+static snd_pcm_uframes_t period = 256;
+static unsigned int periods = 4;
+static unsigned int fill = 2; /* periods queued for playback */
+static unsigned int seconds = 10;
+static unsigned int interval_ms = 100;
+
+static unsigned long long *latencies;
+static size_t nlatencies, maxlatencies;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what, const char *name, int err)
+{
+	fprintf(stderr, "%s %s: %s\n", what, name, snd_strerror(err));
+	exit(1);
+}
+
+/*
+ * Set up a PCM to wake its reader once a period is available, or its writer
+ * once less than @queued periods are queued
+ */
+static snd_pcm_uframes_t pcm_setup(snd_pcm_t *pcm, const char *name,
+				   unsigned int queued)
+{
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	snd_pcm_uframes_t p = period, buffer = period * periods, boundary;
+	int err;
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_sw_params_alloca(&sw);
+
+	if ((err = snd_pcm_hw_params_any(pcm, hw)) < 0 ||
+	    (err = snd_pcm_hw_params_set_access(
+		     pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0 ||
+	    (err = snd_pcm_hw_params_set_format(pcm, hw,
+						SND_PCM_FORMAT_S16_LE)) < 0 ||
+	    (err = snd_pcm_hw_params_set_channels(pcm, hw, channels)) < 0 ||
+	    (err = snd_pcm_hw_params_set_rate(pcm, hw, rate, 0)) < 0 ||
+	    (err = snd_pcm_hw_params_set_period_size_near(pcm, hw, &p,
+							  NULL)) < 0 ||
+	    (err = snd_pcm_hw_params_set_buffer_size_near(pcm, hw,
+							  &buffer)) < 0 ||
+	    (err = snd_pcm_hw_params(pcm, hw)) < 0 ||
+	    (err = snd_pcm_hw_params_get_buffer_size(hw, &buffer)) < 0)
+		die("hw_params", name, err);
+	if (p != period)
+		fprintf(stderr, "%s: period of %lu frames, not %lu\n", name,
+			p, period);
+
+	if ((err = snd_pcm_sw_params_current(pcm, sw)) < 0 ||
+	    (err = snd_pcm_sw_params_get_boundary(sw, &boundary)) < 0 ||
+	    (err = snd_pcm_sw_params_set_avail_min(
+		     pcm, sw, queued ? buffer - (queued - 1) * p : p)) < 0 ||
+	    /* the streams are started by hand */
+	    (err = snd_pcm_sw_params_set_start_threshold(pcm, sw,
+							 boundary)) < 0 ||
+	    (err = snd_pcm_sw_params(pcm, sw)) < 0)
+		die("sw_params", name, err);
+
+	return p;
+}
+
+/* Queue the playback up to the fill level, before it is started */
+static void play_prefill(struct pair *pair)
+{
+	unsigned int i;
+
+	memset(pair->buf, 0, pair->play_period * channels * sizeof(short));
+	for (i = 0; i < fill; i++)
+		snd_pcm_writei(pair->play, pair->buf, pair->play_period);
+}
+
+static void pair_open(struct pair *pair)
+{
+	int err;
+
+	err = snd_pcm_open(&pair->play, pair->play_name,
+			   SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+	if (err < 0)
+		die("open", pair->play_name, err);
+	err = snd_pcm_open(&pair->capt, pair->capt_name,
+			   SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK);
+	if (err < 0)
+		die("open", pair->capt_name, err);
+
+	pair->play_period = pcm_setup(pair->play, pair->play_name, fill);
+	pair->capt_period = pcm_setup(pair->capt, pair->capt_name, 0);
+	pair->buf = calloc(
+		(pair->play_period > pair->capt_period ? pair->play_period :
+							 pair->capt_period) *
+			channels,
+		sizeof(short));
+	if (!pair->buf) {
+		perror("calloc");
+		exit(1);
+	}
+
+	pair->play_nfds = snd_pcm_poll_descriptors_count(pair->play);
+	pair->capt_nfds = snd_pcm_poll_descriptors_count(pair->capt);
+}
+
+/*
+ * The ends are not linked, so that each recovers from its own xruns without
+ * stopping the other
+ */
+static void pair_start(struct pair *pair)
+{
+	int err;
+
+	if ((err = snd_pcm_prepare(pair->play)) < 0)
+		die("prepare", pair->play_name, err);
+	if ((err = snd_pcm_prepare(pair->capt)) < 0)
+		die("prepare", pair->capt_name, err);
+	play_prefill(pair);
+	if ((err = snd_pcm_start(pair->play)) < 0)
+		die("start", pair->play_name, err);
+	if ((err = snd_pcm_start(pair->capt)) < 0)
+		die("start", pair->capt_name, err);
+}
+
+/* The impulses in flight do not make it through an xrun */
+static void pair_xrun(struct pair *pair, snd_pcm_t *pcm)
+{
+	pair->xruns++;
+	pair->lost += pair->count;
+	pair->count = 0;
+
+	snd_pcm_prepare(pcm);
+	if (pcm == pair->play)
+		play_prefill(pair);
+	snd_pcm_start(pcm);
+}
+
+static void pair_play(struct pair *pair)
+{
+	unsigned long long t = now_ns();
+	unsigned long long every =
+		(unsigned long long)interval_ms * rate / 1000 / pair->play_period;
+	int impulse = 0;
+	snd_pcm_sframes_t n;
+	unsigned int c;
+
+	memset(pair->buf, 0, pair->play_period * channels * sizeof(short));
+	if (++pair->periods >= (every ? every : 1) &&
+	    pair->count < MAX_PENDING) {
+		for (c = 0; c < channels; c++)
+			pair->buf[c] = IMPULSE;
+		impulse = 1;
+	}
+
+	n = snd_pcm_writei(pair->play, pair->buf, pair->play_period);
+	if (n == -EPIPE) {
+		pair_xrun(pair, pair->play);
+		return;
+	}
+	if (n <= 0) {
+		/* nothing queued, try again on the next wake */
+		pair->periods--;
+		return;
+	}
+	if (impulse) {
+		pair->pending[(pair->head + pair->count++) % MAX_PENDING] = t;
+		pair->periods = 0;
+	}
+}
+
+static void latency_add(unsigned long long ns)
+{
+	if (nlatencies == maxlatencies) {
+		maxlatencies = maxlatencies ? 2 * maxlatencies : 4096;
+		latencies = realloc(latencies,
+				    maxlatencies * sizeof(*latencies));
+		if (!latencies) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	latencies[nlatencies++] = ns;
+}
+
+static void pair_capture(struct pair *pair)
+{
+	snd_pcm_sframes_t n, i;
+	unsigned long long t;
+
+	for (;;) {
+		n = snd_pcm_readi(pair->capt, pair->buf, pair->capt_period);
+		t = now_ns();
+		if (n == -EPIPE) {
+			pair_xrun(pair, pair->capt);
+			return;
+		}
+		if (n <= 0)
+			return;
+
+		for (i = 0; i < n; i++) {
+			if (pair->buf[i * channels] < IMPULSE_THRESHOLD)
+				continue;
+			if (!pair->count)
+				continue;
+			latency_add(t - pair->pending[pair->head]);
+			pair->head = (pair->head + 1) % MAX_PENDING;
+			pair->count--;
+		}
+
+		while (pair->count &&
+		       t - pair->pending[pair->head] > LOST_NS) {
+			pair->head = (pair->head + 1) % MAX_PENDING;
+			pair->count--;
+			pair->lost++;
+		}
+	}
+}
+
+/* user, system (with irq and softirq) and total jiffies of all CPUs */
+static void cpu_jiffies(unsigned long long *user, unsigned long long *sys,
+			unsigned long long *total)
+{
+	unsigned long long v[8] = { 0 };
+	FILE *f = fopen("/proc/stat", "r");
+	unsigned int i;
+
+	*user = *sys = *total = 0;
+	if (!f)
+		return;
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0],
+		   &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) == 8) {
+		*user = v[0] + v[1];
+		*sys = v[2] + v[5] + v[6];
+		for (i = 0; i < 8; i++)
+			*total += v[i];
+	}
+	fclose(f);
+}
+
+static int latency_cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile, in us */
+static double percentile(double p)
+{
+	size_t rank;
+
+	if (!nlatencies)
+		return 0;
+	rank = (size_t)(p * nlatencies + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	if (rank > nlatencies)
+		rank = nlatencies;
+	return latencies[rank - 1] / 1000.0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <playback> <capture> [<playback> <capture>...]\n"
+		"  -r rate        sample rate (%u)\n"
+		"  -c channels    channels, S16_LE samples (%u)\n"
+		"  -p frames      period size (%lu)\n"
+		"  -n periods     periods per buffer (%u)\n"
+		"  -f periods     periods queued for playback (%u)\n"
+		"  -d seconds     run time (%u)\n"
+		"  -i ms          interval between impulses (%u)\n"
+		"  -H             print the column header\n",
+		prog, rate, channels, period, periods, fill, seconds,
+		interval_ms);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long user0, sys0, total0, user1, sys1, total1, end;
+	unsigned int npairs, i, lost = 0, xruns = 0;
+	unsigned short revents;
+	struct pollfd *fds;
+	struct pair *pairs;
+	int header = 0, nfds = 0, opt;
+	double total;
+
+	while ((opt = getopt(argc, argv, "r:c:p:n:f:d:i:H")) != -1) {
+		switch (opt) {
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 'c':
+			channels = atoi(optarg);
+			break;
+		case 'p':
+			period = atoi(optarg);
+			break;
+		case 'n':
+			periods = atoi(optarg);
+			break;
+		case 'f':
+			fill = atoi(optarg);
+			break;
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 'i':
+			interval_ms = atoi(optarg);
+			break;
+		case 'H':
+			header = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc || (argc - optind) % 2 || !channels || !period ||
+	    !fill || fill > periods)
+		usage(argv[0]);
+
+	npairs = (argc - optind) / 2;
+	pairs = calloc(npairs, sizeof(*pairs));
+	if (!pairs) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < npairs; i++) {
+		pairs[i].play_name = argv[optind + 2 * i];
+		pairs[i].capt_name = argv[optind + 2 * i + 1];
+		pair_open(&pairs[i]);
+		nfds += pairs[i].play_nfds + pairs[i].capt_nfds;
+	}
+
+	fds = calloc(nfds, sizeof(*fds));
+	if (!fds) {
+		perror("calloc");
+		return 1;
+	}
+	for (nfds = 0, i = 0; i < npairs; i++) {
+		pairs[i].play_fds = fds + nfds;
+		nfds += snd_pcm_poll_descriptors(pairs[i].play, fds + nfds,
+						 pairs[i].play_nfds);
+		pairs[i].capt_fds = fds + nfds;
+		nfds += snd_pcm_poll_descriptors(pairs[i].capt, fds + nfds,
+						 pairs[i].capt_nfds);
+	}
+
+	for (i = 0; i < npairs; i++)
+		pair_start(&pairs[i]);
+
+	cpu_jiffies(&user0, &sys0, &total0);
+	end = now_ns() + seconds * 1000000000ULL;
+	while (now_ns() < end) {
+		if (poll(fds, nfds, 100) < 0 && errno != EINTR) {
+			perror("poll");
+			return 1;
+		}
+		for (i = 0; i < npairs; i++) {
+			struct pair *pair = &pairs[i];
+
+			snd_pcm_poll_descriptors_revents(pair->play,
+							 pair->play_fds,
+							 pair->play_nfds,
+							 &revents);
+			if (revents & POLLERR)
+				pair_xrun(pair, pair->play);
+			else if (revents & POLLOUT)
+				pair_play(pair);
+
+			snd_pcm_poll_descriptors_revents(pair->capt,
+							 pair->capt_fds,
+							 pair->capt_nfds,
+							 &revents);
+			if (revents & POLLERR)
+				pair_xrun(pair, pair->capt);
+			else if (revents & POLLIN)
+				pair_capture(pair);
+		}
+	}
+	cpu_jiffies(&user1, &sys1, &total1);
+
+	for (i = 0; i < npairs; i++) {
+		snd_pcm_drop(pairs[i].play);
+		snd_pcm_drop(pairs[i].capt);
+		lost += pairs[i].lost;
+		xruns += pairs[i].xruns;
+		snd_pcm_close(pairs[i].play);
+		snd_pcm_close(pairs[i].capt);
+		free(pairs[i].buf);
+	}
+
+	qsort(latencies, nlatencies, sizeof(*latencies), latency_cmp);
+	total = total1 > total0 ? total1 - total0 : 1;
+	if (header)
+		printf("%7s %6s %6s %8s %5s %5s %9s %9s %9s %9s %9s %6s %6s\n",
+		       "streams", "period", "rate", "impulses", "lost",
+		       "xruns", "p50_us", "p90_us", "p99_us", "p99.9_us",
+		       "max_us", "usr%", "sys%");
+	printf("%7u %6lu %6u %8zu %5u %5u %9.1f %9.1f %9.1f %9.1f %9.1f %6.2f %6.2f\n",
+	       npairs, period, rate, nlatencies, lost, xruns, percentile(0.5),
+	       percentile(0.9), percentile(0.99), percentile(0.999),
+	       percentile(1.0), 100.0 * (user1 - user0) / total,
+	       100.0 * (sys1 - sys0) / total);
+
+	free(fds);
+	free(pairs);
+	free(latencies);
+	return 0;
+}
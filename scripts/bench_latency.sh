@@ -0,0 +1,114 @@
+#!/bin/bash
+#
+# Measure the round trip latency, xruns and CPU load of loopback streams, on
+# AVIRT and on snd-aloop for comparison.
+#
+# For each stream count, AVIRT is reloaded with that many ap_loopback streams,
+# and snd-aloop with as many playback/capture substream pairs. Every pair then
+# runs for each period size, with impulses played every $INTERVAL ms; see
+# scripts/avirt_latency.c for how the latency is measured. One row is printed
+# per run:
+#   driver       - avirt or aloop
+#   streams      - playback/capture pairs running at once
+#   period       - frames per period, $PERIODS periods per buffer
+#   impulses     - impulses timed over all pairs
+#   lost         - impulses that did not make it back, e.g. across an xrun
+#   xruns        - over and underruns over all pairs
+#   p50_us...    - round trip latency percentiles, from the write of an
+#                  impulse to the read that returns it
+#   usr%, sys%   - CPU load of the whole system, over all CPUs
+#
+# Needs alsa-lib and its headers. Run from the repository root after building
+# the modules, as root, on a machine without other audio load, e.g. a local
+# VM. Large stream counts need a kernel with CONFIG_SND_DYNAMIC_MINORS=y.
+#
+# Usage: ./scripts/bench_latency.sh [avirt|aloop|both]
+
+DRIVERS=${1:-both}
+STREAMS=${STREAMS:-"1 4 8 16"}
+PERIOD_SIZES=${PERIOD_SIZES:-"64 128 256 512 1024"}
+PERIODS=${PERIODS:-4}      # periods per buffer
+FILL=${FILL:-2}            # periods queued for playback
+SECONDS_RUN=${SECONDS_RUN:-10}
+INTERVAL=${INTERVAL:-100}  # ms between impulses
+RATE=48000
+CHANNELS=2
+
+CFG=/config/snd-avirt/streams
+BIN=${BIN:-/tmp/avirt_latency}
+
+gcc -O2 -Wall -o $BIN scripts/avirt_latency.c -lasound || exit 1
+
+header=-H
+
+# Runs every period size over the "playback capture" device pairs given
+run_sweep() {
+	local driver=$1 period
+	shift
+
+	for period in $PERIOD_SIZES; do
+		$BIN $header -r $RATE -c $CHANNELS -p $period -n $PERIODS \
+		     -f $FILL -d $SECONDS_RUN -i $INTERVAL "$@" | \
+			awk -v driver=$driver '{ printf "%-6s %s\n",
+				/^ *streams/ ? "driver" : driver, $0 }'
+		header=
+	done
+}
+
+bench_avirt() {
+	local count=$1 card i pairs=()
+
+	./scripts/unload.sh >/dev/null 2>&1
+	insmod snd-avirt-core.ko || exit 1
+	insmod loopback/snd-avirt-ap-loopback.ko || exit 1
+
+	for i in $(seq 0 $((count - 1))); do
+		mkdir $CFG/playback_lat$i
+		echo "$CHANNELS">$CFG/playback_lat$i/channels
+		echo "ap_loopback">$CFG/playback_lat$i/map
+	done
+	echo "1">$CFG/sealed
+
+	card=$(grep -l "^avirt" /proc/asound/card*/id | head -1 | \
+	       sed 's|/proc/asound/card\([0-9]*\)/id|\1|')
+	# each stream is a device, playing into its own capture
+	for i in $(seq 0 $((count - 1))); do
+		pairs+=(hw:$card,$i hw:$card,$i)
+	done
+
+	run_sweep avirt "${pairs[@]}"
+	./scripts/unload.sh >/dev/null 2>&1
+}
+
+bench_aloop() {
+	local count=$1 cards i pairs=() enable ids
+
+	# up to 8 substream pairs per snd-aloop card
+	cards=$(((count + 7) / 8))
+	for i in $(seq 0 $((cards - 1))); do
+		enable=${enable:+$enable,}1
+		ids=${ids:+$ids,}aloop$i
+	done
+	rmmod snd-aloop 2>/dev/null
+	modprobe snd-aloop enable=$enable id=$ids pcm_substreams=8 || exit 1
+
+	# device 0 substream n plays into device 1 substream n
+	for i in $(seq 0 $((count - 1))); do
+		pairs+=(hw:aloop$((i / 8)),0,$((i % 8))
+			hw:aloop$((i / 8)),1,$((i % 8)))
+	done
+
+	run_sweep aloop "${pairs[@]}"
+	rmmod snd-aloop
+}
+
+mkdir -p /config && mountpoint -q /config || mount -t configfs none /config
+
+for count in $STREAMS; do
+	case $DRIVERS in
+	avirt|both) bench_avirt $count ;;
+	esac
+	case $DRIVERS in
+	aloop|both) bench_aloop $count ;;
+	esac
+done
@@ -0,0 +1,88 @@
+#!/bin/bash
+#
+# Measure how AVIRT scales with the number of configured streams.
+#
+# For each stream count, the modules are reloaded, that many loopback
+# playback streams are created and sealed, and the following is reported:
+#   seal_ms      - time taken to seal the streams (PCM + card registration)
+#   open_us      - mean open/hw_params/close latency of the last device
+#   period_us    - kernel CPU time spent per period, with $ACTIVE streams
+#                  running at once
+#
+# Run from the repository root after building the modules, as root.
+# Large stream counts need a kernel with CONFIG_SND_DYNAMIC_MINORS=y.
+#
+# Usage: ./scripts/bench_streams.sh [stream counts...]
+
+COUNTS=${*:-"8 16 32 64 128"}
+ACTIVE=${ACTIVE:-8}       # streams running during the CPU measurement
+SECONDS_RUN=${SECONDS_RUN:-5}
+PERIOD=${PERIOD:-256}     # frames per period
+RATE=48000
+OPENS=20
+
+CFG=/config/snd-avirt/streams
+
+now_ns() {
+	date +%s%N
+}
+
+# system + irq + softirq jiffies of all CPUs
+kernel_jiffies() {
+	awk '/^cpu / { print $4 + $7 + $8 }' /proc/stat
+}
+
+setup_streams() {
+	local count=$1 i
+
+	for i in $(seq 0 $((count - 1))); do
+		mkdir $CFG/playback_bench$i
+		echo "2">$CFG/playback_bench$i/channels
+		echo "ap_loopback">$CFG/playback_bench$i/map
+	done
+}
+
+mkdir -p /config && mountpoint -q /config || mount -t configfs none /config
+
+printf "%8s %10s %10s %10s\n" streams seal_ms open_us period_us
+
+for count in $COUNTS; do
+	./scripts/unload.sh >/dev/null 2>&1
+	insmod snd-avirt-core.ko || exit 1
+	insmod loopback/snd-avirt-ap-loopback.ko || exit 1
+
+	setup_streams $count
+
+	start=$(now_ns)
+	echo "1">$CFG/sealed
+	seal_ns=$(($(now_ns) - start))
+
+	card=$(grep -l "^avirt" /proc/asound/card*/id | head -1 | \
+	       sed 's|/proc/asound/card\([0-9]*\)/id|\1|')
+	last=$((count - 1))
+
+	start=$(now_ns)
+	for i in $(seq $OPENS); do
+		aplay -q -D hw:$card,$last -f S16_LE -c 2 -r $RATE \
+		      --period-size=$PERIOD /dev/null
+	done
+	open_ns=$((($(now_ns) - start) / OPENS))
+
+	active=$((ACTIVE < count ? ACTIVE : count))
+	before=$(kernel_jiffies)
+	for i in $(seq 0 $((active - 1))); do
+		aplay -q -D hw:$card,$i -f S16_LE -c 2 -r $RATE \
+		      --period-size=$PERIOD -d $SECONDS_RUN /dev/zero &
+	done
+	wait
+	jiffies=$(($(kernel_jiffies) - before))
+	periods=$((active * SECONDS_RUN * RATE / PERIOD))
+	period_ns=$((jiffies * 1000000000 / $(getconf CLK_TCK) / periods))
+
+	printf "%8d %10d.%02d %10d %10d.%03d\n" $count \
+	       $((seal_ns / 1000000)) $((seal_ns / 10000 % 100)) \
+	       $((open_ns / 1000)) \
+	       $((period_ns / 1000)) $((period_ns % 1000))
+done
+
+./scripts/unload.sh >/dev/null 2>&1
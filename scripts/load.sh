@@ -6,6 +6,7 @@ insmod snd-avirt-core.ko
 # Load the additional Audio Paths
 insmod dummy/snd-avirt-ap-dummy.ko
 insmod loopback/snd-avirt-ap-loopback.ko
+insmod mixer/snd-avirt-ap-mixer.ko
 
 # Run the test script
 ./scripts/test_configfs.sh
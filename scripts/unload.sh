@@ -7,6 +7,7 @@ rm_module() {
         lsmod |grep "^$1\>" && rmmod $1 || true
 }
 
+rm_module snd_avirt_ap_mixer
 rm_module snd_avirt_ap_loopback
 rm_module snd_avirt_ap_dummy
 rm_module snd_avirt_core
@@ -13,8 +13,10 @@
 #include <sound/core.h>
 #include <sound/pcm.h>
 #include <linux/configfs.h>
+#include <linux/sched/clock.h>
+#include <linux/uaccess.h>
 
-#define MAX_STREAMS 16
+#define MAX_READERS 8
 #define MAX_NAME_LEN 80
 
 #define DINFO(logname, fmt, args...) \
@@ -26,6 +28,36 @@
 #define DDEBUG(logname, fmt, args...) \
 	snd_printk(KERN_DEBUG "AVIRT: %s: " fmt "\n", logname, ##args)
 
+/**
+ * AVIRT stream clock source
+ * Selects the timer used by an Audio Path to drive a stream's periods
+ */
+enum snd_avirt_clock {
+	SND_AVIRT_CLOCK_SYSTIMER = 0, /* jiffies based system timer */
+	SND_AVIRT_CLOCK_HRTIMER, /* High resolution timer */
+	SND_AVIRT_CLOCK_SHARED, /* Core shared master clock */
+};
+
+/**
+ * AVIRT PCM buffer backend
+ * Selects how the core allocates the PCM buffers of a stream
+ */
+enum snd_avirt_buffer {
+	SND_AVIRT_BUFFER_DEFAULT = 0, /* As set by the Audio Path, else vmalloc */
+	SND_AVIRT_BUFFER_VMALLOC, /* Virtually contiguous pages */
+	SND_AVIRT_BUFFER_CONTIG, /* Physically contiguous pages */
+};
+
+/**
+ * AVIRT stream sample rate converter
+ * Selects how an Audio Path converts between the rates of connected streams
+ */
+enum snd_avirt_src_mode {
+	SND_AVIRT_SRC_NONE = 0, /* Rates must match */
+	SND_AVIRT_SRC_LINEAR, /* Linear interpolation */
+	SND_AVIRT_SRC_POLYPHASE, /* Polyphase FIR for integer ratios */
+};
+
 /**
  * AVIRT Audio Path configure function type
  * Each Audio Path registers this at snd_avirt_audiopath_register time.
@@ -35,6 +67,17 @@ typedef int (*snd_avirt_audiopath_configure)(struct snd_card *card,
 					     struct config_group *stream_group,
 					     unsigned int stream_count);
 
+/*
+ * Audio Path flags
+ * DIRECT_OPS: the PCM core calls the Audio Path 'pointer', 'ack' and 'copy_*'
+ * callbacks directly, rather than through the AVIRT PCM callbacks. They fire
+ * the matching avirt_pcm_* tracepoints from those callbacks themselves, and
+ * account their CPU time with snd_avirt_cpu_enter()/snd_avirt_cpu_exit().
+ * Any Audio Path with its own 'copy_*' callbacks accounts the copies, see
+ * snd_avirt_copy_from_user().
+ */
+#define SND_AVIRT_AP_DIRECT_OPS (1 << 0)
+
 /**
  * AVIRT Audio Path info
  */
@@ -45,10 +88,37 @@ struct snd_avirt_audiopath {
 	const struct snd_pcm_hardware *hw; /* ALSA PCM HW conf */
 	const struct snd_pcm_ops *pcm_ops; /* ALSA PCM op table */
 	snd_avirt_audiopath_configure configure; /* Config callback function */
+	unsigned int flags; /* SND_AVIRT_AP_* flags */
+	unsigned int buffer; /* Default buffer backend (enum snd_avirt_buffer) */
+	struct module *owner; /* Module pinned while a substream is open */
 
 	void *context;
 };
 
+/* Channel routes of a stream */
+#define SND_AVIRT_ROUTES_MAX 64
+#define SND_AVIRT_ROUTE_CHANNELS_MAX 32
+
+/*
+ * Stream channel route
+ * Adds a source channel, scaled by a Q16 coefficient, to a destination channel
+ */
+struct snd_avirt_route_entry {
+	unsigned int src; /* Source channel */
+	unsigned int dst; /* Destination channel */
+	int coef; /* Coefficient, Q16 from -unity to unity */
+};
+
+/*
+ * Stream channel routing matrix
+ * Maps the channels played to a stream to the channels captured from it
+ */
+struct snd_avirt_route {
+	unsigned int channels; /* Destination channel count, 0 if unrouted */
+	unsigned int count; /* Number of routes */
+	struct snd_avirt_route_entry map[SND_AVIRT_ROUTES_MAX];
+};
+
 /*
  * Audio stream configuration
  */
@@ -58,10 +128,59 @@ struct snd_avirt_stream {
 	unsigned int channels; /* Stream channel count */
 	unsigned int device; /* Stream PCM device no. */
 	unsigned int direction; /* Stream direction */
+	unsigned int clock; /* Stream clock source (enum snd_avirt_clock) */
+	unsigned int src; /* Stream rate converter (enum snd_avirt_src_mode) */
+	unsigned int readers; /* Loopback capture substream count */
+	unsigned int gain; /* Stream default gain, Q16 */
+	unsigned int buffer; /* Stream buffer backend (enum snd_avirt_buffer) */
+	struct snd_avirt_route route; /* Stream channel routing */
 	struct snd_pcm *pcm; /* ALSA PCM  */
+	struct snd_avirt_audiopath __rcu *audiopath; /* Mapped Audio Path */
+	struct snd_avirt_pcm_buffers *buffers; /* PCM buffer cache */
+	struct snd_avirt_stats *stats; /* Runtime statistics */
 	struct config_item item; /* configfs item reference */
 };
 
+/**
+ * AVIRT stream statistics
+ * Counted by the core, or reported by the Audio Paths with snd_avirt_stat_add()
+ */
+enum snd_avirt_stat {
+	SND_AVIRT_STAT_PERIODS = 0, /* Periods elapsed */
+	SND_AVIRT_STAT_XRUNS, /* Over and underruns */
+	SND_AVIRT_STAT_BYTES, /* Bytes moved between buffers */
+	SND_AVIRT_STAT_SILENCE, /* Silence bytes filled in */
+	SND_AVIRT_STAT_DRIFT, /* Clock drift corrections */
+	/* CPU time spent on the stream, in ns. Keep these last. */
+	SND_AVIRT_STAT_CPU_TIMER, /* Timer callbacks, besides the below */
+	SND_AVIRT_STAT_CPU_COPY, /* Copies between buffers */
+	SND_AVIRT_STAT_CPU_SILENCE, /* Silence fill */
+	SND_AVIRT_STAT_CPU_POINTER, /* Pointer queries, besides the above */
+	SND_AVIRT_STAT_COUNT,
+};
+
+#define SND_AVIRT_STAT_CPU_COUNT                                               \
+	(SND_AVIRT_STAT_COUNT - SND_AVIRT_STAT_CPU_TIMER)
+
+/**
+ * AVIRT CPU time accounting of a code section
+ * Sections may nest, as a copy does within a timer callback. The sections run
+ * under the same lock share a nested time counter, so that each of them is
+ * charged the time spent outside the sections nested in it only.
+ */
+struct snd_avirt_cpu {
+	u64 start; /* local_clock() at the start of the section */
+	u64 nested; /* nested time counter at the start of the section */
+};
+
+/* Period lateness histogram, in power of two microsecond buckets */
+#define SND_AVIRT_LATENESS_BUCKETS 16
+
+struct snd_avirt_stats {
+	atomic64_t count[SND_AVIRT_STAT_COUNT];
+	atomic64_t lateness[SND_AVIRT_LATENESS_BUCKETS];
+};
+
 /**
  * AVIRT core info
  */
@@ -89,6 +208,9 @@ int snd_avirt_audiopath_deregister(struct snd_avirt_audiopath *audiopath);
  * snd_avirt_audiopath_get - retrieves the Audio Path by it's UID
  * @uid: Unique ID for the Audio Path
  * @return: Corresponding Audio Path
+ *
+ * Call under rcu_read_lock(), and pin the Audio Path owner module before
+ * leaving the read side critical section to keep using the Audio Path.
  */
 struct snd_avirt_audiopath *snd_avirt_audiopath_get(const char *uid);
 
@@ -110,6 +232,177 @@ static inline struct snd_avirt_stream *
 	return item ? container_of(item, struct snd_avirt_stream, item) : NULL;
 }
 
+struct snd_avirt_clock_class;
+
+/**
+ * AVIRT shared clock client
+ * Embedded by an Audio Path in its substream data to be driven by the core's
+ * shared master clock, rather than arming a timer of its own. All clients with
+ * the same period time share a single timer, and are ticked in one batch.
+ */
+struct snd_avirt_clock_client {
+	/* Called for each tick, returns true if a period boundary was crossed */
+	bool (*tick)(struct snd_avirt_clock_client *client);
+	struct snd_pcm_substream *substream; /* Substream to notify */
+
+	/* Private, managed by the core */
+	struct snd_avirt_clock_class *clock;
+	struct list_head list;
+	struct list_head due;
+};
+
+/**
+ * snd_avirt_clock_attach - Attach a client to the clock of its period class
+ * @client: The client to attach
+ * @period_ns: The client's period time, in nanoseconds
+ * @return: 0 on success, negative ERRNO on failure
+ */
+int snd_avirt_clock_attach(struct snd_avirt_clock_client *client,
+			   u64 period_ns);
+
+/**
+ * snd_avirt_clock_detach - Detach a client from its clock
+ * @client: The client to detach
+ */
+void snd_avirt_clock_detach(struct snd_avirt_clock_client *client);
+
+/**
+ * snd_avirt_clock_start - Start delivering ticks to a client
+ * @client: The attached client to start
+ * @return: The time origin of the client's first period, in ktime nanoseconds
+ */
+u64 snd_avirt_clock_start(struct snd_avirt_clock_client *client);
+
+/**
+ * snd_avirt_clock_stop - Stop delivering ticks to a client
+ * @client: The client to stop
+ */
+void snd_avirt_clock_stop(struct snd_avirt_clock_client *client);
+
+/**
+ * AVIRT sample format conversion
+ * Converts @samples samples from one format to another, in a single pass
+ */
+typedef void (*snd_avirt_convert_t)(void *dst, const void *src,
+				    unsigned int samples);
+
+/* Sample formats supported by snd_avirt_convert_get() */
+#define SND_AVIRT_CONVERT_FORMATS                                         \
+	(SNDRV_PCM_FMTBIT_S16_LE | SNDRV_PCM_FMTBIT_S16_BE |              \
+	 SNDRV_PCM_FMTBIT_S24_LE | SNDRV_PCM_FMTBIT_S24_BE |              \
+	 SNDRV_PCM_FMTBIT_S24_3LE | SNDRV_PCM_FMTBIT_S24_3BE |            \
+	 SNDRV_PCM_FMTBIT_S32_LE | SNDRV_PCM_FMTBIT_S32_BE |              \
+	 SNDRV_PCM_FMTBIT_FLOAT_LE | SNDRV_PCM_FMTBIT_FLOAT_BE)
+
+/**
+ * snd_avirt_convert_get - Get the conversion function for a format pair
+ * @src: The source sample format
+ * @dst: The destination sample format
+ * @return: The conversion function, or NULL if either format is unsupported
+ */
+snd_avirt_convert_t snd_avirt_convert_get(snd_pcm_format_t src,
+					  snd_pcm_format_t dst);
+
+struct snd_avirt_src;
+
+/**
+ * snd_avirt_src_create - Create a sample rate converter
+ * @mode: The conversion mode (enum snd_avirt_src_mode)
+ * @in_rate: The input rate
+ * @out_rate: The output rate
+ * @channels: The number of interleaved channels
+ * @return: The converter on success, or an error pointer otherwise
+ */
+struct snd_avirt_src *snd_avirt_src_create(unsigned int mode,
+					   unsigned int in_rate,
+					   unsigned int out_rate,
+					   unsigned int channels);
+
+/**
+ * snd_avirt_src_free - Free a sample rate converter
+ * @src: The converter, may be NULL
+ */
+void snd_avirt_src_free(struct snd_avirt_src *src);
+
+/**
+ * snd_avirt_src_reset - Drop the converter history
+ * @src: The converter
+ */
+void snd_avirt_src_reset(struct snd_avirt_src *src);
+
+/**
+ * snd_avirt_src_process - Convert interleaved s32 frames
+ * @src: The converter
+ * @in: The input frames
+ * @in_frames: The number of input frames, set to the number consumed
+ * @out: The output frames
+ * @out_frames: The room in @out, in frames
+ * @return: The number of output frames produced
+ */
+unsigned int snd_avirt_src_process(struct snd_avirt_src *src, const s32 *in,
+				   unsigned int *in_frames, s32 *out,
+				   unsigned int out_frames);
+
+/* Stream gain, Q16 fixed point from 0 (muted) to unity */
+#define SND_AVIRT_GAIN_SHIFT 16
+#define SND_AVIRT_GAIN_UNITY (1 << SND_AVIRT_GAIN_SHIFT)
+
+/**
+ * AVIRT stream gain state
+ * Moves linearly to a new target gain, so that changes do not click
+ */
+struct snd_avirt_gain {
+	s64 cur; /* current gain, with SND_AVIRT_GAIN_SHIFT extra fraction bits */
+	s64 step; /* per frame ramp step */
+	unsigned int target; /* gain being ramped to */
+	unsigned int left; /* frames left in the ramp */
+};
+
+/**
+ * snd_avirt_gain_reset - Set the gain at once, without a ramp
+ * @gain: The gain state
+ * @value: The gain, Q16
+ */
+void snd_avirt_gain_reset(struct snd_avirt_gain *gain, unsigned int value);
+
+/**
+ * snd_avirt_gain_is_unity - Check if the gain leaves samples untouched
+ * @gain: The gain state
+ * @target: The gain that will be applied next
+ * @return: true if snd_avirt_gain_apply() would be a no-op
+ */
+static inline bool snd_avirt_gain_is_unity(const struct snd_avirt_gain *gain,
+					   unsigned int target)
+{
+	return target == SND_AVIRT_GAIN_UNITY &&
+	       gain->target == SND_AVIRT_GAIN_UNITY && !gain->left;
+}
+
+/**
+ * snd_avirt_gain_apply - Scale interleaved s32 frames
+ * @gain: The gain state
+ * @target: The gain to apply, a change starts a new ramp
+ * @ramp: The length of a new ramp, in frames (eg. a period)
+ * @buf: The frames, scaled in place
+ * @frames: The number of frames
+ * @channels: The number of interleaved channels
+ */
+void snd_avirt_gain_apply(struct snd_avirt_gain *gain, unsigned int target,
+			  unsigned int ramp, s32 *buf, unsigned int frames,
+			  unsigned int channels);
+
+/**
+ * snd_avirt_route_apply - Route interleaved s32 frames
+ * @route: The routing matrix
+ * @dst: The routed frames, of @route->channels channels
+ * @src: The source frames
+ * @frames: The number of frames
+ * @src_channels: The number of source channels
+ */
+void snd_avirt_route_apply(const struct snd_avirt_route *route, s32 *dst,
+			   const s32 *src, unsigned int frames,
+			   unsigned int src_channels);
+
 /**
  * snd_avirt_pcm_period_elapsed - PCM buffer complete callback
  * @substream: pointer to ALSA PCM substream
@@ -119,4 +412,114 @@ static inline struct snd_avirt_stream *
  */
 void snd_avirt_pcm_period_elapsed(struct snd_pcm_substream *substream);
 
+/**
+ * snd_avirt_stat_add - Add to a statistic of the stream of a substream
+ * @substream: pointer to ALSA PCM substream
+ * @stat: The statistic (enum snd_avirt_stat)
+ * @value: The amount to add
+ *
+ * Lock free, and safe to call from any context
+ */
+static inline void snd_avirt_stat_add(struct snd_pcm_substream *substream,
+				      unsigned int stat, u64 value)
+{
+	struct snd_avirt_stream *stream = substream->pcm->private_data;
+
+	atomic64_add(value, &stream->stats->count[stat]);
+}
+
+/**
+ * snd_avirt_cpu_enter - Start a CPU time accounting section
+ * @cpu: The section
+ * @nested: The nested time counter of the section
+ */
+static inline void snd_avirt_cpu_enter(struct snd_avirt_cpu *cpu,
+				       const u64 *nested)
+{
+	cpu->nested = *nested;
+	cpu->start = local_clock();
+}
+
+/**
+ * snd_avirt_cpu_exit - End a CPU time accounting section
+ * @cpu: The section, started with snd_avirt_cpu_enter()
+ * @nested: The nested time counter of the section
+ *
+ * Returns the time spent in the section outside its nested sections, in ns,
+ * for the caller to add to one of the SND_AVIRT_STAT_CPU_* statistics.
+ */
+static inline u64 snd_avirt_cpu_exit(struct snd_avirt_cpu *cpu, u64 *nested)
+{
+	u64 elapsed = local_clock() - cpu->start;
+	u64 own = elapsed - (*nested - cpu->nested);
+
+	*nested = cpu->nested + elapsed;
+	return own;
+}
+
+/**
+ * snd_avirt_copy_from_user - copy_from_user(), timing the copy
+ * @to: Destination address, in kernel space
+ * @from: Source address, in user space
+ * @n: Number of bytes to copy
+ * @ns: Incremented by the time of the copy, in ns
+ *
+ * The copy is first made with page faults disabled, and only that is timed.
+ * What it leaves is copied after, serving the faults, which may sleep. So
+ * @ns is the CPU time of the copy, not the wall time of the faults.
+ *
+ * Returns the number of bytes that could not be copied.
+ */
+static inline unsigned long snd_avirt_copy_from_user(void *to,
+						     const void __user *from,
+						     unsigned long n, u64 *ns)
+{
+	u64 start = local_clock();
+	unsigned long left;
+
+	pagefault_disable();
+	left = copy_from_user(to, from, n);
+	pagefault_enable();
+	*ns += local_clock() - start;
+	if (left)
+		left = copy_from_user(to + n - left, from + n - left, left);
+	return left;
+}
+
+/**
+ * snd_avirt_copy_to_user - copy_to_user(), timing the copy
+ * @to: Destination address, in user space
+ * @from: Source address, in kernel space
+ * @n: Number of bytes to copy
+ * @ns: Incremented by the time of the copy, in ns
+ *
+ * See snd_avirt_copy_from_user().
+ *
+ * Returns the number of bytes that could not be copied.
+ */
+static inline unsigned long snd_avirt_copy_to_user(void __user *to,
+						   const void *from,
+						   unsigned long n, u64 *ns)
+{
+	u64 start = local_clock();
+	unsigned long left;
+
+	pagefault_disable();
+	left = copy_to_user(to, from, n);
+	pagefault_enable();
+	*ns += local_clock() - start;
+	if (left)
+		left = copy_to_user(to + n - left, from + n - left, left);
+	return left;
+}
+
+/**
+ * snd_avirt_pcm_buffer_release - Detach the AVIRT PCM buffer from a substream
+ * @substream: pointer to ALSA PCM substream
+ *
+ * For Audio Paths replacing the buffer AVIRT allocated for the substream with
+ * their own. The buffer stays cached for the next 'hw_params'.
+ */
+void snd_avirt_pcm_buffer_release(struct snd_pcm_substream *substream);
+
 #endif // __SOUND_AVIRT_H
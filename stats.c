@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * AVIRT - ALSA Virtual Soundcard
+ *
+ * Copyright (c) 2010-2018 Fiberdyne Systems Pty Ltd
+ *
+ * stats.c - AVIRT per stream runtime statistics
+ */
+
+#include <linux/kobject.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+
+#include "core.h"
+
+#define D_LOGNAME "stats"
+
+#define D_INFOK(fmt, args...) DINFO(D_LOGNAME, fmt, ##args)
+#define D_PRINTK(fmt, args...) DDEBUG(D_LOGNAME, fmt, ##args)
+#define D_ERRORK(fmt, args...) DERROR(D_LOGNAME, fmt, ##args)
+
+/*
+ * The counters are updated from the Audio Path timer and worker contexts with
+ * plain atomics, and read through sysfs without any locking. The period timing
+ * of a substream is written from its trigger and period elapsed callbacks only;
+ * a period reported while the substream restarts skews a single sample at most.
+ */
+
+/**
+ * struct snd_avirt_stats_timing - period timing of a substream
+ * @start_hw: hw_ptr when the substream was started
+ * @periods: periods reported since the start
+ */
+struct snd_avirt_stats_timing {
+	snd_pcm_uframes_t start_hw;
+	u64 periods;
+};
+
+/**
+ * struct snd_avirt_stats_obj - statistics of a stream
+ * @kobj: the stream directory under avirtcore/streams
+ * @stats: the counters, referenced by the stream
+ * @reset_ns: time the counters were last reset
+ * @timing: the period timing of each substream
+ */
+struct snd_avirt_stats_obj {
+	struct kobject kobj;
+	struct snd_avirt_stats stats;
+	u64 reset_ns;
+	struct snd_avirt_stats_timing timing[];
+};
+
+#define to_stats_obj(k) container_of(k, struct snd_avirt_stats_obj, kobj)
+
+static struct kset *snd_avirt_stats_kset;
+
+static struct snd_avirt_stats_timing *
+stats_timing_get(struct snd_pcm_substream *substream)
+{
+	struct snd_avirt_stream *stream = substream->pcm->private_data;
+	struct snd_avirt_stats_obj *obj =
+		container_of(stream->stats, struct snd_avirt_stats_obj, stats);
+
+	return &obj->timing[snd_avirt_substream_index(substream)];
+}
+
+void snd_avirt_stats_start(struct snd_pcm_substream *substream)
+{
+	struct snd_avirt_stats_timing *timing = stats_timing_get(substream);
+
+	timing->start_hw = substream->runtime->status->hw_ptr;
+	timing->periods = 0;
+}
+
+/*
+ * The lateness of a report is how far the position has moved past the first
+ * period boundary not reported yet, converted to time at the nominal rate.
+ * One report may cover several periods, and the position may run off the
+ * nominal rate, so the boundaries are counted from the position, rather than
+ * from the reports or the time since the start. A report that crosses no new
+ * boundary is on time. Call once the PCM core has updated the position.
+ *
+ * Bucket 0 holds the periods reported on time, bucket n > 0 those reported
+ * 2^(n-1) to 2^n - 1 microseconds late, and the last bucket anything later
+ */
+void snd_avirt_stats_period(struct snd_pcm_substream *substream)
+{
+	struct snd_avirt_stream *stream = substream->pcm->private_data;
+	struct snd_avirt_stats_timing *timing = stats_timing_get(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	snd_pcm_sframes_t frames;
+	unsigned int bucket = 0;
+	u64 periods, late;
+
+	atomic64_inc(&stream->stats->count[SND_AVIRT_STAT_PERIODS]);
+
+	if (!runtime->period_size || !runtime->rate)
+		return;
+	frames = READ_ONCE(runtime->status->hw_ptr) - timing->start_hw;
+	if (frames < 0)
+		frames += runtime->boundary;
+	periods = div_u64(frames, runtime->period_size);
+	if (periods > timing->periods) {
+		late = frames - (timing->periods + 1) * runtime->period_size;
+		/* anything over a second goes to the last bucket anyway */
+		late = min_t(u64, late, runtime->rate);
+		late = div_u64(late * USEC_PER_SEC, runtime->rate);
+		bucket = min_t(unsigned int, fls64(late),
+			       SND_AVIRT_LATENESS_BUCKETS - 1);
+		timing->periods = periods;
+	}
+	atomic64_inc(&stream->stats->lateness[bucket]);
+}
+
+static ssize_t stats_show_count(struct kobject *kobj, char *buf,
+				unsigned int stat)
+{
+	struct snd_avirt_stats_obj *obj = to_stats_obj(kobj);
+
+	return sprintf(buf, "%lld\n",
+		       (long long)atomic64_read(&obj->stats.count[stat]));
+}
+
+#define STATS_ATTR_COUNT(_name, _stat)                                        \
+	static ssize_t _name##_show(struct kobject *kobj,                      \
+				    struct kobj_attribute *attr, char *buf)    \
+	{                                                                      \
+		return stats_show_count(kobj, buf, _stat);                     \
+	}                                                                      \
+	static struct kobj_attribute stats_attr_##_name = __ATTR_RO(_name)
+
+STATS_ATTR_COUNT(periods, SND_AVIRT_STAT_PERIODS);
+STATS_ATTR_COUNT(xruns, SND_AVIRT_STAT_XRUNS);
+STATS_ATTR_COUNT(bytes, SND_AVIRT_STAT_BYTES);
+STATS_ATTR_COUNT(silence_bytes, SND_AVIRT_STAT_SILENCE);
+STATS_ATTR_COUNT(drift_corrections, SND_AVIRT_STAT_DRIFT);
+
+static ssize_t lateness_show(struct kobject *kobj, struct kobj_attribute *attr,
+			     char *buf)
+{
+	struct snd_avirt_stats_obj *obj = to_stats_obj(kobj);
+	ssize_t count = 0;
+	unsigned int i;
+
+	for (i = 0; i < SND_AVIRT_LATENESS_BUCKETS; i++)
+		count += sprintf(buf + count, "%s%lld", i ? " " : "",
+				 (long long)atomic64_read(
+					 &obj->stats.lateness[i]));
+	count += sprintf(buf + count, "\n");
+
+	return count;
+}
+static struct kobj_attribute stats_attr_lateness = __ATTR_RO(lateness);
+
+/*
+ * CPU time is shown in microseconds per second since the counters were reset,
+ * which is the time in ns over the milliseconds elapsed
+ */
+static void stats_cpu_load(struct snd_avirt_stats_obj *obj, u64 *us_per_sec)
+{
+	atomic64_t *cpu = &obj->stats.count[SND_AVIRT_STAT_CPU_TIMER];
+	u64 ms = div_u64(ktime_get_ns() - READ_ONCE(obj->reset_ns),
+			 NSEC_PER_MSEC);
+	unsigned int i;
+
+	ms = max_t(u64, ms, 1);
+	for (i = 0; i < SND_AVIRT_STAT_CPU_COUNT; i++)
+		us_per_sec[i] += div64_u64(atomic64_read(&cpu[i]), ms);
+}
+
+void snd_avirt_stats_cpu(struct snd_avirt_stream *stream, u64 *us_per_sec)
+{
+	if (stream->stats)
+		stats_cpu_load(container_of(stream->stats,
+					    struct snd_avirt_stats_obj, stats),
+			       us_per_sec);
+}
+
+ssize_t snd_avirt_stats_cpu_print(char *buf, const u64 *us_per_sec)
+{
+	return sprintf(buf, "%llu %llu %llu %llu\n",
+		       (unsigned long long)us_per_sec[0],
+		       (unsigned long long)us_per_sec[1],
+		       (unsigned long long)us_per_sec[2],
+		       (unsigned long long)us_per_sec[3]);
+}
+
+static ssize_t cpu_us_per_sec_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	u64 us_per_sec[SND_AVIRT_STAT_CPU_COUNT] = { 0 };
+
+	stats_cpu_load(to_stats_obj(kobj), us_per_sec);
+	return snd_avirt_stats_cpu_print(buf, us_per_sec);
+}
+static struct kobj_attribute stats_attr_cpu_us_per_sec =
+	__ATTR_RO(cpu_us_per_sec);
+
+static ssize_t reset_store(struct kobject *kobj, struct kobj_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct snd_avirt_stats_obj *obj = to_stats_obj(kobj);
+	unsigned int i;
+
+	for (i = 0; i < SND_AVIRT_STAT_COUNT; i++)
+		atomic64_set(&obj->stats.count[i], 0);
+	for (i = 0; i < SND_AVIRT_LATENESS_BUCKETS; i++)
+		atomic64_set(&obj->stats.lateness[i], 0);
+	WRITE_ONCE(obj->reset_ns, ktime_get_ns());
+
+	return count;
+}
+static struct kobj_attribute stats_attr_reset = __ATTR_WO(reset);
+
+static struct attribute *snd_avirt_stats_attrs[] = {
+	&stats_attr_periods.attr,
+	&stats_attr_xruns.attr,
+	&stats_attr_bytes.attr,
+	&stats_attr_silence_bytes.attr,
+	&stats_attr_drift_corrections.attr,
+	&stats_attr_lateness.attr,
+	&stats_attr_cpu_us_per_sec.attr,
+	&stats_attr_reset.attr,
+	NULL,
+};
+
+static void snd_avirt_stats_release(struct kobject *kobj)
+{
+	kfree(to_stats_obj(kobj));
+}
+
+static struct kobj_type snd_avirt_stats_ktype = {
+	.sysfs_ops = &kobj_sysfs_ops,
+	.release = snd_avirt_stats_release,
+	.default_attrs = snd_avirt_stats_attrs,
+};
+
+int snd_avirt_stats_create(struct snd_avirt_stream *stream)
+{
+	struct snd_pcm *pcm = stream->pcm;
+	struct snd_avirt_stats_obj *obj;
+	unsigned int count = pcm->streams[SNDRV_PCM_STREAM_PLAYBACK]
+				     .substream_count +
+			     pcm->streams[SNDRV_PCM_STREAM_CAPTURE]
+				     .substream_count;
+	int err;
+
+	obj = kzalloc(sizeof(*obj) + count * sizeof(obj->timing[0]),
+		      GFP_KERNEL);
+	if (!obj)
+		return -ENOMEM;
+	obj->kobj.kset = snd_avirt_stats_kset;
+	obj->reset_ns = ktime_get_ns();
+
+	err = kobject_init_and_add(&obj->kobj, &snd_avirt_stats_ktype, NULL,
+				   "%s_%s",
+				   stream->direction ? "capture" : "playback",
+				   stream->name);
+	if (err) {
+		D_ERRORK("Cannot add statistics of stream %s", stream->name);
+		kobject_put(&obj->kobj);
+		return err;
+	}
+	kobject_uevent(&obj->kobj, KOBJ_ADD);
+	stream->stats = &obj->stats;
+
+	return 0;
+}
+
+void snd_avirt_stats_destroy(struct snd_avirt_stream *stream)
+{
+	struct snd_avirt_stats_obj *obj;
+
+	if (!stream->stats)
+		return;
+	obj = container_of(stream->stats, struct snd_avirt_stats_obj, stats);
+	stream->stats = NULL;
+	kobject_put(&obj->kobj);
+}
+
+int snd_avirt_stats_init(struct snd_avirt_core *core)
+{
+	snd_avirt_stats_kset =
+		kset_create_and_add("streams", NULL, &core->dev->kobj);
+	if (!snd_avirt_stats_kset)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void snd_avirt_stats_exit(struct snd_avirt_core *core)
+{
+	kset_unregister(snd_avirt_stats_kset);
+}